@@ -0,0 +1,194 @@
+/**
+ * ACPI tables
+ *
+ * Only as much as it takes to find the interrupt controllers: the RSDP is
+ * searched for where the BIOS leaves it, the RSDT it points to lists the
+ * other tables, and the MADT lists the processors' local APICs, the
+ * IO-APICs, and how ISA IRQs are wired to IO-APIC inputs. The tables are
+ * in RAM, which the kernel has identity mapped.
+ */
+
+#include <stddef.h>
+#include "arch_x86/acpi.h"
+#include "kernel/vmm.h"
+
+#define EBDA_SEGMENT_PTR  0x40E     // BIOS data area: real-mode segment of the EBDA
+#define BIOS_ROM_START    0xE0000
+#define BIOS_ROM_END      0x100000
+
+// MADT entry types
+#define MADT_LAPIC            0
+#define MADT_IOAPIC           1
+#define MADT_SOURCE_OVERRIDE  2
+
+#define MADT_LAPIC_ENABLED    0x01
+
+typedef struct __attribute__((packed)) rsdp {
+    char signature[8];          // "RSD PTR "
+    uint8_t checksum;           // of the first 20 bytes
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_addr;
+} rsdp_t;
+
+typedef struct __attribute__((packed)) sdt_header {
+    char signature[4];
+    uint32_t length;            // including the header
+    uint8_t revision;
+    uint8_t checksum;           // of the whole table
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} sdt_header_t;
+
+typedef struct __attribute__((packed)) madt {
+    sdt_header_t header;
+    uint32_t lapic_addr;
+    uint32_t flags;
+    uint8_t entries[];          // each starts with a type and a length byte
+} madt_t;
+
+typedef struct __attribute__((packed)) madt_lapic {
+    uint8_t type, length;
+    uint8_t acpi_id;
+    uint8_t apic_id;
+    uint32_t flags;
+} madt_lapic_t;
+
+typedef struct __attribute__((packed)) madt_ioapic {
+    uint8_t type, length;
+    uint8_t id;
+    uint8_t reserved;
+    uint32_t addr;
+    uint32_t gsi_base;
+} madt_ioapic_t;
+
+typedef struct __attribute__((packed)) madt_override {
+    uint8_t type, length;
+    uint8_t bus;                // 0: ISA
+    uint8_t irq;
+    uint32_t gsi;
+    uint16_t flags;
+} madt_override_t;
+
+static _Bool has_signature(const char* p, const char* sig, int n) {
+    for (int i = 0; i < n; i++) {
+        if (p[i] != sig[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// a table is valid if its bytes add up to 0
+static _Bool checksum_ok(const void* p, uint32_t size) {
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < size; i++) {
+        sum += ((const uint8_t*)p)[i];
+    }
+    return sum == 0;
+}
+
+// the RSDP is on a 16-byte boundary in [start, end)
+static rsdp_t* scan_rsdp(uint32_t start, uint32_t end) {
+    for (uint32_t p = start; p + sizeof(rsdp_t) <= end; p += 16) {
+        if (has_signature((char*)p, "RSD PTR ", 8) && checksum_ok((void*)p, sizeof(rsdp_t))) {
+            return (rsdp_t*)p;
+        }
+    }
+    return NULL;
+}
+
+// in the first KB of the EBDA, or in the BIOS ROM area
+static rsdp_t* find_rsdp() {
+    uint32_t ebda = *(uint16_t*)EBDA_SEGMENT_PTR << 4;
+    rsdp_t* rsdp = NULL;
+    if (ebda != 0) {
+        rsdp = scan_rsdp(ebda, ebda + 1024);
+    }
+    if (rsdp == NULL) {
+        rsdp = scan_rsdp(BIOS_ROM_START, BIOS_ROM_END);
+    }
+    return rsdp;
+}
+
+// tables past the identity-mapped memory are out of reach
+static sdt_header_t* map_table(uint32_t addr) {
+    if (addr == 0 || addr >= KSTACK_AREA) {
+        return NULL;
+    }
+    sdt_header_t* h = (sdt_header_t*)addr;
+    if (h->length < sizeof(sdt_header_t) || addr + h->length > KSTACK_AREA
+        || !checksum_ok(h, h->length)) {
+        return NULL;
+    }
+    return h;
+}
+
+static madt_t* find_madt() {
+    rsdp_t* rsdp = find_rsdp();
+    if (rsdp == NULL) {
+        return NULL;
+    }
+    sdt_header_t* rsdt = map_table(rsdp->rsdt_addr);
+    if (rsdt == NULL || !has_signature(rsdt->signature, "RSDT", 4)) {
+        return NULL;
+    }
+    uint32_t* tables = (uint32_t*)(rsdt + 1);
+    uint32_t n = (rsdt->length - sizeof(sdt_header_t)) / 4;
+    for (uint32_t i = 0; i < n; i++) {
+        sdt_header_t* h = map_table(tables[i]);
+        if (h != NULL && has_signature(h->signature, "APIC", 4)) {
+            return (madt_t*)h;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Find the MADT and fill in `info`. ISA IRQs without an override map to
+ * the GSI of the same number. Returns -1 if there is no MADT, or it lists
+ * no IO-APIC (then only the 8259s can deliver IRQs).
+ */
+int acpi_find_madt(madt_info_t* info) {
+    madt_t* madt = find_madt();
+    if (madt == NULL) {
+        return -1;
+    }
+
+    info->lapic_addr = madt->lapic_addr;
+    info->ioapic_addr = 0;
+    info->n_cpus = 0;
+    for (int irq = 0; irq < 16; irq++) {
+        info->irq_gsi[irq] = irq;
+        info->irq_flags[irq] = 0;
+    }
+
+    uint8_t* p = madt->entries;
+    uint8_t* end = (uint8_t*)madt + madt->header.length;
+    while (p + 2 <= end && p[1] >= 2 && p + p[1] <= end) {
+        if (p[0] == MADT_LAPIC) {
+            madt_lapic_t* e = (madt_lapic_t*)p;
+            if ((e->flags & MADT_LAPIC_ENABLED) && info->n_cpus < MAX_CPUS) {
+                info->cpu_apic_ids[info->n_cpus++] = e->apic_id;
+            }
+        } else if (p[0] == MADT_IOAPIC && info->ioapic_addr == 0) {
+            // a PC's ISA IRQs are all on the first IO-APIC
+            madt_ioapic_t* e = (madt_ioapic_t*)p;
+            info->ioapic_addr = e->addr;
+            info->ioapic_id = e->id;
+            info->ioapic_gsi_base = e->gsi_base;
+        } else if (p[0] == MADT_SOURCE_OVERRIDE) {
+            madt_override_t* e = (madt_override_t*)p;
+            if (e->bus == 0 && e->irq < 16) {
+                info->irq_gsi[e->irq] = e->gsi;
+                info->irq_flags[e->irq] = e->flags;
+            }
+        }
+        p += p[1];
+    }
+
+    return info->ioapic_addr != 0 ? 0 : -1;
+}
@@ -0,0 +1,76 @@
+;;;
+ ; Application Processor Startup
+ ;
+ ; A STARTUP IPI starts an application processor (AP) in real mode at a
+ ; page boundary below 1MB, so smp_init copies this code (ap_trampoline up
+ ; to ap_trampoline_end) to AP_TRAMPOLINE and fills in ap_params. The AP
+ ; loads the kernel's GDT, switches to protected mode, turns on paging
+ ; with the kernel's page directory, and calls ap_main(cpu) on its stack.
+ ;;
+
+AP_TRAMPOLINE   equ 0x1000          ; must match smp.c (SIPI vector 0x01)
+
+CR0_PE          equ 0x00000001
+CR0_WP          equ 0x00010000
+CR0_PG          equ 0x80000000
+CR4_PSE         equ 0x00000010
+CR4_PGE         equ 0x00000080
+
+; where a trampoline label ends up once copied
+%define TRAMPOLINE_ADDR(label) (AP_TRAMPOLINE + (label) - ap_trampoline)
+
+extern ap_main
+
+global ap_trampoline
+global ap_trampoline_end
+global ap_params
+
+section .text
+
+[bits 16]
+ap_trampoline:
+    cli
+    cld
+    mov     ax, cs                  ; cs = AP_TRAMPOLINE >> 4
+    mov     ds, ax
+    o32 lgdt [ap_params.gdtr - ap_trampoline]
+
+    mov     eax, cr0
+    or      eax, CR0_PE
+    mov     cr0, eax
+    jmp     dword 0x08:TRAMPOLINE_ADDR(ap_pmode)
+
+[bits 32]
+ap_pmode:
+    mov     ax, 0x10
+    mov     ds, ax
+    mov     es, ax
+    mov     fs, ax
+    mov     gs, ax
+    mov     ss, ax
+
+    ; paging as the boot CPU has it (see vmm_init)
+    mov     eax, [TRAMPOLINE_ADDR(ap_params.cr3)]
+    mov     cr3, eax
+    mov     eax, cr4
+    or      eax, CR4_PSE | CR4_PGE
+    mov     cr4, eax
+    mov     eax, cr0
+    or      eax, CR0_PG | CR0_WP
+    mov     cr0, eax
+
+    mov     esp, [TRAMPOLINE_ADDR(ap_params.stack)]
+    push    dword [TRAMPOLINE_ADDR(ap_params.cpu)]
+    mov     eax, ap_main            ; absolute: the kernel's copy of the code
+    call    eax
+    jmp     $
+
+; filled in by smp_init (the layout must match ap_params_t)
+align 4
+ap_params:
+.gdtr:  dw 0                        ; GDT limit
+        dd 0                        ; GDT base
+.cr3:   dd 0                        ; kernel page directory
+.stack: dd 0                        ; top of the AP's boot stack
+.cpu:   dd 0                        ; cpu index for ap_main
+ap_trampoline_end:
@@ -5,20 +5,82 @@
 
 [org 0x7C00]
 
+E820_COUNT   equ 0x500           ; number of entries (dword), read by the kernel's pmm
+E820_ENTRIES equ 0x504           ; 24-byte entries
+E820_MAX     equ 32
+
+KERNEL_LBA   equ 5
+%ifndef KERNEL_SECTORS           ; the kernel image's size (passed in by the Makefile)
+KERNEL_SECTORS equ 128
+%endif
+READ_CHUNK   equ 64              ; sectors per BIOS call (32KB)
+
     ;
-    ; load kernel (starts at sector 2 in 0-based = sector 3 in BIOS 1-based)
+    ; load kernel (starts at sector 5)
     ; Sector 0: boot sector
-    ; Sector 1: file table
-    ; Sector 2+: kernel
-    ;
-    mov    ah, 2                 ; INT 13,2 Read Disk Sectors
-    mov    al, 128               ; read n sectors
-    mov    ch, 0                 ; first track/cylinder
-    mov    cl, 3                 ; third sector (sector numbers are 1-based)
-    mov    dh, 0                 ; first head
+    ; Sector 1-4: file table
+    ; Sector 5+: kernel
+    ;
+    ; READ_CHUNK sectors at a time with INT 13,42 Extended Read (by LBA),
+    ; to 0x7E00 and up
+    ;
+read_next:
+    mov    ax, [sectors_left]
+    cmp    ax, READ_CHUNK
+    jbe    read_chunk
+    mov    ax, READ_CHUNK
+read_chunk:
+    mov    [dap.count], ax
+    mov    ah, 0x42              ; INT 13,42 Extended Read Sectors
     mov    dl, 0x80              ; drive number, 80h=drive 0
-    mov    bx, 0x7E00            ; es:bx = 0x0000:0x7E00 = 0x07E00
+    mov    si, dap               ; ds:si = disk address packet
     int    0x13
+    jc     disk_error            ; carry: the read failed
+    mov    ax, [dap.count]       ; sectors actually read
+    test   ax, ax
+    jz     disk_error
+    sub    [sectors_left], ax
+    jz     read_done
+    add    [dap.lba], ax
+    shl    ax, 5                 ; sectors -> paragraphs (512 / 16)
+    add    [dap.segment], ax
+    jmp    read_next
+read_done:
+
+    ;
+    ; collect the BIOS memory map (INT 15,E820) for the kernel
+    ;
+    xor    ebx, ebx              ; continuation value (0 = first entry)
+    xor    bp, bp                ; number of entries
+    mov    di, E820_ENTRIES      ; es:di = entry buffer
+e820_next:
+    mov    eax, 0xE820
+    mov    edx, 0x534D4150       ; 'SMAP'
+    mov    ecx, 24
+    mov    dword [di + 20], 1    ; ACPI 3.x attributes: valid unless the BIOS says otherwise
+    int    0x15
+    jc     e820_done             ; carry: no more entries (or not supported)
+    cmp    eax, 0x534D4150
+    jne    e820_done
+    jcxz   e820_skip             ; empty entry
+    inc    bp
+    add    di, 24
+e820_skip:
+    test   ebx, ebx              ; ebx = 0: that was the last entry
+    jz     e820_done
+    cmp    bp, E820_MAX
+    jb     e820_next
+e820_done:
+    mov    [E820_COUNT], bp
+    mov    word [E820_COUNT + 2], 0
+
+    ;
+    ; enable the A20 line (fast A20 gate) so memory above 1MB is usable
+    ;
+    in     al, 0x92
+    or     al, 2
+    and    al, 0xFE              ; don't trigger a reset
+    out    0x92, al
 
     ;
     ; switch to protected mode
@@ -50,8 +112,45 @@ pm_entry:
 
 
 [bits 16]
+    ;
+    ; the kernel couldn't be loaded: say so and stop
+    ;
+disk_error:
+    mov    si, disk_error_msg
+    cld
+    xor    bx, bx                ; page 0
+print_next:
+    lodsb
+    test   al, al
+    jz     stop
+    mov    ah, 0x0E              ; INT 10,E Teletype Output
+    int    0x10
+    jmp    print_next
+stop:
+    cli
+    hlt
+    jmp    stop
+
+disk_error_msg:
+    db     "Disk read error", 0
+
 %include "src/arch_x86/gdt.asm"
 
+sectors_left:
+    dw     KERNEL_SECTORS
+
+; disk address packet for INT 13,42
+dap:
+    db     16, 0                 ; packet size, reserved
+.count:
+    dw     0                     ; sectors to read
+    dw     0                     ; buffer offset
+.segment:
+    dw     0x07E0                ; buffer segment (0x07E0:0 = 0x07E00)
+.lba:
+    dd     KERNEL_LBA            ; first sector (64-bit LBA)
+    dd     0
+
     ;
     ; pad with zeros; set boot sector magic number
     ;
@@ -18,3 +18,67 @@ void halt() {
             "hlt");
     }
 }
+
+/**
+ * Read the CPU's time-stamp counter.
+ */
+uint64_t rdtsc() {
+    uint64_t tsc;
+    asm volatile("rdtsc" : "=A"(tsc));
+    return tsc;
+}
+
+/**
+ * Read CR2: the linear address that caused the last page fault.
+ */
+uint32_t read_cr2() {
+    uint32_t cr2;
+    asm volatile("mov %0, cr2" : "=r"(cr2));
+    return cr2;
+}
+
+/**
+ * Check the interrupt flag (IF) in EFLAGS.
+ */
+_Bool interrupts_enabled() {
+    uint32_t eflags;
+    asm volatile("pushfd \n"
+                 "pop %0"
+                 : "=r"(eflags));
+    return (eflags & 0x200) != 0;
+}
+
+/**
+ * Disable interrupts and return the previous EFLAGS, to be handed back to
+ * restore_interrupts (so nested critical sections don't enable early).
+ */
+uint32_t save_and_disable_interrupts() {
+    uint32_t eflags;
+    asm volatile("pushfd \n"
+                 "pop %0 \n"
+                 "cli"
+                 : "=r"(eflags) : : "memory");
+    return eflags;
+}
+
+void restore_interrupts(uint32_t eflags) {
+    if (eflags & 0x200) {
+        asm volatile("sti" : : : "memory");
+    }
+}
+
+/**
+ * Run CPUID for `leaf`: regs gets eax, ebx, ecx and edx.
+ */
+void cpuid(uint32_t leaf, uint32_t regs[4]) {
+    asm volatile("cpuid"
+                 : "=a"(regs[0]), "=b"(regs[1]), "=c"(regs[2]), "=d"(regs[3])
+                 : "a"(leaf), "c"(0));
+}
+
+/**
+ * Write a model-specific register.
+ */
+void wrmsr(uint32_t msr, uint64_t value) {
+    asm volatile("wrmsr" : : "c"(msr), "A"(value));
+}
@@ -4,6 +4,7 @@
 
 #include <stdint.h>
 #include <arch_x86/tss.h>
+#include "arch_x86/acpi.h"
 #include "arch_x86/gdt.h"
 
 typedef union {
@@ -60,10 +61,15 @@ typedef union {
     };
 } seg_desc_t;
 
-static seg_desc_t gdt[16];
-static tss_desc_t tss;
+static seg_desc_t gdt[FIRST_CPU_TSS_SLOT + MAX_CPUS];
+static tss_desc_t tss[MAX_CPUS];   // one per CPU, found through its task register
+static uint32_t sysenter_stack[MAX_CPUS][256];  // see sysenter_stack_top
 static uint8_t kstack[1024];
 
+// the double fault task: its own TSS and stack (see gdt_set_double_fault_task)
+static tss_desc_t df_tss;
+static uint8_t df_stack[1024] __attribute__((aligned(16)));
+
 static struct __attribute__((packed)) {
     uint16_t limit;
     void*    base;
@@ -120,22 +126,90 @@ void gdt_init() {
     set_code_seg(&gdt[3], 0x0, 0xfffff, 3);
     set_data_seg(&gdt[4], 0x0, 0xfffff, 3);
 
-    // set task state segment (TSS)
-    tss.ss0 = 0x10;
-    tss.esp0 = (uint32_t)(kstack + sizeof(kstack));
-    set_tss_seg(&gdt[5], (uint32_t)&tss, sizeof(tss) - 1, 3);
+    // set a task state segment (TSS) for each CPU
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        tss[cpu].ss0 = 0x10;
+        set_tss_seg(&gdt[CPU_TSS_SEL(cpu) / 8], (uint32_t)&tss[cpu], sizeof(tss[cpu]) - 1, 3);
+    }
+    tss[0].esp0 = (uint32_t)(kstack + sizeof(kstack));
+    set_tss_seg(&gdt[DOUBLE_FAULT_TSS_SEL / 8], (uint32_t)&df_tss, sizeof(df_tss) - 1, 0);
 
-    gdt_desc.limit = (sizeof(seg_desc_t) * 6) - 1;
+    gdt_desc.limit = sizeof(gdt) - 1;
     gdt_desc.base = gdt;
 
     // load GDT descriptor into CPU
     asm("lgdt %0" : : "m"(gdt_desc));
 
-    // load TSS selector into Task Register
-    asm("mov ax, (5 * 8) | 0 \n" // TSS selector with RPL 0
-        "ltr ax");
+    // load the boot CPU's TSS selector into Task Register
+    asm volatile("ltr %0" : : "r"((uint16_t)CPU_TSS_SEL(0)));
+}
+
+/**
+ * Load an application processor's TSS (the AP startup code has loaded
+ * the GDT already).
+ */
+void gdt_init_ap(uint32_t cpu) {
+    asm volatile("ltr %0" : : "r"((uint16_t)CPU_TSS_SEL(cpu)));
+}
+
+/**
+ * The index of the CPU we're running on, told by the TSS in its task
+ * register. In the double fault task, it's the CPU whose task the fault
+ * interrupted. Before gdt_init loads a TSS, it's the boot CPU.
+ */
+uint32_t cpu_id() {
+    uint16_t sel;
+    asm volatile("str %0" : "=r"(sel));
+    if (sel == 0) {
+        return 0;
+    }
+    if (sel == DOUBLE_FAULT_TSS_SEL) {
+        sel = df_tss.prev_tss;
+    }
+    return sel / 8 - FIRST_CPU_TSS_SLOT;
 }
 
 void tss_set_kernel_stack(uint32_t esp0) {
-    tss.esp0 = esp0;
+    uint32_t cpu = cpu_id();
+    tss[cpu].esp0 = esp0;
+    sysenter_stack[cpu][255] = esp0;
+}
+
+/**
+ * Where SYSENTER starts a CPU's kernel stack pointer (see syscall.c): at
+ * a copy of its TSS.esp0, the top word of a small stack. The entry's
+ * first instruction loads esp0 from there; the stack below only ever
+ * takes a single-step trap or an NMI on that instruction (see isr01).
+ */
+uint32_t sysenter_stack_top(uint32_t cpu) {
+    return (uint32_t)&sysenter_stack[cpu][255];
+}
+
+/**
+ * Set up the task that the double fault vector switches to (a task gate,
+ * see exceptions_init). It has a stack of its own: a kernel stack
+ * overflow runs into the guard page below the stack, and the CPU then
+ * can't even push the page fault's frame, so only a task switch gets a
+ * handler running. The task runs in the current address space (paging
+ * must be on) with interrupts off.
+ */
+void gdt_set_double_fault_task(void (*handler)(void)) {
+    uint32_t cr3;
+    asm volatile("mov %0, cr3" : "=r"(cr3));
+
+    df_tss.cr3 = cr3;
+    df_tss.eip = (uint32_t)handler;
+    df_tss.eflags = 0x2;
+    df_tss.esp = (uint32_t)(df_stack + sizeof(df_stack));
+    df_tss.cs = 0x08;
+    df_tss.ss = df_tss.ds = df_tss.es = df_tss.fs = df_tss.gs = 0x10;
+    df_tss.iomap_base = sizeof(df_tss);
+}
+
+/**
+ * The stack pointer of the task interrupted by a double fault, as saved
+ * by the task switch.
+ */
+uint32_t tss_interrupted_esp() {
+    return tss[cpu_id()].esp;
 }
@@ -35,6 +35,11 @@ void idt_init() {
     asm("lidt %0" : : "m"(idt_desc));
 }
 
+// load the (shared) IDT on an application processor
+void idt_load() {
+    asm("lidt %0" : : "m"(idt_desc));
+}
+
 void idt_set(uint8_t vector, isr_t handler) {
     idt[vector].segment_sel = 0x08; // code segment
     idt[vector].offset_lo = (uint32_t)handler & 0xffff;
@@ -43,3 +48,25 @@ void idt_set(uint8_t vector, isr_t handler) {
     idt[vector].dpl = 0; // privilege level
     idt[vector].present = 1;
 }
+
+/**
+ * Like idt_set, but the gate can also be used by an INT instruction in
+ * ring 3 (for system calls).
+ */
+void idt_set_user(uint8_t vector, isr_t handler) {
+    idt_set(vector, handler);
+    idt[vector].dpl = 3;
+}
+
+/**
+ * Install a task gate: the vector switches to the task whose TSS has the
+ * GDT selector `tss_sel`.
+ */
+void idt_set_task_gate(uint8_t vector, uint16_t tss_sel) {
+    idt[vector].segment_sel = tss_sel;
+    idt[vector].offset_lo = 0;
+    idt[vector].offset_hi = 0;
+    idt[vector].gate_type = TASK_GATE;
+    idt[vector].dpl = 0;
+    idt[vector].present = 1;
+}
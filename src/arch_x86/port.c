@@ -2,6 +2,7 @@
  * I/O Ports
  */
 
+#include <stddef.h>
 #include <stdint.h>
 
 void port_out8(uint16_t port, uint8_t byte) {
@@ -16,6 +17,12 @@ void port_out16(uint16_t port, uint16_t word) {
         : "Nd"(port), "a"(word));
 }
 
+void port_out32(uint16_t port, uint32_t dword) {
+    asm("out dx, eax"
+        : // no output data
+        : "Nd"(port), "a"(dword));
+}
+
 uint8_t port_in8(uint16_t port) {
     uint8_t byte;
     asm("in al, dx"
@@ -31,3 +38,18 @@ uint16_t port_in16(uint16_t port) {
         : "Nd"(port));
     return word;
 }
+
+uint32_t port_in32(uint16_t port) {
+    uint32_t dword;
+    asm("in eax, dx"
+        : "=a"(dword)
+        : "Nd"(port));
+    return dword;
+}
+
+void port_in16_rep(uint16_t port, void* buf, size_t count) {
+    asm volatile("rep insw"
+        : "+D"(buf), "+c"(count)
+        : "d"(port)
+        : "memory");
+}
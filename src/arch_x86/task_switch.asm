@@ -13,6 +13,7 @@ endstruc
 section .text
 
 global resume_new_task
+global user_exit
 
 ; resume_new_task(task_t* task)
 ; Used to start the first task from kmain. Loads the task's esp and
@@ -29,3 +30,16 @@ resume_new_task:
     popa
     add     esp, 0x8                      ; pop int_no and error_code
     iret
+
+; user_exit
+; Return address of a spawned user task's entry point (runs in ring 3, so
+; it lives in the user-accessible .utext section). Ends the task through
+; the exit system call, with the entry point's return value as the exit
+; code.
+section .utext progbits alloc exec nowrite align=16
+
+user_exit:
+    mov     ebx, eax                      ; exit code
+    mov     eax, 0                        ; SYS_EXIT
+    int     0x80
+    jmp     $
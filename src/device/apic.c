@@ -0,0 +1,244 @@
+/**
+ * Local APIC and IO-APIC
+ *
+ * The IO-APIC takes the ISA IRQs (wired as the ACPI MADT says) and sends
+ * them to the local APIC as messages, vector IRQ_BASE_VECTOR + IRQ, like
+ * the 8259s deliver them. Acknowledging one is a single write to the
+ * memory-mapped EOI register, instead of one or two port writes to the
+ * 8259s. The local APIC's timer is calibrated against the PIT at boot
+ * (along with the TSC) and can then stand in for the PIT as the
+ * scheduler's tick. Both APICs are uncached MMIO in the top gigabyte (see
+ * vmm_map_mmio).
+ *
+ * The local APICs also carry interprocessor interrupts (IPIs): the INIT
+ * and STARTUP messages that wake the other CPUs (see smp.c), and the
+ * CPUs' nudges to each other.
+ */
+
+#include <stddef.h>
+#include "arch_x86/acpi.h"
+#include "arch_x86/cpu.h"
+#include "arch_x86/idt.h"
+#include "device/apic.h"
+#include "device/console.h"
+#include "device/pic.h"
+#include "device/pit.h"
+#include "kernel/vmm.h"
+#include "lib/util.h"
+
+// local APIC registers (byte offsets)
+#define LAPIC_ID            0x020
+#define LAPIC_TPR           0x080
+#define LAPIC_EOI           0x0B0
+#define LAPIC_SVR           0x0F0
+#define LAPIC_ICR_LOW       0x300
+#define LAPIC_ICR_HIGH      0x310
+#define LAPIC_LVT_TIMER     0x320
+#define LAPIC_TIMER_INIT    0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIV     0x3E0
+
+#define LAPIC_SVR_ENABLE    0x100
+#define LVT_MASKED          0x10000
+#define LVT_TIMER_PERIODIC  0x20000
+#define TIMER_DIV_16        0x3
+
+// interrupt command register (low half)
+#define ICR_INIT            0x500
+#define ICR_STARTUP         0x600
+#define ICR_PENDING         0x1000  // delivery status: not accepted yet
+#define ICR_ASSERT          0x4000
+
+// IO-APIC registers: select one through IOREGSEL, access it through IOWIN
+#define IOAPIC_IOREGSEL     0x00
+#define IOAPIC_IOWIN        0x10
+#define IOAPIC_VER          0x01
+#define IOAPIC_REDTBL       0x10    // two registers per input
+
+#define IOAPIC_ACTIVE_LOW   0x2000
+#define IOAPIC_LEVEL        0x8000
+#define IOAPIC_MASKED       0x10000
+
+#define CALIBRATE_US        10000   // time the APIC timer and TSC over 10 ms
+
+extern isr_t isr48;
+extern isr_t isr255;
+
+static volatile uint32_t* lapic = NULL;
+static volatile uint32_t* ioapic = NULL;
+static madt_info_t madt;
+static uint32_t timer_hz;
+static uint64_t cpu_tsc_hz;
+
+static uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4];
+}
+
+static void lapic_write(uint32_t reg, uint32_t value) {
+    lapic[reg / 4] = value;
+}
+
+static uint32_t ioapic_read(uint8_t reg) {
+    ioapic[IOAPIC_IOREGSEL / 4] = reg;
+    return ioapic[IOAPIC_IOWIN / 4];
+}
+
+static void ioapic_write(uint8_t reg, uint32_t value) {
+    ioapic[IOAPIC_IOREGSEL / 4] = reg;
+    ioapic[IOAPIC_IOWIN / 4] = value;
+}
+
+uint32_t lapic_id() {
+    return lapic_read(LAPIC_ID) >> 24;
+}
+
+void lapic_eoi() {
+    lapic_write(LAPIC_EOI, 0);
+}
+
+// send an IPI and wait for the target's local APIC to accept it
+static void lapic_send(uint32_t apic_id, uint32_t command) {
+    lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, command);
+    while (lapic_read(LAPIC_ICR_LOW) & ICR_PENDING) {
+        asm volatile("pause");
+    }
+}
+
+// interrupt the CPU with local APIC `apic_id` at `vector`
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector) {
+    lapic_send(apic_id, ICR_ASSERT | vector);
+}
+
+// reset a CPU into its wait-for-SIPI state
+void lapic_send_init(uint32_t apic_id) {
+    lapic_send(apic_id, ICR_INIT | ICR_ASSERT);
+}
+
+// start a waiting CPU in real mode at address `page` << 12
+void lapic_send_startup(uint32_t apic_id, uint8_t page) {
+    lapic_send(apic_id, ICR_STARTUP | ICR_ASSERT | page);
+}
+
+/**
+ * Route ISA IRQ `irq` to this CPU at vector IRQ_BASE_VECTOR + irq, with
+ * the polarity and trigger mode the MADT gives it, or mask it.
+ */
+void ioapic_set_irq(uint8_t irq, _Bool enabled) {
+    if (ioapic == NULL || irq >= 16) {
+        return;
+    }
+    uint32_t pin = madt.irq_gsi[irq] - madt.ioapic_gsi_base;
+    uint16_t flags = madt.irq_flags[irq];
+
+    uint32_t entry = IRQ_BASE_VECTOR + irq;
+    if ((flags & INTI_POLARITY_MASK) == INTI_ACTIVE_LOW) {
+        entry |= IOAPIC_ACTIVE_LOW;
+    }
+    if ((flags & INTI_TRIGGER_MASK) == INTI_LEVEL) {
+        entry |= IOAPIC_LEVEL;
+    }
+    if (!enabled) {
+        entry |= IOAPIC_MASKED;
+    }
+    ioapic_write(IOAPIC_REDTBL + 2 * pin + 1, lapic_id() << 24);
+    ioapic_write(IOAPIC_REDTBL + 2 * pin, entry);
+}
+
+/**
+ * Start the local APIC timer: it interrupts at LAPIC_TIMER_VECTOR after
+ * `count` periods (of lapic_timer_hz), and again every `count` periods if
+ * `periodic`.
+ */
+void lapic_timer_start(uint32_t count, _Bool periodic) {
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_VECTOR | (periodic ? LVT_TIMER_PERIODIC : 0));
+    lapic_write(LAPIC_TIMER_INIT, count);
+}
+
+void lapic_timer_stop() {
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_VECTOR | LVT_MASKED);
+    lapic_write(LAPIC_TIMER_INIT, 0);
+}
+
+// periods left until the timer fires (0 once a one-shot has)
+uint32_t lapic_timer_count() {
+    return lapic_read(LAPIC_TIMER_CURRENT);
+}
+
+uint32_t lapic_timer_hz() {
+    return timer_hz;
+}
+
+uint64_t tsc_hz() {
+    return cpu_tsc_hz;
+}
+
+// count APIC timer periods and TSC cycles over CALIBRATE_US of the PIT
+static void calibrate() {
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_VECTOR | LVT_MASKED);
+    lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+    uint64_t start = rdtsc();
+    pit_wait(CALIBRATE_US);
+    uint64_t cycles = rdtsc() - start;
+    uint32_t periods = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CURRENT);
+    lapic_write(LAPIC_TIMER_INIT, 0);
+
+    timer_hz = periods * (1000000 / CALIBRATE_US);
+    cpu_tsc_hz = cycles * (1000000 / CALIBRATE_US);
+}
+
+// what the MADT said (valid once apic_init has succeeded)
+const madt_info_t* apic_madt() {
+    return &madt;
+}
+
+/**
+ * Enable an application processor's local APIC, with its timer ticking
+ * at TIMER_HZ (calibrated on the boot CPU: the timers run at the same
+ * rate).
+ */
+void lapic_init_ap() {
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+    lapic_write(LAPIC_TIMER_DIV, TIMER_DIV_16);
+    lapic_timer_start(timer_hz / TIMER_HZ, 1);
+}
+
+/**
+ * Find the APICs through the ACPI MADT, enable this CPU's local APIC,
+ * mask every IO-APIC input, and calibrate the APIC timer. Returns -1 (and
+ * leaves the 8259s in charge) if there is no MADT or IO-APIC. Call it
+ * during boot, with interrupts off; irq_use_apic then switches over.
+ */
+int apic_init() {
+    if (acpi_find_madt(&madt) != 0) {
+        print("APIC: no MADT, using the 8259 PICs\n");
+        return -1;
+    }
+    vmm_map_mmio(madt.lapic_addr, PAGE_SIZE);
+    vmm_map_mmio(madt.ioapic_addr, PAGE_SIZE);
+    lapic = (volatile uint32_t*)madt.lapic_addr;
+    ioapic = (volatile uint32_t*)madt.ioapic_addr;
+
+    idt_set(LAPIC_TIMER_VECTOR, &isr48);
+    idt_set(LAPIC_SPURIOUS_VECTOR, &isr255);
+
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+    lapic_write(LAPIC_TIMER_DIV, TIMER_DIV_16);
+    calibrate();
+
+    uint32_t inputs = ((ioapic_read(IOAPIC_VER) >> 16) & 0xFF) + 1;
+    for (uint32_t pin = 0; pin < inputs; pin++) {
+        ioapic_write(IOAPIC_REDTBL + 2 * pin, IOAPIC_MASKED);
+    }
+
+    print("APIC: ");
+    print_dec32(madt.n_cpus);
+    print(" CPU(s), timer ");
+    print_dec32(timer_hz / 1000);
+    print(" kHz, TSC ");
+    print_dec32((uint32_t)udiv64(cpu_tsc_hz, 1000000));
+    print(" MHz\n");
+    return 0;
+}
@@ -4,9 +4,17 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include "arch_x86/cpu.h"
 #include "arch_x86/port.h"
+#include "device/ata.h"
+#include "device/pci.h"
+#include "device/pic.h"
+#include "kernel/event.h"
+#include "kernel/vmm.h"
 
 #define ATA0_BASE         0x1F0
+#define ATA0_CTRL         0x3F6
+#define ATA0_IRQ          14
 
 #define REG_DATA          0
 #define REG_ERROR         1
@@ -22,11 +30,48 @@
 #define FLAG_LBA          0b01000000
 #define FLAG_DRV1         0b00010000
 
-#define CMD_READ_SECTORS  0x20
+#define CTRL_NIEN         0b00000010
+
+#define CMD_READ_SECTORS      0x20
+#define CMD_READ_SECTORS_EXT  0x24
+#define CMD_READ_DMA_EXT      0x25
+#define CMD_READ_MULTIPLE_EXT 0x29
+#define CMD_READ_MULTIPLE     0xC4
+#define CMD_SET_MULTIPLE      0xC6
+#define CMD_READ_DMA          0xC8
+#define CMD_IDENTIFY          0xEC
 #define STATUS_BUSY       0x80
 #define STATUS_DRQ        0x08
 #define STATUS_ERR        0x01
 
+#define LBA28_MAX         0x0FFFFFFF
+#define LBA28_MAX_COUNT   256    // sector count register value 0
+#define LBA48_MAX_COUNT   65536  // sector count register pair value 0
+
+// IDENTIFY DEVICE data (word offsets)
+#define ID_MAX_MULTIPLE   47
+#define ID_SECTORS_28     60
+#define ID_FEATURES_83    83
+#define ID_SECTORS_48     100
+
+#define ID_83_LBA48       (1 << 10)
+
+#define MULTIPLE_MAX      16     // sectors per DRQ block we ask for
+
+// Bus master IDE registers (primary channel, offsets from PCI BAR4)
+#define BM_COMMAND        0
+#define BM_STATUS         2
+#define BM_PRDT           4
+
+#define BM_CMD_START      0x01
+#define BM_CMD_READ       0x08  // transfer direction: device to memory
+#define BM_STATUS_ERROR   0x02
+#define BM_STATUS_IRQ     0x04
+
+#define PRD_EOT           0x8000
+#define PRD_MAX_ENTRIES   16
+#define DMA_MAX_SECTORS   1024   // 512KB; at most 9 PRDs even when unaligned
+
 // #define ERR_NOTHING       0x01
 // #define ERR_FORMATTER_DEV 0x02
 // #define ERR_SECTOR_BUF    0x03
@@ -53,6 +98,48 @@
 //     }
 // }
 
+/**
+ * Physical Region Descriptor: one contiguous chunk of a DMA transfer.
+ * A region may not cross a 64KB boundary; a byte count of 0 means 64KB.
+ */
+typedef struct prd {
+    uint32_t addr;
+    uint16_t byte_count;
+    uint16_t flags;
+} __attribute__((packed)) prd_t;
+
+/**
+ * The in-flight interrupt-driven read (there is at most one). For PIO the
+ * IRQ handler moves one DRQ block (`block` sectors) into `buf` per
+ * interrupt; for DMA the controller fills the buffer and raises a single
+ * interrupt at the end. Either way, once `remaining` drops to zero the
+ * caller's completion record is filled in and `request_done` is signalled.
+ */
+typedef struct ata_request {
+    uint16_t* buf;
+    size_t count;
+    size_t block;
+    size_t remaining;
+    size_t read_count;
+    int dma;
+    int error;
+    ata_async_t* async;
+} ata_request_t;
+
+static volatile ata_request_t request;
+static event_t* request_done;
+static ata_mode_t mode = ATA_MODE_POLL;
+static ata_stats_t stats;
+
+// the table is aligned to its own size, so it never crosses a 64KB boundary
+static prd_t prdt[PRD_MAX_ENTRIES] __attribute__((aligned(sizeof(prd_t) * PRD_MAX_ENTRIES)));
+static uint16_t bm_base = 0;
+
+// drive capabilities, from IDENTIFY DEVICE
+static _Bool lba48 = 0;
+static size_t multiple = 1;   // sectors per DRQ block (READ MULTIPLE)
+static uint32_t total_sectors = 0;
+
 void wait_on_busy() {
     uint8_t busy = port_in8(ATA0_BASE + REG_STATUS) & STATUS_BUSY;
     while (busy) {
@@ -61,7 +148,7 @@ void wait_on_busy() {
     };
 }
 
-int read_sectors(uint32_t start, size_t count, uint32_t* dest) {
+static void send_command_28(uint32_t start, size_t count, uint8_t command) {
     wait_on_busy();
 
     // send LBA block address
@@ -72,12 +159,61 @@ int read_sectors(uint32_t start, size_t count, uint32_t* dest) {
     // send sector count
     port_out8(ATA0_BASE + REG_SECTOR_COUNT, count);
     // send command
-    port_out8(ATA0_BASE + REG_COMMAND, CMD_READ_SECTORS);
+    port_out8(ATA0_BASE + REG_COMMAND, command);
+}
 
-    // read sectors
+/**
+ * 48-bit LBA variant: the count and LBA registers are two bytes deep, so the
+ * high-order bytes are written first, followed by the low-order bytes.
+ */
+static void send_command_48(uint32_t start, size_t count, uint8_t command) {
+    wait_on_busy();
+
+    port_out8(ATA0_BASE + REG_LBA_24, FLAG_LBA);  // drive 0, LBA mode
+
+    port_out8(ATA0_BASE + REG_SECTOR_COUNT, (uint8_t)(count >> 8));
+    port_out8(ATA0_BASE + REG_LBA_00, (uint8_t)(start >> 24));
+    port_out8(ATA0_BASE + REG_LBA_08, 0);         // LBA bits 32-39
+    port_out8(ATA0_BASE + REG_LBA_16, 0);         // LBA bits 40-47
+
+    port_out8(ATA0_BASE + REG_SECTOR_COUNT, (uint8_t)count);
+    port_out8(ATA0_BASE + REG_LBA_00, (uint8_t)start);
+    port_out8(ATA0_BASE + REG_LBA_08, (uint8_t)(start >> 8));
+    port_out8(ATA0_BASE + REG_LBA_16, (uint8_t)(start >> 16));
+
+    port_out8(ATA0_BASE + REG_COMMAND, command);
+}
+
+/**
+ * Issue a read, using the 48-bit form of the command when the range or the
+ * count doesn't fit the 28-bit registers.
+ */
+static void send_command(uint32_t start, size_t count, uint8_t command_28, uint8_t command_48) {
+    if (lba48 && (start + count > LBA28_MAX || count > LBA28_MAX_COUNT)) {
+        send_command_48(start, count, command_48);
+    } else {
+        send_command_28(start, count, command_28);
+    }
+}
+
+static void send_pio_read(uint32_t start, size_t count) {
+    if (multiple > 1) {
+        send_command(start, count, CMD_READ_MULTIPLE, CMD_READ_MULTIPLE_EXT);
+    } else {
+        send_command(start, count, CMD_READ_SECTORS, CMD_READ_SECTORS_EXT);
+    }
+}
+
+static int read_sectors_poll(uint32_t start, size_t count, uint32_t* dest) {
+    uint64_t start_tsc = rdtsc();
+
+    send_pio_read(start, count);
+    stats.commands++;
+
+    // read sectors, one DRQ block (up to `multiple` sectors) at a time
     size_t read_count = 0;
     uint16_t* ptr = (uint16_t*)dest;
-    for (int c = 0; c < count; c++) {
+    while (read_count < count) {
         wait_on_busy();
 
         uint8_t status = port_in8(ATA0_BASE + REG_STATUS);
@@ -89,12 +225,371 @@ int read_sectors(uint32_t start, size_t count, uint32_t* dest) {
             // this shouldn't happen; we may handle this differently later
             break;
         }
-        // read sector's data in 16-bit words
-        for (int i = 0; i < 256; i++, ptr++) {
-            *ptr = port_in16(ATA0_BASE + REG_DATA);
+        size_t n = count - read_count;
+        if (n > multiple) {
+            n = multiple;
+        }
+        port_in16_rep(ATA0_BASE + REG_DATA, ptr, n * 256);
+        ptr += n * 256;
+        read_count += n;
+    }
+
+    stats.sectors += read_count;
+    stats.cpu_cycles += rdtsc() - start_tsc;
+    return read_count;
+}
+
+static void begin_request(size_t count, uint32_t* dest, int dma, ata_async_t* async) {
+    request.buf = (uint16_t*)dest;
+    request.count = count;
+    request.block = multiple;
+    request.read_count = 0;
+    request.dma = dma;
+    request.error = 0;
+    request.async = async;
+    request.remaining = count;
+    reset_event(request_done);
+}
+
+/**
+ * Called from the IRQ handler once the in-flight request is over.
+ */
+static void end_request() {
+    request.remaining = 0;
+    request.async->read_count = request.read_count;
+    request.async->done = 1;
+    stats.sectors += request.read_count;
+    set_event(request_done);
+}
+
+static void start_irq(uint32_t start, size_t count, uint32_t* dest, ata_async_t* async) {
+    uint64_t start_tsc = rdtsc();
+
+    begin_request(count, dest, 0, async);
+    send_pio_read(start, count);
+
+    stats.commands++;
+    stats.cpu_cycles += rdtsc() - start_tsc;
+}
+
+/**
+ * Describe `bytes` of the (physical) buffer at `dest` in the PRD table.
+ * Returns the number of entries used, or 0 if the table is too small.
+ */
+static int build_prdt(void* dest, size_t bytes) {
+    uint32_t addr = (uint32_t)dest;
+    int n = 0;
+
+    while (bytes > 0) {
+        if (n == PRD_MAX_ENTRIES) {
+            return 0;
+        }
+        uint32_t chunk = 0x10000 - (addr & 0xffff);
+        if (chunk > bytes) {
+            chunk = bytes;
+        }
+        prdt[n].addr = addr;
+        prdt[n].byte_count = (uint16_t)chunk;
+        prdt[n].flags = 0;
+
+        addr += chunk;
+        bytes -= chunk;
+        n++;
+    }
+    prdt[n - 1].flags = PRD_EOT;
+
+    return n;
+}
+
+/**
+ * Whether the bus master can write `count` sectors to `dest`: it takes
+ * physical addresses, so the buffer must lie in the identity-mapped part
+ * of kernel space (not on a kernel stack at KSTACK_AREA, or in user
+ * space), and be word aligned.
+ */
+static _Bool dma_reachable(uint32_t* dest, size_t count) {
+    uint32_t addr = (uint32_t)dest;
+    return (addr & 1) == 0 && addr < KSTACK_AREA && count * 512 <= KSTACK_AREA - addr;
+}
+
+static _Bool start_dma(uint32_t start, size_t count, uint32_t* dest, ata_async_t* async) {
+    uint64_t start_tsc = rdtsc();
+
+    if (!build_prdt(dest, count * 512)) {
+        return 0;
+    }
+
+    begin_request(count, dest, 1, async);
+
+    // stop the engine, point it at the PRD table and clear stale status bits
+    // (ERROR and IRQ are write-1-to-clear)
+    port_out8(bm_base + BM_COMMAND, BM_CMD_READ);
+    port_out32(bm_base + BM_PRDT, (uint32_t)prdt);
+    port_out8(bm_base + BM_STATUS, port_in8(bm_base + BM_STATUS) | BM_STATUS_ERROR | BM_STATUS_IRQ);
+
+    send_command(start, count, CMD_READ_DMA, CMD_READ_DMA_EXT);
+    port_out8(bm_base + BM_COMMAND, BM_CMD_READ | BM_CMD_START);
+
+    stats.commands++;
+    stats.cpu_cycles += rdtsc() - start_tsc;
+    return 1;
+}
+
+static void complete_pio_block() {
+    uint8_t status = port_in8(ATA0_BASE + REG_STATUS);
+
+    if ((status & STATUS_ERR) || (status & STATUS_DRQ) == 0) {
+        request.error = 1;
+        end_request();
+        return;
+    }
+
+    size_t n = request.remaining;
+    if (n > request.block) {
+        n = request.block;
+    }
+    port_in16_rep(ATA0_BASE + REG_DATA, request.buf, n * 256);
+    request.buf += n * 256;
+    request.read_count += n;
+    request.remaining -= n;
+
+    if (request.remaining == 0) {
+        end_request();
+    }
+}
+
+static void complete_dma() {
+    uint8_t bm_status = port_in8(bm_base + BM_STATUS);
+    if ((bm_status & BM_STATUS_IRQ) == 0) {
+        // not raised by our channel
+        return;
+    }
+
+    port_out8(bm_base + BM_COMMAND, BM_CMD_READ);  // stop the engine
+    uint8_t status = port_in8(ATA0_BASE + REG_STATUS);
+    port_out8(bm_base + BM_STATUS, bm_status | BM_STATUS_ERROR | BM_STATUS_IRQ);
+
+    request.error = (bm_status & BM_STATUS_ERROR) || (status & STATUS_ERR);
+    request.read_count = request.error ? 0 : request.count;
+    end_request();
+}
+
+/**
+ * IRQ14 handler: for PIO the drive raises an interrupt each time a block of
+ * sectors is ready in its buffer (DRQ set); for DMA once the whole transfer
+ * is done.
+ * Reading the Status register acknowledges it.
+ */
+static void handle_interrupt(interrupt_frame_t* frame) {
+    uint64_t start_tsc = rdtsc();
+
+    if (request.remaining == 0) {
+        // no interrupt-driven request in flight (e.g. a polled read)
+        port_in8(ATA0_BASE + REG_STATUS);
+        return;
+    }
+
+    if (request.dma) {
+        complete_dma();
+    } else {
+        complete_pio_block();
+    }
+
+    stats.cpu_cycles += rdtsc() - start_tsc;
+}
+
+/**
+ * Public functions
+ */
+
+/**
+ * Start reading up to `count` sectors into `dest` and return without
+ * waiting; `async` is filled in when the transfer completes. Returns the
+ * number of sectors requested, which is less than `count` if it exceeds
+ * what one command can transfer.
+ *
+ * Without interrupts (early boot, or polling mode) the read is done
+ * synchronously and `async` is already complete on return.
+ */
+int read_sectors_async(uint32_t start, size_t count, uint32_t* dest, ata_async_t* async) {
+    async->done = 0;
+    async->read_count = 0;
+
+    if (!interrupts_enabled() || mode == ATA_MODE_POLL) {
+        if (count > LBA28_MAX_COUNT) {
+            count = LBA28_MAX_COUNT;
+        }
+        async->read_count = read_sectors_poll(start, count, dest);
+        async->done = 1;
+        return count;
+    }
+
+    // one request at a time
+    while (request.remaining) {
+        wait_event(request_done);
+    }
+
+    // other buffers go through PIO
+    if (mode == ATA_MODE_DMA && bm_base != 0) {
+        size_t max_count = lba48 ? DMA_MAX_SECTORS : LBA28_MAX_COUNT;
+        if (count > max_count) {
+            count = max_count;
+        }
+        if (dma_reachable(dest, count) && start_dma(start, count, dest, async)) {
+            return count;
         }
-        read_count++;
+    }
+
+    size_t max_count = lba48 ? LBA48_MAX_COUNT : LBA28_MAX_COUNT;
+    if (count > max_count) {
+        count = max_count;
+    }
+    start_irq(start, count, dest, async);
+    return count;
+}
+
+/**
+ * Park the calling task until `async` completes (other tasks get the CPU in
+ * the meantime). Returns the number of sectors read.
+ */
+int ata_wait(ata_async_t* async) {
+    while (!async->done) {
+        wait_event(request_done);
+    }
+    return async->read_count;
+}
+
+int read_sectors(uint32_t start, size_t count, uint32_t* dest) {
+    // split into as few commands as the drive (or PRD table) allows
+    int read_count = 0;
+    while (count > 0) {
+        ata_async_t async;
+        size_t n = read_sectors_async(start, count, dest, &async);
+        int r = ata_wait(&async);
+        read_count += r;
+        if (r != n) {
+            break;
+        }
+        start += n;
+        count -= n;
+        dest += n * 512 / sizeof(uint32_t);
     }
 
     return read_count;
 }
+
+void ata_set_mode(ata_mode_t new_mode) {
+    if (new_mode == ATA_MODE_DMA && bm_base == 0) {
+        new_mode = ATA_MODE_IRQ;
+    }
+    mode = new_mode;
+}
+
+ata_mode_t ata_get_mode() {
+    return mode;
+}
+
+void ata_get_stats(ata_stats_t* out) {
+    *out = stats;
+}
+
+void ata_reset_stats() {
+    stats.commands = 0;
+    stats.sectors = 0;
+    stats.cpu_cycles = 0;
+}
+
+/**
+ * Locate the PCI IDE controller's bus master registers (BAR4) and let it
+ * master the bus. QEMU's PIIX3/PIIX4 IDE function provides these.
+ */
+static void dma_init() {
+    pci_device_t ide;
+    if (!pci_find_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_IDE, &ide)) {
+        return;
+    }
+
+    uint32_t bar4 = pci_read32(&ide, PCI_BAR4);
+    if ((bar4 & 1) == 0) {
+        // bus master registers must be in I/O space
+        return;
+    }
+    bm_base = bar4 & 0xfffc;
+
+    uint32_t cmd = pci_read32(&ide, PCI_COMMAND) & 0xffff;
+    pci_write32(&ide, PCI_COMMAND, cmd | PCI_CMD_IO | PCI_CMD_BUS_MASTER);
+}
+
+/**
+ * Query the drive with IDENTIFY DEVICE (polled; runs before interrupts are
+ * enabled) and switch it to multiple mode so that each DRQ block carries
+ * several sectors.
+ */
+static void identify() {
+    static uint16_t id[256];
+
+    wait_on_busy();
+    port_out8(ATA0_BASE + REG_LBA_24, FLAG_LBA);  // drive 0
+    port_out8(ATA0_BASE + REG_COMMAND, CMD_IDENTIFY);
+
+    uint8_t status = port_in8(ATA0_BASE + REG_STATUS);
+    if (status == 0) {
+        // no drive
+        return;
+    }
+    wait_on_busy();
+    status = port_in8(ATA0_BASE + REG_STATUS);
+    if ((status & STATUS_ERR) || (status & STATUS_DRQ) == 0) {
+        return;
+    }
+    port_in16_rep(ATA0_BASE + REG_DATA, id, 256);
+
+    lba48 = (id[ID_FEATURES_83] & ID_83_LBA48) != 0;
+    total_sectors = lba48
+        ? (id[ID_SECTORS_48] | (uint32_t)id[ID_SECTORS_48 + 1] << 16)
+        : (id[ID_SECTORS_28] | (uint32_t)id[ID_SECTORS_28 + 1] << 16);
+
+    // the largest block the drive supports, capped and rounded down to a
+    // power of two
+    size_t max_multiple = id[ID_MAX_MULTIPLE] & 0xff;
+    size_t block = MULTIPLE_MAX;
+    while (block > max_multiple) {
+        block >>= 1;
+    }
+    if (block <= 1) {
+        return;
+    }
+
+    wait_on_busy();
+    port_out8(ATA0_BASE + REG_LBA_24, FLAG_LBA);
+    port_out8(ATA0_BASE + REG_SECTOR_COUNT, block);
+    port_out8(ATA0_BASE + REG_COMMAND, CMD_SET_MULTIPLE);
+    wait_on_busy();
+    if ((port_in8(ATA0_BASE + REG_STATUS) & STATUS_ERR) == 0) {
+        multiple = block;
+    }
+}
+
+void ata_get_info(ata_info_t* info) {
+    info->lba48 = lba48;
+    info->multiple = multiple;
+    info->total_sectors = total_sectors;
+    info->dma = bm_base != 0;
+}
+
+/**
+ * Identify the drive, install the ATA IRQ handler at IRQ14, and enable DMA
+ * if the controller supports bus mastering.
+ */
+void ata_init() {
+    request_done = create_event();
+
+    identify();
+
+    // make sure the drive is allowed to raise interrupts (nIEN clear)
+    port_out8(ATA0_CTRL, 0);
+    irq_install(ATA0_IRQ, handle_interrupt);
+
+    dma_init();
+    mode = bm_base ? ATA_MODE_DMA : ATA_MODE_IRQ;
+}
@@ -5,6 +5,7 @@
 #include <stdint.h>
 #include "arch_x86/port.h"
 #include "device/bga.h"
+#include "kernel/vmm.h"
 
 
 #define VBE_DISPI_BANK_ADDRESS           0xA0000
@@ -106,5 +107,6 @@ void bga_copy(uint8_t mask[], uint16_t x, uint16_t y, uint16_t width, uint16_t h
 }
 
 void bga_set_graphics_mode() {
+    vmm_map_mmio(VBE_DISPI_LFB_PHYSICAL_ADDRESS, SCREEN_WIDTH * SCREEN_HEIGHT * 4);
     set_video_mode(SCREEN_WIDTH, SCREEN_HEIGHT, 32);
 }
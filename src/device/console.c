@@ -1,17 +1,22 @@
 /**
  * VGA Console
+ *
+ * Text printed with print and friends goes at current_offset, which
+ * console_lock guards (interrupt handlers print too). put_char and
+ * put_str write at a given position and need no lock.
  */
 
 #include <stdint.h>
+#include "arch_x86/cpu.h"
 #include "arch_x86/port.h"
+#include "device/pit.h"
 #include "lib/util.h"
 #include "device/console.h"
+#include "kernel/spinlock.h"
 #include "kernel/task.h"
 #include "lib/blocking_queue.h"
 
 #define VIDEO_MEMORY_ADDR 0xB8000
-#define SCREEN_ROWS 25
-#define SCREEN_COLS 80
 
 #define OFFSET(row, col) (row * SCREEN_COLS + col)
 #define COL(offset) (offset % SCREEN_COLS)
@@ -19,6 +24,9 @@
 uint16_t* const video_memory = (uint16_t* const)VIDEO_MEMORY_ADDR;
 uint16_t current_offset = 0;
 
+static lock_stats_t console_lock_stats = { .name = "console" };
+static spinlock_t console_lock = { .stats = &console_lock_stats };
+
 int put_char_at(unsigned char ch, char attr, int offset) {
     int advance = 1;
     if (ch == '\n') {
@@ -62,10 +70,12 @@ void debug_hex32(uint32_t value) {
  */
 
 void clear_screen() {
+    uint32_t flags = spin_lock_irqsave(&console_lock);
     for (int i = 0; i < (SCREEN_ROWS * SCREEN_COLS); i++) {
         put_char_at(0, 0, i);
     }
     current_offset = 0;
+    spin_unlock_irqrestore(&console_lock, flags);
 }
 
 void put_char(unsigned char ch, char attr, int row, int col) {
@@ -77,11 +87,15 @@ void put_str(const unsigned char* str, char attr, int row, int col) {
 }
 
 void write_char(unsigned char ch, char attr) {
+    uint32_t flags = spin_lock_irqsave(&console_lock);
     current_offset = put_char_at(ch, attr, current_offset);
+    spin_unlock_irqrestore(&console_lock, flags);
 }
 
 void write_str(const unsigned char* str, char attr) {
+    uint32_t flags = spin_lock_irqsave(&console_lock);
     current_offset = put_str_at(str, attr, current_offset);
+    spin_unlock_irqrestore(&console_lock, flags);
 }
 
 void print_char(unsigned char ch) {
@@ -110,6 +124,12 @@ void print_hex32(uint32_t value) {
     print(hex);
 }
 
+void print_dec32(uint32_t value) {
+    char dec[11];
+    to_dec32(value, dec);
+    print(dec);
+}
+
 #define VGA_CRTC_ADDR 0x3D4
 #define VGA_CRTC_DATA 0x3D5
 
@@ -124,8 +144,22 @@ void set_active_task(task_t* task) {
     active_task = task;
 }
 
+// when the most recent key arrived, for keystroke latency stats
+static uint32_t key_tick;
+static uint64_t key_tsc;
+
 void handle_key_event(char ch) {
+    key_tick = get_ticks();
+    key_tsc = rdtsc();
     if (active_task) {
         bq_enqueue(active_task->keybuf, ch);
     }
 }
+
+/**
+ * The tick count (and TSC) at the arrival of the most recent key.
+ */
+uint32_t last_key_time(uint64_t* tsc) {
+    *tsc = key_tsc;
+    return key_tick;
+}
@@ -0,0 +1,55 @@
+/**
+ * PCI Configuration Space (Mechanism #1)
+ */
+
+#include <stdint.h>
+#include "arch_x86/port.h"
+#include "device/pci.h"
+
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA    0xCFC
+
+#define PCI_ENABLE         0x80000000
+
+static uint32_t config_read(uint8_t bus, uint8_t dev, uint8_t fn, uint8_t offset) {
+    port_out32(PCI_CONFIG_ADDRESS,
+               PCI_ENABLE | bus << 16 | dev << 11 | fn << 8 | (offset & 0xfc));
+    return port_in32(PCI_CONFIG_DATA);
+}
+
+uint32_t pci_read32(pci_device_t* pdev, uint8_t offset) {
+    return config_read(pdev->bus, pdev->dev, pdev->fn, offset);
+}
+
+void pci_write32(pci_device_t* pdev, uint8_t offset, uint32_t value) {
+    port_out32(PCI_CONFIG_ADDRESS,
+               PCI_ENABLE | pdev->bus << 16 | pdev->dev << 11 | pdev->fn << 8 | (offset & 0xfc));
+    port_out32(PCI_CONFIG_DATA, value);
+}
+
+/**
+ * Brute-force scan of all buses/devices/functions for the first device
+ * with the given class and subclass.
+ */
+_Bool pci_find_class(uint8_t class_code, uint8_t subclass, pci_device_t* pdev) {
+    for (int bus = 0; bus < 256; bus++) {
+        for (int dev = 0; dev < 32; dev++) {
+            for (int fn = 0; fn < 8; fn++) {
+                uint32_t id = config_read(bus, dev, fn, PCI_VENDOR_ID);
+                if ((id & 0xffff) == 0xffff) {
+                    continue;
+                }
+                uint32_t class = config_read(bus, dev, fn, PCI_CLASS);
+                if ((class >> 24) == class_code && ((class >> 16) & 0xff) == subclass) {
+                    pdev->bus = bus;
+                    pdev->dev = dev;
+                    pdev->fn = fn;
+                    pdev->vendor_id = id & 0xffff;
+                    pdev->device_id = id >> 16;
+                    return 1;
+                }
+            }
+        }
+    }
+    return 0;
+}
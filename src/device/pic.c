@@ -1,14 +1,22 @@
 /**
  * Programmable Interrupt Controller (PIC)
+ *
+ * IRQs come through the 8259 PICs, or through the IO-APIC once
+ * irq_use_apic has switched over to it (see apic.c); the 8259s stay as
+ * the fallback when the ACPI MADT lists no IO-APIC. Either way ISA IRQ n
+ * arrives at vector IRQ_BASE_VECTOR + n. Handlers are looked up by vector,
+ * so the local APIC timer's vector is served the same way.
  */
 
 #include <stdint.h>
+#include "arch_x86/cpu.h"
 #include "arch_x86/idt.h"
 #include "arch_x86/port.h"
+#include "device/apic.h"
 #include "device/pic.h"
+#include "device/pit.h"
 #include "device/console.h"
-
-#define IRQ_BASE_VECTOR 0x20
+#include "kernel/smp.h"
 
 #define PIC1_COMMAND 0x20
 #define PIC2_COMMAND 0xA0
@@ -20,6 +28,11 @@
 #define ICW4_8086    0x01  // 8086/88 (MCS-80/85) mode
 #define PIC_EOI      0x20  // End-of-interrupt command
 
+
+static _Bool use_apic;                        // IRQs come through the IO-APIC
+static interrupt_handler_t irq_handlers[256]; // by vector
+static irq_latency_t latency[2];              // through the 8259s, the APICs
+
 /**
  * Remap PIC1 and PIC2 interrupt vectors to start at 32 and 40, respectively.
  */
@@ -48,6 +61,10 @@ void irq_disable(uint8_t irq_no) {
     if (irq_no > 15) {
         return;
     }
+    if (use_apic) {
+        ioapic_set_irq(irq_no, 0);
+        return;
+    }
 
     uint16_t port = PIC1_DATA;
     if (irq_no >= 8) {
@@ -66,11 +83,18 @@ void irq_enable(uint8_t irq_no) {
     if (irq_no > 15) {
         return;
     }
+    if (use_apic) {
+        ioapic_set_irq(irq_no, 1);
+        return;
+    }
 
     uint16_t port = PIC1_DATA;
     if (irq_no >= 8) {
         port = PIC2_DATA;
         irq_no -= 8;
+
+        // slave PIC interrupts are delivered through the cascade line (IRQ2)
+        port_out8(PIC1_DATA, port_in8(PIC1_DATA) & ~(1 << 2));
     }
 
     uint8_t mask = port_in8(port) & ~(1 << irq_no);
@@ -105,11 +129,6 @@ void irq_eoi(uint8_t irq_no) {
     port_out8(PIC1_COMMAND, PIC_EOI);
 }
 
-interrupt_handler_t irq_handlers[16] = {
-    0, 0, 0, 0, 0, 0, 0, 0,
-    0, 0, 0, 0, 0, 0, 0, 0,
-};
-
 /**
  * Install an IRQ handler.
  */
@@ -117,24 +136,86 @@ void irq_install(uint8_t irq_no, interrupt_handler_t irq_handler) {
     if (irq_no >= 16) {
         return;
     }
-    irq_handlers[irq_no] = irq_handler;
+    irq_handlers[IRQ_BASE_VECTOR + irq_no] = irq_handler;
     irq_enable(irq_no);
 }
 
+/**
+ * Install a handler for an interrupt vector that isn't an ISA IRQ (like
+ * the local APIC timer's).
+ */
+void irq_install_vector(uint8_t vector, interrupt_handler_t handler) {
+    irq_handlers[vector] = handler;
+}
+
 void handle_irq(interrupt_frame_t* frame) {
-    uint32_t irq_no = frame->int_no - IRQ_BASE_VECTOR;
+    uint32_t vector = frame->int_no;
 
-    // ack interrupt
-    irq_eoi(irq_no);
+    // ack interrupt (the local APIC's own, like IPIs, go to it either way)
+    if (!use_apic && vector - IRQ_BASE_VECTOR < 16) {
+        irq_eoi(vector - IRQ_BASE_VECTOR);
+    } else {
+        lapic_eoi();
+    }
 
-    if (irq_no >= 16) {
+    interrupt_handler_t handler = irq_handlers[vector & 0xFF];
+    if (handler == 0) {
         return;
     }
-    if (irq_handlers[irq_no] == 0) {
-        return;
+
+    // from isr_common to here, the EOI (and any wait for the kernel lock)
+    // included
+    uint32_t cycles = (uint32_t)(rdtsc() - this_cpu()->entry_tsc);
+    irq_latency_t* l = &latency[use_apic];
+    l->count++;
+    l->cycles += cycles;
+    if (cycles > l->max) {
+        l->max = cycles;
     }
 
-    irq_handlers[irq_no](frame);
+    handler(frame);
+}
+
+/**
+ * Switch IRQ delivery to the IO-APIC (`on`) or back to the 8259s, and the
+ * timer tick to the local APIC timer or back to the PIT. The IRQs that
+ * have handlers are masked on one controller and unmasked on the other.
+ * Returns -1 if apic_init found no APICs. It must run on the boot CPU,
+ * which gets the IRQs and keeps the time.
+ */
+int irq_use_apic(_Bool on) {
+    if (on && lapic_timer_hz() == 0) {
+        return -1;
+    }
+    uint32_t flags = save_and_disable_interrupts();
+    for (int irq = 0; irq < 16; irq++) {
+        if (irq_handlers[IRQ_BASE_VECTOR + irq] != 0) {
+            irq_disable(irq);
+        }
+    }
+    use_apic = on;
+    for (int irq = 0; irq < 16; irq++) {
+        if (irq_handlers[IRQ_BASE_VECTOR + irq] != 0) {
+            irq_enable(irq);
+        }
+    }
+    timer_use_lapic(on);
+    restore_interrupts(flags);
+    return 0;
+}
+
+_Bool irq_apic_active() {
+    return use_apic;
+}
+
+/**
+ * Entry-to-handler latency of the IRQs delivered through the APICs
+ * (`apic`) or through the 8259s.
+ */
+void irq_get_latency(_Bool apic, irq_latency_t* out) {
+    uint32_t flags = save_and_disable_interrupts();
+    *out = latency[apic];
+    restore_interrupts(flags);
 }
 
 /**
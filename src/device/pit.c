@@ -1,10 +1,35 @@
 /**
  * Programmable Interval Timer (PIT)
+ *
+ * The timer ticks at TIMER_HZ while tasks take turns on the CPU. When the
+ * task about to run has nobody to share it with (it is the idle task, or
+ * no other task of its priority is runnable), those ticks would only
+ * redraw the status line: the timer is put in one-shot mode instead and
+ * fires once, when the first sleeper is due or after the longest delay
+ * the 16-bit counter allows (ONESHOT_MAX_TICKS). The tick count catches up
+ * from the counter when the one-shot fires or is cut short because the
+ * periodic tick is needed again.
+ *
+ * With the APICs in charge of interrupts (irq_use_apic), the local APIC
+ * timer gives the ticks instead of the PIT. It works the same way, at its
+ * own counter rate and with a 32-bit counter, so a one-shot can span much
+ * longer. PIT channel 2, which doesn't interrupt, serves to calibrate it.
+ *
+ * Each CPU picks its own timer mode, for its own task, with its own timer
+ * state: the other CPUs' APIC timers go one-shot just like the boot
+ * CPU's, for as long as their counters allow. Only the boot CPU keeps the
+ * time and wakes sleepers, though. While its one-shot runs, another CPU
+ * reading the tick count adds the TSC cycles since the boot CPU counted
+ * the latest tick, and one that puts a task to sleep before the one-shot
+ * fires sends it a reschedule IPI, which re-arms it on the way out.
  */
 
+#include "arch_x86/cpu.h"
 #include "arch_x86/port.h"
+#include "device/apic.h"
 #include "kernel/interrupt.h"
 #include "kernel/scheduler.h"
+#include "kernel/smp.h"
 #include "lib/util.h"
 #include "device/console.h"
 #include "device/pic.h"
@@ -12,17 +37,59 @@
 
 #define PIT_FREQUENCY 1193180
 #define PIT_CH0_DATA  0x40
+#define PIT_CH2_DATA  0x42
 #define PIT_COMMAND   0x43
+#define PIT_PORT_B    0x61   // channel 2 gate and output (with the PC speaker)
 
-#define PIT_COUNTER_0   0b00000000
-#define PIT_RW_LSB_MSB  0b00110000
-#define PIT_MODE_SQUARE 0b00000110
+#define PIT_COUNTER_0    0b00000000
+#define PIT_COUNTER_2    0b10000000
+#define PIT_LATCH        0b00000000
+#define PIT_RW_LSB_MSB   0b00110000
+#define PIT_MODE_ONESHOT 0b00000000   // interrupt on terminal count
+#define PIT_MODE_SQUARE  0b00000110
 
-#define TIMER_HZ 250
+#define PORT_B_GATE2     0x01
+#define PORT_B_SPEAKER   0x02
+#define PORT_B_OUT2      0x20
 
-extern task_t* current_task;
+#define PIT_TICK_COUNTS  (PIT_FREQUENCY / TIMER_HZ)   // counter periods per tick
+#define MAX_SLEEP_TICKS  0x7FFFFFFF   // further ahead, before() would take it for the past
 
-static uint32_t ticks = 0;
+typedef enum timer_mode {
+    TIMER_PERIODIC,
+    TIMER_ONESHOT,    // armed for oneshot_ticks
+    TIMER_STOPPED,    // the one-shot has fired, nothing is armed
+} timer_mode_t;
+
+// one per CPU; each works only its own timer
+typedef struct cpu_timer {
+    timer_mode_t mode;
+    _Bool lapic;                 // ticks come from the local APIC timer
+    uint32_t tick_counts;        // timer counter periods per tick
+    uint32_t oneshot_max_ticks;
+    uint32_t oneshot_count;      // counter value the one-shot started from
+    uint32_t oneshot_ticks;      // ticks it spans
+    uint32_t oneshot_end;        // tick it fires at
+    uint32_t carry;              // counter periods towards the next tick
+} cpu_timer_t;
+
+static uint32_t ticks = 0;       // counted by the boot CPU
+static uint64_t ticks_tsc;       // TSC where tick `ticks` began
+static uint32_t tsc_per_tick;    // 0 until the APIC timer is first used
+static cpu_timer_t timers[MAX_CPUS] = {
+    [0] = {
+        .mode = TIMER_PERIODIC,
+        .tick_counts = PIT_TICK_COUNTS,
+        .oneshot_max_ticks = 0xFFFF / PIT_TICK_COUNTS,
+    },
+};
+static task_t* sleepers;         // sleeping tasks by wake_tick, linked by sleep_next
+static timer_stats_t stats;
+
+// whether tick `a` comes before tick `b` (the count wraps around)
+static _Bool before(uint32_t a, uint32_t b) {
+    return (int32_t)(a - b) < 0;
+}
 
 void set_frequency(uint16_t hz) {
     uint16_t divisor = PIT_FREQUENCY / hz;
@@ -34,14 +101,76 @@ void set_frequency(uint16_t hz) {
     port_out8(PIT_CH0_DATA, divisor >> 8);
 }
 
-void tick() {
+static cpu_timer_t* this_timer() {
+    return &timers[this_cpu()->id];
+}
+
+static void start_periodic(cpu_timer_t* tm) {
+    if (tm->lapic) {
+        lapic_timer_start(tm->tick_counts, 1);
+    } else {
+        set_frequency(TIMER_HZ);
+    }
+}
+
+/**
+ * Fire once after `n` ticks (1..oneshot_max_ticks), less the counter
+ * periods already carried towards the first of them.
+ */
+static void start_oneshot(cpu_timer_t* tm, uint32_t n) {
+    tm->oneshot_count = n * tm->tick_counts - tm->carry;
+    tm->oneshot_ticks = n;
+    tm->oneshot_end = ticks + n;
+
+    if (tm->lapic) {
+        lapic_timer_start(tm->oneshot_count, 0);
+    } else {
+        port_out8(PIT_COMMAND, PIT_COUNTER_0 | PIT_RW_LSB_MSB | PIT_MODE_ONESHOT);
+        port_out8(PIT_CH0_DATA, tm->oneshot_count & 0xff);
+        port_out8(PIT_CH0_DATA, tm->oneshot_count >> 8);
+    }
+
+    tm->mode = TIMER_ONESHOT;
+    stats.oneshots++;
+}
+
+// counter periods since the one-shot was armed (all of them once it fired)
+static uint32_t oneshot_elapsed(cpu_timer_t* tm) {
+    uint32_t count;
+    if (tm->lapic) {
+        count = lapic_timer_count();
+    } else {
+        port_out8(PIT_COMMAND, PIT_COUNTER_0 | PIT_LATCH);
+        count = port_in8(PIT_CH0_DATA);
+        count |= port_in8(PIT_CH0_DATA) << 8;
+    }
+
+    // past zero the PIT's counter wraps around and keeps counting down
+    // (the APIC timer's stays at zero)
+    if (count == 0 || count > tm->oneshot_count) {
+        return tm->oneshot_count;
+    }
+    return tm->oneshot_count - count;
+}
+
+void tick(uint32_t n) {
     static char spinner[] = { '-', '\\', '|', '/' };
     static int count = 0;
     static char msg[] = "________\0";
 
-    ticks++;
+    current_task->ticks += n;
+    if (this_cpu()->id != 0) {
+        return;
+    }
+
+    ticks += n;
+    if (tsc_per_tick != 0) {
+        // the tick began `carry` counter periods ago
+        cpu_timer_t* tm = &timers[0];
+        ticks_tsc = rdtsc() - udiv64((uint64_t)tm->carry * tsc_per_tick, tm->tick_counts);
+    }
 
-    if ((ticks & 0xF) == 0) { // mod 16
+    if ((ticks >> 4) != ((ticks - n) >> 4)) { // every 16
         put_char(spinner[count++ % 4], (GRAY_DK << 4 | WHITE), 24, 0);
     }
 
@@ -52,11 +181,214 @@ void tick() {
     put_str(msg, (GRAY_DK << 4 | WHITE), 24, 11);
 }
 
+/**
+ * Cut an armed one-shot short, counting the ticks that have passed since
+ * it was armed. Returns 0 (and leaves it to the interrupt handler) if it
+ * has fired already.
+ */
+static _Bool cancel_oneshot(cpu_timer_t* tm) {
+    uint32_t elapsed = oneshot_elapsed(tm);
+    if (elapsed == tm->oneshot_count) {
+        return 0;
+    }
+    elapsed += tm->carry;
+    tm->carry = elapsed % tm->tick_counts;
+    stats.avoided += elapsed / tm->tick_counts;
+    tick(elapsed / tm->tick_counts);
+    tm->mode = TIMER_STOPPED;
+    return 1;
+}
+
+uint32_t get_ticks() {
+    uint32_t flags = save_and_disable_interrupts();
+    uint32_t now = ticks;
+    cpu_timer_t* tm = &timers[0];
+    if (tm->mode == TIMER_ONESHOT) {
+        if (this_cpu()->id == 0) {
+            now += (tm->carry + oneshot_elapsed(tm)) / tm->tick_counts;
+        } else if (tsc_per_tick != 0) {
+            // the boot CPU's counter can't be read from here
+            int64_t cycles = (int64_t)(rdtsc() - ticks_tsc);
+            if (cycles > 0) {
+                now += (uint32_t)udiv64(cycles, tsc_per_tick);
+            }
+        }
+    }
+    restore_interrupts(flags);
+    return now;
+}
+
+// make the sleepers that are due runnable
+static void wake_sleepers() {
+    while (sleepers != NULL && !before(ticks, sleepers->wake_tick)) {
+        task_t* t = sleepers;
+        sleepers = t->sleep_next;
+        t->sleep_next = NULL;
+        set_task_state(t->id, READY);
+    }
+}
+
 void handle_interrupt(interrupt_frame_t* frame) {
-    tick();
+    cpu_timer_t* tm = this_timer();
+    stats.interrupts++;
+    if (tm->mode == TIMER_ONESHOT) {
+        tm->mode = TIMER_STOPPED;
+        tm->carry = 0;
+        stats.avoided += tm->oneshot_ticks - 1;
+        tick(tm->oneshot_ticks);
+    } else {
+        tick(1);
+    }
+    if (this_cpu()->id == 0) {
+        wake_sleepers();
+    }
     schedule(READY);
 }
 
+/**
+ * Pick this CPU's timer mode for the task about to run: periodic if it
+ * shares the CPU with others of its priority, one-shot otherwise. Called
+ * on the way out of every interrupt, once the scheduler has had its say.
+ */
+void pit_update() {
+    uint32_t flags = save_and_disable_interrupts();
+    cpu_timer_t* tm = this_timer();
+    // only the boot CPU's timer wakes sleepers
+    task_t* next = (this_cpu()->id == 0) ? sleepers : NULL;
+
+    if (sched_needs_tick()) {
+        if (tm->mode == TIMER_STOPPED || (tm->mode == TIMER_ONESHOT && cancel_oneshot(tm))) {
+            start_periodic(tm);
+            tm->mode = TIMER_PERIODIC;
+        }
+    } else if (tm->mode != TIMER_ONESHOT
+               || (next != NULL && before(next->wake_tick, tm->oneshot_end))) {
+        // arm a one-shot, or re-arm it for a sleeper due before it fires
+        if (tm->mode != TIMER_ONESHOT || cancel_oneshot(tm)) {
+            uint32_t n = tm->oneshot_max_ticks;
+            if (next != NULL && before(next->wake_tick, ticks + n)) {
+                n = before(ticks, next->wake_tick) ? next->wake_tick - ticks : 1;
+            }
+            start_oneshot(tm, n);
+        }
+    }
+
+    restore_interrupts(flags);
+}
+
+/**
+ * Block the current task for `ms` milliseconds, rounded up to whole ticks
+ * (and cut to MAX_SLEEP_TICKS; `ms` may come from user space). It waits in
+ * the sleeper list, ordered by wakeup tick, until the timer interrupt finds
+ * it due.
+ */
+void sleep(uint32_t ms) {
+    // whole seconds apart, so that ms * TIMER_HZ can't overflow
+    uint32_t n = (ms % 1000 * TIMER_HZ + 999) / 1000;
+    uint32_t secs = ms / 1000;
+    if (secs > (MAX_SLEEP_TICKS - n) / TIMER_HZ) {
+        n = MAX_SLEEP_TICKS;
+    } else {
+        n += secs * TIMER_HZ;
+    }
+    uint32_t flags = save_and_disable_interrupts();
+    task_t* self = current_task;
+
+    if (n > 0) {
+        self->wake_tick = get_ticks() + n;
+        task_t** p = &sleepers;
+        while (*p != NULL && !before(self->wake_tick, (*p)->wake_tick)) {
+            p = &(*p)->sleep_next;
+        }
+        self->sleep_next = *p;
+        *p = self;
+        set_task_state(self->id, BLOCKED);
+
+        // the boot CPU's one-shot may be armed to fire after it is due
+        cpu_timer_t* tm = &timers[0];
+        if (this_cpu()->id != 0 && tm->mode == TIMER_ONESHOT
+            && before(self->wake_tick, tm->oneshot_end)) {
+            smp_send_resched(0);
+        }
+    }
+    yield();
+
+    restore_interrupts(flags);
+}
+
+/**
+ * Take the boot CPU's ticks from the local APIC timer (`on`) or from the
+ * PIT. The time of a one-shot in progress is counted first; the new timer
+ * starts out as pit_update sees fit. Call it on the boot CPU, with
+ * interrupts off.
+ */
+void timer_use_lapic(_Bool on) {
+    cpu_timer_t* tm = &timers[0];
+    if (tm->mode == TIMER_ONESHOT && !cancel_oneshot(tm)) {
+        // it fired, but its interrupt won't be served by this handler
+        tm->carry = 0;
+        tick(tm->oneshot_ticks);
+    }
+    tm->mode = TIMER_STOPPED;
+
+    if (on) {
+        irq_disable(0);
+        irq_install_vector(LAPIC_TIMER_VECTOR, handle_interrupt);
+        // the PIT fires once more (masked) and then stays quiet
+        port_out8(PIT_COMMAND, PIT_COUNTER_0 | PIT_RW_LSB_MSB | PIT_MODE_ONESHOT);
+        port_out8(PIT_CH0_DATA, 0xff);
+        port_out8(PIT_CH0_DATA, 0xff);
+        tm->tick_counts = lapic_timer_hz() / TIMER_HZ;
+        tm->oneshot_max_ticks = 0xFFFFFFFF / tm->tick_counts;
+        tsc_per_tick = (uint32_t)udiv64(tsc_hz(), TIMER_HZ);
+    } else {
+        lapic_timer_stop();
+        irq_enable(0);
+        tm->tick_counts = PIT_TICK_COUNTS;
+        tm->oneshot_max_ticks = 0xFFFF / PIT_TICK_COUNTS;
+    }
+    tm->lapic = on;
+    tm->carry = 0;
+    pit_update();
+}
+
+/**
+ * Set up the timer state of an application processor, whose APIC timer
+ * lapic_init_ap has started ticking (the other CPUs get their turns
+ * through LAPIC_TIMER_VECTOR, whichever timer the boot CPU uses).
+ */
+void timer_init_ap(uint32_t cpu) {
+    cpu_timer_t* tm = &timers[cpu];
+    tm->mode = TIMER_PERIODIC;
+    tm->lapic = 1;
+    tm->tick_counts = lapic_timer_hz() / TIMER_HZ;
+    tm->oneshot_max_ticks = 0xFFFFFFFF / tm->tick_counts;
+}
+
+/**
+ * Busy-wait `us` microseconds (at most 54 ms) on PIT channel 2, which
+ * counts without interrupting; for calibrating other clocks.
+ */
+void pit_wait(uint32_t us) {
+    uint16_t count = PIT_FREQUENCY / 1000 * us / 1000;
+
+    // gate channel 2 on, with the speaker off
+    port_out8(PIT_PORT_B, (port_in8(PIT_PORT_B) & ~PORT_B_SPEAKER) | PORT_B_GATE2);
+    port_out8(PIT_COMMAND, PIT_COUNTER_2 | PIT_RW_LSB_MSB | PIT_MODE_ONESHOT);
+    port_out8(PIT_CH2_DATA, count & 0xff);
+    port_out8(PIT_CH2_DATA, count >> 8);
+
+    while ((port_in8(PIT_PORT_B) & PORT_B_OUT2) == 0) {
+    }
+}
+
+void pit_get_stats(timer_stats_t* out) {
+    uint32_t flags = save_and_disable_interrupts();
+    *out = stats;
+    restore_interrupts(flags);
+    out->ticks = get_ticks();
+}
+
 /**
  * Install the timer IRQ handler at IRQ0.
  */
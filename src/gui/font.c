@@ -1,5 +1,7 @@
 #include <stdint.h>
-#include <device/ata.h>
+#include <kernel/bcache.h>
+#include <kernel/kmalloc.h>
+#include <kernel/loader.h>
 #include <device/console.h>
 
 #define MZ_SIG ((uint16_t)'Z' << 8 | 'M')
@@ -202,9 +204,15 @@ void parse_ne(uint8_t* buf, uint32_t offset) {
  */
 
 void font_load() {
-    static uint8_t buf[12848];
-
-    read_sectors(92, 10, (uint32_t*)buf);
+    // the parsed fonts point into this buffer, so it is never freed
+    int sectors = file_sectors("font");
+    uint8_t* buf = sectors > 0 ? kmalloc(sectors * SECTOR_SIZE) : NULL;
+
+    if (buf == NULL || load_file("font", buf, sectors) < 0) {
+        kfree(buf);
+        print("Font not found.");
+        return;
+    }
 
     parse_mz_sig(buf);
 
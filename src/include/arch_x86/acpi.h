@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+
+#define MAX_CPUS 8
+
+// MPS INTI flags of an interrupt source override
+#define INTI_POLARITY_MASK  0x03
+#define INTI_ACTIVE_LOW     0x03
+#define INTI_TRIGGER_MASK   0x0C
+#define INTI_LEVEL          0x0C
+
+// what the MADT (the ACPI "APIC" table) says about the interrupt hardware
+typedef struct madt_info {
+    uint32_t lapic_addr;        // physical address of the local APICs
+    uint32_t ioapic_addr;       // the first IO-APIC
+    uint32_t ioapic_gsi_base;   // global system interrupt of its first input
+    uint8_t ioapic_id;
+    uint8_t n_cpus;             // enabled processors
+    uint8_t cpu_apic_ids[MAX_CPUS];
+    uint32_t irq_gsi[16];       // ISA IRQ -> global system interrupt
+    uint16_t irq_flags[16];     // ISA IRQ -> INTI flags (0: bus default)
+} madt_info_t;
+
+int acpi_find_madt(madt_info_t* info);
@@ -1,4 +1,14 @@
 #pragma once
 
+#include <stdint.h>
+
 _Noreturn void idle(int _tid);
 _Noreturn void halt();
+
+uint64_t rdtsc();
+uint32_t read_cr2();
+_Bool interrupts_enabled();
+uint32_t save_and_disable_interrupts();
+void restore_interrupts(uint32_t eflags);
+void cpuid(uint32_t leaf, uint32_t regs[4]);
+void wrmsr(uint32_t msr, uint64_t value);
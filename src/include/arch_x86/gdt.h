@@ -2,5 +2,14 @@
 
 #include <stdint.h>
 
+#define DOUBLE_FAULT_TSS_SEL (5 * 8)
+#define FIRST_CPU_TSS_SLOT   6
+#define CPU_TSS_SEL(cpu)     ((FIRST_CPU_TSS_SLOT + (cpu)) * 8)
+
 void gdt_init();
+void gdt_init_ap(uint32_t cpu);
+uint32_t cpu_id();
 void tss_set_kernel_stack(uint32_t esp0);
+uint32_t sysenter_stack_top(uint32_t cpu);
+void gdt_set_double_fault_task(void (*handler)(void));
+uint32_t tss_interrupted_esp();
@@ -5,3 +5,6 @@
 
 void idt_init();
 void idt_set(uint8_t vector, void (*handler)());
+void idt_set_user(uint8_t vector, void (*handler)());
+void idt_set_task_gate(uint8_t vector, uint16_t tss_sel);
+void idt_load();
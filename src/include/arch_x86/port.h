@@ -1,9 +1,13 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
 void port_out8(uint16_t port, uint8_t byte);
 void port_out16(uint16_t port, uint16_t word);
+void port_out32(uint16_t port, uint32_t dword);
 
 uint8_t port_in8(uint16_t port);
 uint16_t port_in16(uint16_t port);
+uint32_t port_in32(uint16_t port);
+void port_in16_rep(uint16_t port, void* buf, size_t count);
@@ -3,4 +3,7 @@
 #include "../kernel/task.h"
 
 // Start the first task from kmain (never returns)
-void resume_new_task(task_t* task);
\ No newline at end of file
+_Noreturn void resume_new_task(task_t* task);
+
+// Return address for spawned user tasks; exits the task (ring 3 code)
+void user_exit();
\ No newline at end of file
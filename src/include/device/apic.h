@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdint.h>
+#include "../arch_x86/acpi.h"
+
+#define LAPIC_TIMER_VECTOR     0x30
+#define LAPIC_SPURIOUS_VECTOR  0xFF
+
+int apic_init();
+uint32_t lapic_id();
+void lapic_eoi();
+uint32_t lapic_timer_hz();
+uint64_t tsc_hz();
+void lapic_timer_start(uint32_t count, _Bool periodic);
+void lapic_timer_stop();
+uint32_t lapic_timer_count();
+void ioapic_set_irq(uint8_t irq, _Bool enabled);
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector);
+void lapic_send_init(uint32_t apic_id);
+void lapic_send_startup(uint32_t apic_id, uint8_t page);
+void lapic_init_ap();
+const madt_info_t* apic_madt();
@@ -1,4 +1,40 @@
+#pragma once
+
 #include <stddef.h>
 #include <stdint.h>
 
+typedef enum ata_mode {
+    ATA_MODE_POLL,  // PIO, busy-wait on the Status register
+    ATA_MODE_IRQ,   // PIO, caller blocks until IRQ14 delivers the data
+    ATA_MODE_DMA,   // PCI bus master DMA, one IRQ14 per command
+} ata_mode_t;
+
+// completion record for read_sectors_async
+typedef struct ata_async {
+    volatile int done;
+    volatile int read_count;
+} ata_async_t;
+
+typedef struct ata_info {
+    _Bool lba48;
+    _Bool dma;
+    size_t multiple;         // sectors per DRQ block for PIO reads
+    uint32_t total_sectors;
+} ata_info_t;
+
+typedef struct ata_stats {
+    uint32_t commands;
+    uint32_t sectors;
+    uint64_t cpu_cycles;  // time the CPU spent in the driver (not waiting)
+} ata_stats_t;
+
+void ata_init();
+void ata_set_mode(ata_mode_t mode);
+ata_mode_t ata_get_mode();
+void ata_get_info(ata_info_t* info);
+void ata_get_stats(ata_stats_t* stats);
+void ata_reset_stats();
+
 int read_sectors(uint32_t start, size_t count, uint32_t* dest);
+int read_sectors_async(uint32_t start, size_t count, uint32_t* dest, ata_async_t* async);
+int ata_wait(ata_async_t* async);
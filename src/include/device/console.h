@@ -3,6 +3,9 @@
 #include <stdint.h>
 #include "../kernel/task.h"
 
+#define SCREEN_ROWS 25
+#define SCREEN_COLS 80
+
 // text mode colors
 #define BLACK       0x0
 #define BLUE        0x1
@@ -40,6 +43,7 @@ void print(const char* str);
 void print_hex8(uint8_t value);
 void print_hex16(uint16_t value);
 void print_hex32(uint32_t value);
+void print_dec32(uint32_t value);
 
 void disable_cursor();
 
@@ -47,3 +51,4 @@ void disable_cursor();
 void set_active_task(task_t* task);
 
 void handle_key_event(char ch);
+uint32_t last_key_time(uint64_t* tsc);
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+
+// configuration space registers (offsets)
+#define PCI_VENDOR_ID      0x00
+#define PCI_COMMAND        0x04
+#define PCI_CLASS          0x08
+#define PCI_BAR0           0x10
+#define PCI_BAR4           0x20
+
+#define PCI_CLASS_STORAGE  0x01
+#define PCI_SUBCLASS_IDE   0x01
+
+#define PCI_CMD_IO         0x0001
+#define PCI_CMD_MEMORY     0x0002
+#define PCI_CMD_BUS_MASTER 0x0004
+
+typedef struct pci_device {
+    uint8_t bus;
+    uint8_t dev;
+    uint8_t fn;
+    uint16_t vendor_id;
+    uint16_t device_id;
+} pci_device_t;
+
+uint32_t pci_read32(pci_device_t* pdev, uint8_t offset);
+void pci_write32(pci_device_t* pdev, uint8_t offset, uint32_t value);
+
+_Bool pci_find_class(uint8_t class_code, uint8_t subclass, pci_device_t* pdev);
@@ -3,9 +3,22 @@
 #include <stdint.h>
 #include "../kernel/interrupt.h"
 
+#define IRQ_BASE_VECTOR 0x20
+
+// cycles from interrupt entry (isr_common) to the IRQ's handler
+typedef struct irq_latency {
+    uint32_t count;
+    uint32_t max;
+    uint64_t cycles;
+} irq_latency_t;
+
 void pic_init();
 
 void irq_install(uint8_t irq_no, interrupt_handler_t irq_handler);
+void irq_install_vector(uint8_t vector, interrupt_handler_t handler);
+int irq_use_apic(_Bool on);
+_Bool irq_apic_active();
+void irq_get_latency(_Bool apic, irq_latency_t* latency);
 
 void irq_disable_all();
 void irq_enable_all();
@@ -1,3 +1,21 @@
 #pragma once
 
+#include <stdint.h>
+
+#define TIMER_HZ 250
+
+typedef struct timer_stats {
+    uint32_t ticks;        // since boot
+    uint32_t interrupts;   // timer interrupts taken (on all CPUs)
+    uint32_t avoided;      // ticks that passed without one (one-shot mode)
+    uint32_t oneshots;     // times the timer was armed in one-shot mode
+} timer_stats_t;
+
 void pit_init();
+uint32_t get_ticks();
+void pit_update();
+void sleep(uint32_t ms);
+void timer_use_lapic(_Bool on);
+void timer_init_ap(uint32_t cpu);
+void pit_wait(uint32_t us);
+void pit_get_stats(timer_stats_t* stats);
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SECTOR_SIZE 512
+
+typedef struct bcache_stats {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions;
+    uint32_t disk_reads;  // read_sectors calls issued for misses
+    uint32_t ra_reads;    // asynchronous read-ahead commands
+    uint32_t ra_sectors;  // sectors requested by read-ahead
+    uint32_t ra_hits;     // prefetched sectors that were later requested
+    uint32_t buffers;     // size of the pool, in sectors
+} bcache_stats_t;
+
+void bcache_init();
+int bcache_read(uint32_t lba, size_t count, void* dest);
+void bcache_get_stats(bcache_stats_t* stats);
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * ELF32 definitions (the subset the loader needs)
+ */
+
+#define EI_NIDENT 16
+
+#define ELFMAG0 0x7F
+#define ELFMAG1 'E'
+#define ELFMAG2 'L'
+#define ELFMAG3 'F'
+
+#define EI_CLASS   4
+#define EI_DATA    5
+#define ELFCLASS32 1
+#define ELFDATA2LSB 1
+
+#define ET_EXEC 2
+#define ET_DYN  3
+
+#define EM_386 3
+
+#define PT_NULL    0
+#define PT_LOAD    1
+#define PT_DYNAMIC 2
+
+#define PF_X 1
+#define PF_W 2
+#define PF_R 4
+
+#define DT_NULL   0
+#define DT_REL    17
+#define DT_RELSZ  18
+#define DT_RELENT 19
+
+#define R_386_NONE     0
+#define R_386_RELATIVE 8
+
+#define ELF32_R_TYPE(info) ((uint8_t)(info))
+
+typedef struct elf32_ehdr {
+    uint8_t e_ident[EI_NIDENT];
+    uint16_t e_type;
+    uint16_t e_machine;
+    uint32_t e_version;
+    uint32_t e_entry;
+    uint32_t e_phoff;
+    uint32_t e_shoff;
+    uint32_t e_flags;
+    uint16_t e_ehsize;
+    uint16_t e_phentsize;
+    uint16_t e_phnum;
+    uint16_t e_shentsize;
+    uint16_t e_shnum;
+    uint16_t e_shstrndx;
+} elf32_ehdr_t;
+
+typedef struct elf32_phdr {
+    uint32_t p_type;
+    uint32_t p_offset;
+    uint32_t p_vaddr;
+    uint32_t p_paddr;
+    uint32_t p_filesz;
+    uint32_t p_memsz;
+    uint32_t p_flags;
+    uint32_t p_align;
+} elf32_phdr_t;
+
+typedef struct elf32_dyn {
+    int32_t d_tag;
+    uint32_t d_val;
+} elf32_dyn_t;
+
+typedef struct elf32_rel {
+    uint32_t r_offset;
+    uint32_t r_info;
+} elf32_rel_t;
@@ -1,11 +1,18 @@
 #pragma once
 
+struct task;
+
+// A manual-reset event: once set it stays set (and waiting on it returns
+// at once) until reset. Tasks waiting for it are queued on the event.
 typedef struct event {
     int state;
-    int tid;
+    struct task* waiters;       // FIFO of blocked tasks, linked by wait_next
+    struct task* waiters_tail;
 } event_t;
 
 event_t* create_event();
+void destroy_event(event_t* evt);
 void set_event(event_t* evt);
+void signal_event(event_t* evt);
 void reset_event(event_t* evt);
 void wait_event(event_t* evt);
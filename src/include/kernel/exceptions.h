@@ -1,4 +1,4 @@
 #pragma once
 
 void exceptions_init();
-uint32_t handle_exception(interrupt_frame_t* frame);
\ No newline at end of file
+void handle_exception(interrupt_frame_t* frame);
\ No newline at end of file
@@ -16,4 +16,10 @@ typedef struct interrupt_frame {
     uint32_t eip, cs, eflags;
 } interrupt_frame_t;
 
+// an interrupt from ring 3 also has the user stack on the frame
+typedef struct user_interrupt_frame {
+    interrupt_frame_t frame;
+    uint32_t user_esp, ss;
+} user_interrupt_frame_t;
+
 typedef void (*interrupt_handler_t)(interrupt_frame_t*);
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct kmalloc_stats {
+    uint32_t arenas;         // 64KB blocks backing small allocations
+    uint32_t large;          // live page-backed allocations
+    uint32_t bytes_in_use;   // live allocations, including headers
+    uint32_t allocs;
+    uint32_t frees;
+    uint32_t failures;
+    uint32_t poison_errors;  // freed memory found modified (if poisoning is on)
+} kmalloc_stats_t;
+
+void* kmalloc(size_t size);
+void* kzalloc(size_t size);
+void kfree(void* ptr);
+void kmalloc_get_stats(kmalloc_stats_t* stats);
@@ -1,3 +1,39 @@
 #pragma once
 
-int exec(const char* name);
+#include <stddef.h>
+#include <stdint.h>
+#include "kernel/vector.h"
+
+#define PROGRAM_MAX_SEGMENTS 4
+
+typedef void (*program_entry_t)(kernel_vector_t[]);
+
+struct filetable_entry;
+
+// a PT_LOAD segment of a demand-paged image
+typedef struct program_segment {
+    uint32_t vaddr;
+    uint32_t memsz;
+    uint32_t offset;         // in the file
+    uint32_t filesz;
+    _Bool writable;
+} program_segment_t;
+
+// a task image: either preloaded into a region of its own (relocatable
+// images) or paged in from its file as the task touches it
+typedef struct program {
+    uint32_t base;           // physical address of the region (0 if none)
+    uint32_t order;          // region size: 2^order frames
+    uint32_t size;           // bytes spanned by the PT_LOAD segments
+    program_entry_t entry;   // virtual address (the image runs at USER_BASE)
+    const struct filetable_entry* file;
+    int n_segments;
+    program_segment_t segments[PROGRAM_MAX_SEGMENTS];
+} program_t;
+
+int file_sectors(const char* name);
+int load_file(const char* name, void* dest, size_t max_sectors);
+int load_program(const char* name, program_t* prog);
+void unload_program(program_t* prog);
+int program_page_in(program_t* prog, uint32_t page_dir, uint32_t addr);
+int spawn(const char* name);
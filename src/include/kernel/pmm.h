@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdint.h>
+
+#define FRAME_SIZE      4096
+#define FRAME_SHIFT     12
+#define PMM_MAX_ORDER   10   // largest block: 2^10 frames (4MB)
+
+typedef struct pmm_stats {
+    uint32_t total_frames;   // usable frames handed to the allocator
+    uint32_t free_frames;
+    uint32_t free_blocks[PMM_MAX_ORDER + 1];
+} pmm_stats_t;
+
+void pmm_init();
+uint32_t pmm_alloc_frames(uint32_t order);
+void pmm_free_frames(uint32_t addr, uint32_t order);
+uint32_t pmm_alloc_frame();
+void pmm_free_frame(uint32_t addr);
+void pmm_get_stats(pmm_stats_t* stats);
@@ -2,4 +2,18 @@
 
 #include "task.h"
 
+#define YIELD_VECTOR 0x81
+
 void schedule(task_state_t state);
+void sched_enqueue(task_t* t);
+void sched_dequeue(task_t* t);
+task_t* sched_pick();
+void sched_preempt();
+_Bool sched_needs_tick();
+void sched_pin(task_t* t, uint32_t cpu);
+uint32_t sched_set_cpus(uint32_t n);
+uint32_t sched_get_cpus();
+void preempt_disable();
+void preempt_enable();
+void sched_init();
+void yield();
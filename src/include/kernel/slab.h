@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdint.h>
+
+#define CACHE_LINE_SIZE 64
+
+typedef void (*slab_ctor_t)(void* obj);
+
+typedef struct slab_cache slab_cache_t;
+
+typedef struct slab_stats {
+    const char* name;
+    uint32_t obj_size;       // including padding to a cache line
+    uint32_t objs_per_slab;
+    uint32_t slabs;
+    uint32_t active;         // objects handed out
+    uint32_t allocs;
+    uint32_t frees;
+} slab_stats_t;
+
+slab_cache_t* slab_cache_create(const char* name, uint32_t size, slab_ctor_t ctor);
+void* slab_alloc(slab_cache_t* cache);
+void slab_free(slab_cache_t* cache, void* obj);
+int slab_get_stats(slab_stats_t* stats, int max);
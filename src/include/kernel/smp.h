@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+#include "../arch_x86/acpi.h"
+#include "spinlock.h"
+#include "task.h"
+
+#define RESCHED_VECTOR  0x31
+
+// what each CPU keeps to itself
+typedef struct cpu {
+    task_t* current;     // the task it runs
+    task_t* idle;        // runs when nothing else can; never leaves the CPU
+    uint32_t id;         // index in cpus[] (0: the boot CPU)
+    uint32_t apic_id;
+    volatile _Bool online;
+    _Bool need_resched;  // a queued task outranks the running one
+    uint32_t preempt_count;  // preempt_disable calls not yet undone
+    mcs_node_t lock_node;    // this CPU's place in the kernel lock's queue
+    uint64_t entry_tsc;  // when the latest interrupt came in (see isr_enter)
+    uint32_t kstack_gen; // kernel stack unmappings seen (see vmm_sync_kstacks)
+
+    // run queues (see scheduler.c)
+    task_t* rq_head[SCHED_PRIORITIES];
+    task_t* rq_tail[SCHED_PRIORITIES];
+    uint32_t rq_bitmap;  // bit p set: rq_head[p] is not empty
+    uint32_t nr_queued;  // tasks on the queues that may move (not pinned)
+    uint32_t steals;     // tasks taken from other CPUs' queues
+} cpu_t;
+
+extern cpu_t cpus[MAX_CPUS];
+
+// the task running on this CPU
+#define current_task (this_cpu()->current)
+
+cpu_t* this_cpu();
+uint32_t smp_cpus_online();
+_Bool smp_is_running(task_t* t);
+void smp_send_resched(uint32_t cpu);
+void smp_init();
+void kernel_lock();
+void kernel_unlock();
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+
+// how a lock (or a family of locks sharing the record) has been used
+typedef struct lock_stats {
+    const char* name;
+    uint32_t acquired;
+    uint32_t contended;       // acquisitions that had to wait
+    uint64_t wait_cycles;     // spent waiting by those
+    uint64_t hold_cycles;
+    uint32_t max_hold;        // longest hold, in cycles (saturating)
+    uint64_t since;           // when the current holder got it
+    _Bool listed;             // on the list lock_stats_first walks
+    struct lock_stats* next;
+} lock_stats_t;
+
+// a ticket lock: CPUs get it in the order they asked for it
+typedef struct spinlock {
+    volatile uint16_t next;   // ticket of the next CPU to ask
+    volatile uint16_t owner;  // ticket being served
+    lock_stats_t* stats;      // NULL: not counted
+} spinlock_t;
+
+// an MCS lock: each waiter spins on its own node, not on the lock
+typedef struct mcs_node {
+    struct mcs_node* volatile next;
+    volatile _Bool waiting;
+} mcs_node_t;
+
+typedef struct mcs_lock {
+    mcs_node_t* volatile tail;  // the last CPU to ask, NULL if free
+    lock_stats_t* stats;
+} mcs_lock_t;
+
+void spin_lock(spinlock_t* lock);
+void spin_unlock(spinlock_t* lock);
+uint32_t spin_lock_irqsave(spinlock_t* lock);
+void spin_unlock_irqrestore(spinlock_t* lock, uint32_t flags);
+void mcs_lock(mcs_lock_t* lock, mcs_node_t* node);
+void mcs_unlock(mcs_lock_t* lock, mcs_node_t* node);
+lock_stats_t* lock_stats_first();
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "interrupt.h"
+
+#define SYSCALL_VECTOR 0x80
+
+// system call numbers (passed in eax; arguments in ebx, ecx, edx, esi),
+// the same for INT 0x80 and SYSENTER
+#define SYS_EXIT     0
+#define SYS_PRINT    1   // (str)
+#define SYS_PUT_STR  2   // (str, attr, row, col)
+#define SYS_PUT_CHAR 3   // (ch, attr, row, col)
+#define SYS_FORK     4   // () -> child id in the parent, 0 in the child
+#define SYS_WAIT     5   // (child id) -> exit code
+#define SYS_YIELD    6   // ()
+#define SYS_READ_KEY 7   // () -> next key from the task's keyboard buffer
+#define SYS_SPAWN    8   // (program name) -> child id, or -1
+#define SYS_SLEEP    9   // (milliseconds)
+#define SYS_NULL     10  // () -> 0, for timing the entry and exit
+#define NR_SYSCALLS  11
+
+void syscall_detect();
+void syscall_init();
+void syscall_init_cpu(uint32_t cpu);
+void handle_syscall(interrupt_frame_t* frame);
@@ -2,6 +2,17 @@
 
 #include <stdint.h>
 #include "../lib/blocking_queue.h"
+#include "event.h"
+#include "interrupt.h"
+#include "loader.h"
+
+#define MAX_TASKS 64
+
+// scheduling priorities: 0 is the highest
+#define SCHED_PRIORITIES      32
+#define PRIORITY_INTERACTIVE  8    // tasks that mostly wait for input
+#define PRIORITY_DEFAULT      16
+#define PRIORITY_IDLE         (SCHED_PRIORITIES - 1)
 
 typedef enum task_state {
     NEW,
@@ -13,19 +24,53 @@ typedef enum task_state {
 
 typedef struct task {
     uint32_t esp;
-    uint32_t kstack;
+    uint32_t kstack;     // top of the kernel stack (TSS.esp0), in stack slot `id`
     uint32_t id;
     uint8_t privilege;
     task_state_t state;
+    uint32_t ticks;
     blocking_queue_t* keybuf;
-    struct task* next;
+    uint8_t priority;
+    _Bool queued;        // on its priority's run queue (see scheduler.c)
+    uint8_t cpu;         // CPU whose run queues it is on, or last ran on
+    _Bool pinned;        // never moved to another CPU
+    struct task* rq_next;
+    struct task* rq_prev;
     char name[32];
+    event_t* exited;     // set when the task terminates
+    event_t* waiting_on; // event the task is blocked on, if any
+    struct task* wait_next;  // next task waiting on the same event
+    uint32_t wake_tick;  // tick a sleeping task is due to wake up at
+    struct task* sleep_next; // next sleeper (see sleep in pit.c)
+    int exit_code;
+    program_t program;   // image of a spawned task (base 0 if none)
+    uint32_t ustack_size;  // bytes of user stack mapped: its high-water mark
+    uint32_t page_dir;   // address space (physical address of the page directory)
+    _Bool detached;      // freed on termination instead of by wait_task
+    struct task* parent; // task it was forked from, until one of them ends
+    uint32_t faults;     // pages of the program image brought in on demand
+    uint64_t fault_cycles;  // TSC cycles spent serving them
 } task_t;
 
+// what a task used, reported by wait_task
+typedef struct task_stats {
+    uint32_t ticks;
+    uint32_t faults;
+    uint64_t fault_cycles;
+} task_stats_t;
+
 task_t* create_task(const char* name, void (entry_point)(int));
 task_t* create_user_task(const char* name, void (entry_point)(int));
+task_t* create_program_task(const char* name, program_t* prog, uint32_t arg);
 task_t* get_current_task();
 task_t* get_task(uint32_t tid);
 void set_task_state(uint32_t tid, task_state_t state);
-int get_task_list(task_t** task_list);
-void end_task(void);
\ No newline at end of file
+void set_task_priority(uint32_t tid, uint8_t priority);
+int get_task_list(task_t** task_list, int max);
+void end_task(void);
+void exit_task(int exit_code);
+int wait_task(uint32_t tid, task_stats_t* stats);
+void detach_task(uint32_t tid);
+int fork_task(interrupt_frame_t* frame);
+int task_page_fault(uint32_t addr);
+uint32_t task_kstack_used(task_t* t);
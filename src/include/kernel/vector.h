@@ -1,6 +1,38 @@
 #pragma once
 
+#include <stdint.h>
+
+// code and constants that user tasks can reach (read-only; see vmm.c)
+#define USER_TEXT   __attribute__((section(".utext")))
+#define USER_RODATA __attribute__((section(".urodata")))
+// variables user tasks can read; the kernel sets them before vmm_init
+#define USER_DATA   __attribute__((section(".udata")))
+
 typedef void (*kernel_vector_t)(void);
 
-#define VEC_PUT_STR 0
-#define VEC_PRINT   1
+#define VEC_PUT_STR  0
+#define VEC_PRINT    1
+#define VEC_FORK     2
+#define VEC_WAIT     3
+#define VEC_YIELD    4
+#define VEC_READ_KEY 5
+#define VEC_SPAWN    6
+#define VEC_SLEEP    7
+#define VEC_EXIT     8
+
+extern const kernel_vector_t kernel_vectors[];
+extern _Bool syscall_use_sysenter;
+
+// system call stubs (in .utext)
+uint32_t syscall_int80(uint32_t call, uint32_t a, uint32_t b, uint32_t c, uint32_t d);
+uint32_t syscall_sysenter(uint32_t call, uint32_t a, uint32_t b, uint32_t c, uint32_t d);
+void user_print(const char* str);
+void user_put_str(const char* str, char attr, int row, int col);
+void user_put_char(unsigned char ch, char attr, int row, int col);
+int user_fork(void);
+int user_wait(int tid);
+void user_yield(void);
+char user_read_key(void);
+int user_spawn(const char* name);
+void user_sleep(uint32_t ms);
+_Noreturn void user_exit_task(int exit_code);
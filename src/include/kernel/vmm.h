@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+
+#define PAGE_SIZE         4096
+#define PAGE_SHIFT        12
+
+// address space layout (the same in every page directory)
+#define KSTACK_AREA       0x3FC00000   // [0, 1GB - 4MB): kernel, identity mapped
+#define KERNEL_SPACE_END  0x40000000   // [1GB - 4MB, 1GB): kernel stacks
+#define USER_BASE         0x40000000   // [1GB, 3GB): per-task user space
+#define USER_STACK_TOP    0xC0000000
+#define USER_SPACE_END    0xC0000000   // [3GB, 4GB): kernel MMIO mappings
+
+// kernel stacks: a slot per task, an unmapped guard page below each stack
+#define KSTACK_SIZE       PAGE_SIZE
+#define KSTACK_SLOT_SIZE  (KSTACK_SIZE + PAGE_SIZE)
+
+// user stacks start with one page and grow on demand up to this size
+#define USER_STACK_MAX    0x40000
+
+// page directory / page table entry bits
+#define PTE_PRESENT       0x001
+#define PTE_WRITE         0x002
+#define PTE_USER          0x004
+#define PTE_PWT           0x008
+#define PTE_PCD           0x010
+#define PTE_LARGE         0x080        // 4MB page (PDEs only)
+#define PTE_GLOBAL        0x100
+#define PTE_OWNED         0x200        // frame is freed with the address space (available bit)
+#define PTE_COW           0x400        // shared read-only, copied on the first write (available bit)
+
+typedef struct vmm_stats {
+    uint32_t forks;          // address spaces copied by vmm_fork_space
+    uint32_t shared_pages;   // pages shared copy-on-write by those forks
+    uint32_t copied_pages;   // pages copied at fork time (not owned by the space)
+    uint32_t cow_copies;     // write faults that copied a shared page
+    uint32_t cow_reuses;     // write faults on a page no longer shared
+} vmm_stats_t;
+
+void vmm_init();
+uint32_t vmm_kernel_space();
+uint32_t vmm_create_space();
+void vmm_destroy_space(uint32_t page_dir);
+int vmm_map(uint32_t page_dir, uint32_t vaddr, uint32_t paddr, uint32_t size, uint32_t flags);
+void vmm_map_mmio(uint32_t paddr, uint32_t size);
+uint32_t vmm_alloc_kstack(uint32_t slot);
+void vmm_free_kstack(uint32_t slot);
+void vmm_sync_kstacks(uint32_t* seen);
+void vmm_switch(uint32_t page_dir);
+_Bool vmm_user_accessible(uint32_t page_dir, uint32_t vaddr, uint32_t size, _Bool write);
+int vmm_fork_space(uint32_t parent_dir, uint32_t child_dir);
+int vmm_copy_on_write(uint32_t page_dir, uint32_t vaddr);
+void vmm_get_stats(vmm_stats_t* stats);
@@ -1,14 +1,19 @@
 #pragma once
 
+#include <stdint.h>
 #include "queue.h"
 #include "../kernel/event.h"
 
+// One producer (e.g. the keyboard interrupt) and one consumer task.
 typedef struct blocking_queue {
     queue_t* inner;
     event_t* not_empty_evt;
+    uint32_t dropped;    // items lost to a full queue
 } blocking_queue_t;
 
 blocking_queue_t* create_blocking_queue();
+void destroy_blocking_queue(blocking_queue_t* q);
 void bq_enqueue(blocking_queue_t* q, char ch);
 char bq_dequeue(blocking_queue_t* q);
+uint32_t bq_dequeue_batch(blocking_queue_t* q, char* buf, uint32_t max);
 _Bool bq_is_empty(blocking_queue_t* q);
@@ -1,15 +1,22 @@
 #pragma once
 
-#define QUEUE_MAX_ITEMS 128
+#include <stdint.h>
 
+#define QUEUE_MAX_ITEMS 256        // a power of two
+#define QUEUE_MASK      (QUEUE_MAX_ITEMS - 1)
+
+// A single-producer/single-consumer ring: only the producer writes tail
+// and only the consumer writes head (see queue.c).
 typedef struct queue {
-    int front;
-    int rear;
+    uint32_t head;      // next item to dequeue
+    uint32_t tail;      // next slot to fill
     char buf[QUEUE_MAX_ITEMS];
 } queue_t;
 
 queue_t* create_queue();
-void enqueue(queue_t* q, char ch);
+void destroy_queue(queue_t* q);
+_Bool enqueue(queue_t* q, char ch);
 char dequeue(queue_t* q);
+uint32_t dequeue_batch(queue_t* q, char* buf, uint32_t max);
 _Bool is_empty(queue_t* q);
 _Bool is_full(queue_t* q);
@@ -8,7 +8,12 @@
 void to_hex8(uint8_t value, char* buf);
 void to_hex16(uint16_t value, char* buf);
 void to_hex32(uint32_t value, char* buf);
+void to_dec32(uint32_t value, char* buf);
+
+uint64_t udiv64(uint64_t n, uint32_t d);
 
 int strcmp(const char* str1, const char* str2);
 int strlen(const char* str);
-void strncpy(char* dest, const char* src, size_t n);
\ No newline at end of file
+void strncpy(char* dest, const char* src, size_t n);
+void* memcpy(void* dest, const void* src, size_t n);
+void* memset(void* dest, int value, size_t n);
@@ -0,0 +1,365 @@
+/**
+ * Block Buffer Cache
+ *
+ * Sits between the disk's callers (task loader, font loader) and the ATA
+ * driver. A pool of sector buffers is indexed by LBA in a chained hash
+ * table and kept on an LRU list; a miss evicts the least recently used
+ * buffer. The pool is allocated at boot, large enough for the whole disk
+ * when that fits within BCACHE_MAX_BUFS and a share of RAM.
+ *
+ * Consecutive misses within one request are read from the disk with a
+ * single read_sectors call straight into the caller's buffer and then
+ * copied into the cache.
+ *
+ * Read-ahead: after each request the sectors that follow it are fetched
+ * asynchronously into a staging buffer, and installed in the cache when
+ * the next request needs them (or the disk). The window starts at RA_MIN
+ * sectors and doubles up to RA_MAX as long as requests stay sequential;
+ * a request anywhere else resets it.
+ *
+ * Requests are served one at a time: page faults read program images with
+ * interrupts enabled, so a task can fault while another one (the shell
+ * loading a program) is in the middle of a request. The second one blocks
+ * on an event until the first is done (a loop of HLTs would keep the
+ * kernel lock, see smp.c, from the task it waits for).
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include "arch_x86/cpu.h"
+#include "device/ata.h"
+#include "kernel/bcache.h"
+#include "kernel/event.h"
+#include "kernel/kmalloc.h"
+#include "kernel/pmm.h"
+#include "lib/util.h"
+
+#define BCACHE_MIN_BUFS   64
+#define BCACHE_MAX_BUFS   4096
+#define BCACHE_RAM_SHARE  32    // at most 1/32 of RAM
+
+#define RA_MIN        4
+#define RA_MAX        32
+
+#define BUF_VALID      0x01
+#define BUF_PREFETCHED 0x02  // brought in by read-ahead, not yet requested
+
+typedef struct buf {
+    uint32_t lba;
+    uint8_t flags;
+    struct buf* hnext;  // hash chain
+    struct buf* prev;   // LRU list (head = most recently used)
+    struct buf* next;
+    uint8_t* data;
+} buf_t;
+
+static buf_t* bufs;
+static uint8_t* pool;
+static uint32_t nbuf;
+
+static buf_t** buckets;
+static uint32_t buckets_shift;
+static buf_t* lru_head;
+static buf_t* lru_tail;
+
+static bcache_stats_t stats;
+static volatile _Bool busy;  // a request is in progress
+static event_t* not_busy;    // set while none is
+
+static struct {
+    uint32_t next_lba;  // where the previous request ended
+    size_t window;
+    _Bool active;       // a prefetch is in flight (or done but not installed)
+    uint32_t lba;
+    size_t count;
+    ata_async_t async;
+} ra;
+
+static uint8_t ra_buf[RA_MAX][SECTOR_SIZE] __attribute__((aligned(4)));
+static uint32_t disk_sectors;
+
+static uint32_t hash(uint32_t lba) {
+    // Fibonacci hashing: take the top bits of lba * 2^32/phi
+    return (lba * 2654435769u) >> (32 - buckets_shift);
+}
+
+static void lru_unlink(buf_t* b) {
+    if (b->prev) {
+        b->prev->next = b->next;
+    } else {
+        lru_head = b->next;
+    }
+    if (b->next) {
+        b->next->prev = b->prev;
+    } else {
+        lru_tail = b->prev;
+    }
+    b->prev = b->next = NULL;
+}
+
+static void lru_push_front(buf_t* b) {
+    b->prev = NULL;
+    b->next = lru_head;
+    if (lru_head) {
+        lru_head->prev = b;
+    }
+    lru_head = b;
+    if (!lru_tail) {
+        lru_tail = b;
+    }
+}
+
+static void hash_remove(buf_t* b) {
+    buf_t** p = &buckets[hash(b->lba)];
+    while (*p && *p != b) {
+        p = &(*p)->hnext;
+    }
+    if (*p) {
+        *p = b->hnext;
+    }
+    b->hnext = NULL;
+}
+
+static void hash_insert(buf_t* b) {
+    uint32_t h = hash(b->lba);
+    b->hnext = buckets[h];
+    buckets[h] = b;
+}
+
+static buf_t* lookup(uint32_t lba) {
+    for (buf_t* b = buckets[hash(lba)]; b; b = b->hnext) {
+        if ((b->flags & BUF_VALID) && b->lba == lba) {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Take the least recently used buffer and rebind it to `lba`. Only valid
+ * buffers are hashed; the caller fills the data and then calls install().
+ */
+static buf_t* evict(uint32_t lba) {
+    buf_t* b = lru_tail;
+    if (b->flags & BUF_VALID) {
+        hash_remove(b);
+        stats.evictions++;
+    }
+    b->lba = lba;
+    b->flags = 0;
+    return b;
+}
+
+static void install(buf_t* b) {
+    b->flags |= BUF_VALID;
+    hash_insert(b);
+}
+
+static void touch(buf_t* b) {
+    lru_unlink(b);
+    lru_push_front(b);
+}
+
+/**
+ * Wait for the prefetch in flight (if any) and move it into the cache.
+ */
+static void ra_collect() {
+    if (!ra.active) {
+        return;
+    }
+    ra.active = 0;
+
+    int n = ata_wait(&ra.async);
+    for (int j = 0; j < n; j++) {
+        if (lookup(ra.lba + j)) {
+            continue;
+        }
+        buf_t* b = evict(ra.lba + j);
+        memcpy(b->data, ra_buf[j], SECTOR_SIZE);
+        b->flags = BUF_PREFETCHED;
+        install(b);
+        touch(b);
+    }
+}
+
+/**
+ * Adjust the window after a request for [lba, lba + count) and prefetch
+ * the sectors that follow it.
+ */
+static void ra_issue(uint32_t lba, size_t count) {
+    if (lba == ra.next_lba && ra.window != 0) {
+        ra.window = ra.window * 2 > RA_MAX ? RA_MAX : ra.window * 2;
+    } else {
+        ra.window = RA_MIN;
+    }
+    ra.next_lba = lba + count;
+
+    if (ra.active) {
+        return;
+    }
+
+    // skip what is already cached, then fetch up to the end of the window
+    uint32_t start = lba + count;
+    uint32_t end = start + ra.window;
+    if (end > disk_sectors) {
+        end = disk_sectors;
+    }
+    while (start < end && lookup(start)) {
+        start++;
+    }
+    size_t n = 0;
+    while (start + n < end && !lookup(start + n)) {
+        n++;
+    }
+    if (n == 0) {
+        return;
+    }
+
+    ra.lba = start;
+    ra.active = 1;
+    ra.count = read_sectors_async(start, n, (uint32_t*)ra_buf, &ra.async);
+    stats.ra_reads++;
+    stats.ra_sectors += ra.count;
+}
+
+// bcache_read, with the request lock held
+static int read_cached(uint32_t lba, size_t count, void* dest) {
+    uint8_t* out = dest;
+    size_t i = 0;
+
+    if (nbuf == 0) {
+        return read_sectors(lba, count, dest);
+    }
+
+    // pick up a finished prefetch, or wait for one this request overlaps
+    if (ra.active && (ra.async.done || (lba < ra.lba + ra.count && ra.lba < lba + count))) {
+        ra_collect();
+    }
+
+    while (i < count) {
+        buf_t* b = lookup(lba + i);
+        if (b) {
+            stats.hits++;
+            if (b->flags & BUF_PREFETCHED) {
+                b->flags &= ~BUF_PREFETCHED;
+                stats.ra_hits++;
+            }
+            memcpy(out + i * SECTOR_SIZE, b->data, SECTOR_SIZE);
+            touch(b);
+            i++;
+            continue;
+        }
+
+        // gather the run of consecutive misses and fetch it in one go
+        size_t run = 1;
+        while (i + run < count && lookup(lba + i + run) == NULL) {
+            run++;
+        }
+        stats.misses += run;
+        stats.disk_reads++;
+
+        // the disk serves one command at a time; don't lose the prefetch
+        ra_collect();
+
+        int n = read_sectors(lba + i, run, (uint32_t*)(out + i * SECTOR_SIZE));
+        for (int j = 0; j < n; j++) {
+            b = evict(lba + i + j);
+            memcpy(b->data, out + (i + j) * SECTOR_SIZE, SECTOR_SIZE);
+            install(b);
+            touch(b);
+        }
+        if (n != run) {
+            return i + n;
+        }
+        i += run;
+    }
+
+    ra_issue(lba, count);
+    return count;
+}
+
+/**
+ * Read `count` sectors starting at `lba` into `dest`, serving whatever is
+ * cached from memory. Returns the number of sectors read. Waits for the
+ * request in progress, if any.
+ */
+int bcache_read(uint32_t lba, size_t count, void* dest) {
+    uint32_t flags = save_and_disable_interrupts();
+    while (busy) {
+        wait_event(not_busy);
+    }
+    busy = 1;
+    reset_event(not_busy);
+    restore_interrupts(flags);
+
+    int n = read_cached(lba, count, dest);
+
+    flags = save_and_disable_interrupts();
+    busy = 0;
+    set_event(not_busy);
+    restore_interrupts(flags);
+    return n;
+}
+
+void bcache_get_stats(bcache_stats_t* out) {
+    *out = stats;
+    out->buffers = nbuf;
+}
+
+/**
+ * Allocate the pool and hash table for `n` buffers (one bucket per buffer,
+ * rounded up to a power of two).
+ */
+static _Bool alloc_pool(uint32_t n) {
+    buckets_shift = 1;
+    while ((1u << buckets_shift) < n) {
+        buckets_shift++;
+    }
+
+    bufs = kzalloc(n * sizeof(buf_t));
+    pool = kmalloc(n * SECTOR_SIZE);
+    buckets = kzalloc((1u << buckets_shift) * sizeof(buf_t*));
+    if (bufs && pool && buckets) {
+        return 1;
+    }
+    kfree(bufs);
+    kfree(pool);
+    kfree(buckets);
+    return 0;
+}
+
+void bcache_init() {
+    not_busy = create_event();
+    set_event(not_busy);
+
+    ata_info_t info;
+    ata_get_info(&info);
+    disk_sectors = info.total_sectors;
+
+    pmm_stats_t mem;
+    pmm_get_stats(&mem);
+    uint32_t ram_bufs = mem.total_frames / BCACHE_RAM_SHARE * (FRAME_SIZE / SECTOR_SIZE);
+
+    uint32_t n = disk_sectors;
+    if (n > ram_bufs) {
+        n = ram_bufs;
+    }
+    if (n > BCACHE_MAX_BUFS) {
+        n = BCACHE_MAX_BUFS;
+    }
+    if (n < BCACHE_MIN_BUFS) {
+        n = BCACHE_MIN_BUFS;
+    }
+
+    // fall back to smaller pools; with none at all reads go to the disk
+    while (n > 0 && !alloc_pool(n)) {
+        n /= 2;
+    }
+    nbuf = n;
+
+    for (uint32_t i = 0; i < nbuf; i++) {
+        bufs[i].data = pool + i * SECTOR_SIZE;
+        bufs[i].flags = 0;
+        lru_push_front(&bufs[i]);
+    }
+}
@@ -1,40 +1,131 @@
+/**
+ * Events
+ *
+ * A task that waits for an event is put on the event's wait queue and
+ * taken off the scheduler's run queues (BLOCKED); setting the event puts
+ * the waiters back (READY). So the scheduler never sees sleeping tasks,
+ * and any number of tasks can wait on one event. set_event wakes them
+ * all; signal_event wakes only the first, for waiters that each consume
+ * something (like the items of a blocking queue).
+ *
+ * Events are set from interrupt handlers, so the wait queues are only
+ * touched with interrupts off, under wait_lock.
+ */
+
+#include <stddef.h>
+#include "arch_x86/cpu.h"
 #include "kernel/event.h"
+#include "kernel/slab.h"
 #include "kernel/task.h"
 #include "kernel/scheduler.h"
+#include "kernel/spinlock.h"
 
 
-static event_t events[16];
-static int n_events = 0;
+static slab_cache_t* event_cache = NULL;
 
+// guards every event's state and wait queue
+static lock_stats_t wait_lock_stats = { .name = "events" };
+static spinlock_t wait_lock = { .stats = &wait_lock_stats };
+
+static void event_ctor(void* obj) {
+    event_t* evt = obj;
+    evt->state = 0;
+    evt->waiters = NULL;
+    evt->waiters_tail = NULL;
+}
 
 event_t* create_event() {
-    events[n_events].state = 0;
-    events[n_events].tid = -1;
-    return &events[n_events++];
+    if (event_cache == NULL) {
+        event_cache = slab_cache_create("event", sizeof(event_t), event_ctor);
+    }
+    return slab_alloc(event_cache);
 }
 
+void destroy_event(event_t* evt) {
+    if (evt == NULL) {
+        return;
+    }
+    event_ctor(evt);
+    slab_free(event_cache, evt);
+}
+
+// take the first waiter off the queue and make it runnable
+static void wake_first(event_t* evt) {
+    task_t* t = evt->waiters;
+    evt->waiters = t->wait_next;
+    if (evt->waiters == NULL) {
+        evt->waiters_tail = NULL;
+    }
+    t->wait_next = NULL;
+    t->waiting_on = NULL;
+    set_task_state(t->id, READY);
+}
+
+/**
+ * Set the event and wake every task waiting for it.
+ */
 void set_event(event_t* evt) {
+    uint32_t flags = spin_lock_irqsave(&wait_lock);
+    evt->state = 1;
+    while (evt->waiters != NULL) {
+        wake_first(evt);
+    }
+    spin_unlock_irqrestore(&wait_lock, flags);
+}
+
+/**
+ * Set the event but wake only the task that has waited longest. That
+ * task should pass the event on (signal it again) if there is more left
+ * for the others.
+ */
+void signal_event(event_t* evt) {
+    uint32_t flags = spin_lock_irqsave(&wait_lock);
     evt->state = 1;
-    if (evt->tid != -1) {
-        set_task_state(evt->tid, READY);
+    if (evt->waiters != NULL) {
+        wake_first(evt);
     }
+    spin_unlock_irqrestore(&wait_lock, flags);
 }
 
+/**
+ * Clear the event. This is a full barrier: a waiter that resets the event
+ * and then checks for work (see bq_dequeue_batch) can't have the check
+ * done before the reset, and so miss a set_event that came in between.
+ */
 void reset_event(event_t* evt) {
-    evt->state = 0;
-    evt->tid = -1;
+    __atomic_store_n(&evt->state, 0, __ATOMIC_SEQ_CST);
 }
 
+/**
+ * Block the current task until the event is set: it joins the wait queue,
+ * is marked BLOCKED, and yields, so the scheduler switches away from it at
+ * once; yield returns when the task has been woken and picked again.
+ * Checking the event and joining the queue happen under wait_lock, so a
+ * set_event can't slip in between and be missed; interrupts stay off
+ * until the task has yielded. Returns with interrupts as they were on
+ * entry.
+ */
 void wait_event(event_t* evt) {
-    // Block the current task until the event is set.
-    // We avoid invoking the scheduler directly from kernel mode;
-    // instead we mark the task BLOCKED and yield the CPU with HLT,
-    // letting the timer interrupt drive scheduling.
-    while (evt->state == 0) {
-        evt->tid = get_current_task()->id;
-        set_task_state(evt->tid, BLOCKED);
+    uint32_t flags = save_and_disable_interrupts();
+    task_t* self = get_current_task();
+    spin_lock(&wait_lock);
 
-        // Enable interrupts and halt until the next interrupt.
-        asm volatile("sti\nhlt");
+    // the event may have been reset again by the time we run
+    while (evt->state == 0) {
+        self->waiting_on = evt;
+        self->wait_next = NULL;
+        if (evt->waiters_tail != NULL) {
+            evt->waiters_tail->wait_next = self;
+        } else {
+            evt->waiters = self;
+        }
+        evt->waiters_tail = self;
+        set_task_state(self->id, BLOCKED);
+        spin_unlock(&wait_lock);
+        yield();
+        spin_lock(&wait_lock);
     }
+
+    spin_unlock(&wait_lock);
+    restore_interrupts(flags);
 }
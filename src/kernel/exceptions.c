@@ -3,8 +3,11 @@
  */
 
 #include "arch_x86/cpu.h"
+#include "arch_x86/gdt.h"
 #include "arch_x86/idt.h"
 #include "device/console.h"
+#include "kernel/task.h"
+#include "kernel/vmm.h"
 #include "lib/util.h"
 
 char* exception_msgs[] = {
@@ -41,7 +44,6 @@ extern isr_t isr04;
 extern isr_t isr05;
 extern isr_t isr06;
 extern isr_t isr07;
-extern isr_t isr08;
 extern isr_t isr09;
 extern isr_t isr10;
 extern isr_t isr11;
@@ -74,6 +76,8 @@ extern isr_t isr46;
 extern isr_t isr47;
 
 
+static void double_fault();
+
 void exceptions_init() {
     idt_set(0, &isr00);
     idt_set(1, &isr01);
@@ -83,7 +87,9 @@ void exceptions_init() {
     idt_set(5, &isr05);
     idt_set(6, &isr06);
     idt_set(7, &isr07);
-    idt_set(8, &isr08);
+    // a task gate: a double fault may mean the kernel stack is unusable
+    gdt_set_double_fault_task(double_fault);
+    idt_set_task_gate(8, DOUBLE_FAULT_TSS_SEL);
     idt_set(9, &isr09);
     idt_set(10, &isr10);
     idt_set(11, &isr11);
@@ -108,17 +114,79 @@ void exceptions_init() {
     idt_set(39, &isr39);
     idt_set(40, &isr40);
     idt_set(41, &isr41);
-    idt_set(41, &isr42);
-    idt_set(42, &isr43);
-    idt_set(43, &isr44);
-    idt_set(44, &isr45);
-    idt_set(45, &isr46);
-    idt_set(46, &isr47);
+    idt_set(42, &isr42);
+    idt_set(43, &isr43);
+    idt_set(44, &isr44);
+    idt_set(45, &isr45);
+    idt_set(46, &isr46);
+    idt_set(47, &isr47);
 }
 
-_Noreturn
-uint32_t handle_exception(interrupt_frame_t* frame) {
-    print("\nCPU Exception: ");
+#define EXC_PAGE_FAULT 14
+#define PFERR_PRESENT  0x01    // page fault error code: protection violation
+#define PFERR_WRITE    0x02    // page fault error code: write access
+
+static void print_exception(interrupt_frame_t* frame) {
     print(exception_msgs[frame->int_no]);
+    if (frame->int_no == EXC_PAGE_FAULT) {
+        print(" at 0x");
+        print_hex32(read_cr2());
+    }
+}
+
+/**
+ * The double fault task (see gdt_set_double_fault_task). A kernel stack
+ * overflow shows up as one, with the interrupted stack pointer at the
+ * guard page below the current task's stack.
+ */
+_Noreturn static void double_fault() {
+    task_t* t = get_current_task();
+    uint32_t esp = tss_interrupted_esp();
+    uint32_t bottom = t->kstack - KSTACK_SIZE;
+
+    print("\nCPU Exception: ");
+    print(exception_msgs[8]);
+    if (esp >= bottom - PAGE_SIZE && esp < bottom + 256) {
+        print(" (kernel stack overflow in ");
+        print(t->name);
+        print(")");
+    }
+    halt();
+}
+
+/**
+ * A user-mode fault on a not-present page of a demand-paged program
+ * brings the page in (or grows the stack), and a write fault on a
+ * copy-on-write page copies it; either way the instruction is restarted. Any other exception in
+ * user mode ends the task that raised it; one in the kernel halts the
+ * system.
+ */
+void handle_exception(interrupt_frame_t* frame) {
+    if ((frame->cs & 3) == 3) {
+        if (frame->int_no == EXC_PAGE_FAULT && !(frame->error_code & PFERR_PRESENT)
+            && task_page_fault(read_cr2()) == 0) {
+            return;
+        }
+        if (frame->int_no == EXC_PAGE_FAULT && (frame->error_code & PFERR_PRESENT)
+            && (frame->error_code & PFERR_WRITE)
+            && vmm_copy_on_write(get_current_task()->page_dir, read_cr2()) == 0) {
+            return;
+        }
+        print("\n");
+        print(get_current_task()->name);
+        print(": ");
+        print_exception(frame);
+        if (frame->int_no == EXC_PAGE_FAULT
+            && read_cr2() >= USER_STACK_TOP - USER_STACK_MAX - PAGE_SIZE
+            && read_cr2() < USER_STACK_TOP - USER_STACK_MAX) {
+            print(" (stack overflow)");
+        }
+        print("\n");
+        exit_task(-1);
+        return;
+    }
+
+    print("\nCPU Exception: ");
+    print_exception(frame);
     halt();
 }
@@ -1,9 +1,66 @@
+#include "arch_x86/cpu.h"
 #include "device/pic.h"
+#include "device/pit.h"
 #include "kernel/exceptions.h"
+#include "kernel/scheduler.h"
+#include "kernel/smp.h"
+#include "kernel/syscall.h"
 
+/**
+ * Called by isr_common (isr.asm) once the registers are saved. Takes the
+ * kernel lock (see smp.c) and saves the current task's kernel stack
+ * pointer, which points at the interrupt frame. If this interrupt arrived
+ * inside another handler on the same task (one that runs with interrupts
+ * on, like the page fault handler), the value replaced is that handler's
+ * frame; it is kept in the frame's esp slot, which popa ignores.
+ */
+void isr_enter(interrupt_frame_t* frame) {
+    cpu_t* cpu = this_cpu();
+    cpu->entry_tsc = rdtsc();   // for the IRQ latency stats (see handle_irq)
+    kernel_lock();
+
+    frame->esp = cpu->current->esp;
+    cpu->current->esp = (uint32_t)frame;
+}
+
+/**
+ * Called by isr_common after isr_handler: returns the frame of the
+ * (possibly different) current task to resume, and gives that task back
+ * the frame of its outer handler, if any.
+ */
+uint32_t isr_exit() {
+    task_t* t = current_task;
+    uint32_t frame = t->esp;
+    t->esp = ((interrupt_frame_t*)frame)->esp;
+    return frame;
+}
+
+/**
+ * Called by isr_common on the resumed task's stack: drops the kernel lock
+ * if the task is going back to user mode, or is this CPU's idle task.
+ * Kernel code keeps it; it is dropped when the task blocks or is
+ * preempted in favor of one that doesn't.
+ */
+void isr_leave(interrupt_frame_t* frame) {
+    cpu_t* cpu = this_cpu();
+    if ((frame->cs & 3) == 3 || cpu->current == cpu->idle) {
+        kernel_unlock();
+    }
+}
 
 void isr_handler(interrupt_frame_t frame) {
-    (frame.int_no < 32)
-        ? handle_exception(&frame)
-        : handle_irq(&frame);
+    if (frame.int_no < 32) {
+        handle_exception(&frame);
+    } else if (frame.int_no == SYSCALL_VECTOR) {
+        handle_syscall(&frame);
+    } else if (frame.int_no == YIELD_VECTOR) {
+        schedule(READY);
+    } else {
+        handle_irq(&frame);
+    }
+
+    // a task woken by this interrupt may outrank the one interrupted
+    sched_preempt();
+    // and the timer only needs to tick if that task has turns to take
+    pit_update();
 }
@@ -33,6 +33,17 @@ isr00:
 ; Debug Exception
 ;
 isr01:
+    ; SYSENTER keeps a single-stepping task's TF until sysenter_entry
+    ; clears it, so each instruction up to there traps; carry on with no
+    ; handler (the stack is only a few words deep at the first one)
+    test    byte [esp + 4], 3
+    jnz     .trap
+    cmp     dword [esp], sysenter_entry
+    jb      .trap
+    cmp     dword [esp], sysenter_flags_clean
+    ja      .trap
+    iret
+.trap:
     push    0
     push    1
     jmp     isr_common
@@ -262,18 +273,99 @@ isr47:
     push    47
     jmp     isr_common
 
+; -----------------------------------------------------------------------------
+; Local APIC interrupts
+; -----------------------------------------------------------------------------
+
+;
+; APIC timer
+;
+isr48:
+    push    0
+    push    48
+    jmp     isr_common
+
+;
+; Spurious interrupt: it isn't acknowledged (no EOI), and there is nothing to do
+;
+isr255:
+    iret
+
+;
+; Reschedule IPI, sent by another CPU that queued a task for this one
+;
+isr49:
+    push    0
+    push    49
+    jmp     isr_common
 
 ; -----------------------------------------------------------------------------
-; Common stub
+; System call (INT 0x80, callable from ring 3)
 ; -----------------------------------------------------------------------------
 
-extern current_task
+isr128:
+    push    0
+    push    128
+    jmp     isr_common
+
+; -----------------------------------------------------------------------------
+; System call (SYSENTER, callable from ring 3; see syscall.c)
+; -----------------------------------------------------------------------------
 
-struc task_t
-    .esp    resd 1
-endstruc
+USER_CS         equ 0x1B
+USER_DS         equ 0x23
+EFLAGS_TF       equ 0x100
+EFLAGS_IF       equ 0x200
+KERNEL_EFLAGS   equ 0x2                 ; only the always-set bit: no TF, IF, DF or NT
+SYSENTER_MARK   equ 0xFFFFFFFF          ; in the error code slot: no exception pushes this
+
+extern sysenter_return
+
+;
+; SYSENTER comes here with interrupts off and esp pointing at a copy of
+; this CPU's TSS.esp0; the user stack pointer is in ebp (see
+; syscall_sysenter). Build the frame INT 0x80 would have pushed from
+; ring 3, with interrupts on in the saved eflags (SYSENTER cleared IF) and
+; the return at sysenter_return. SYSENTER leaves the rest of the user's
+; flags alone, so load clean ones before going on: a set TF would trap on
+; every kernel instruction and NT would turn the next IRET into a task
+; return. (DF is cleared too; isr_common's cld covers that either way.)
+;
+sysenter_entry:
+    mov     esp, [esp]              ; the current task's kernel stack
+    push    USER_DS                 ; ss
+    push    ebp                     ; esp
+    pushfd
+    or      dword [esp], EFLAGS_IF
+    push    KERNEL_EFLAGS
+    popfd
+sysenter_flags_clean:
+    push    USER_CS
+    push    sysenter_return         ; eip
+    push    SYSENTER_MARK           ; error code
+    push    128                     ; interrupt vector
+    jmp     isr_common
+
+; -----------------------------------------------------------------------------
+; Yield (INT 0x81, kernel only): reschedule through the common stub
+; -----------------------------------------------------------------------------
+
+isr129:
+    push    0
+    push    129
+    jmp     isr_common
+
+
+; -----------------------------------------------------------------------------
+; Common stub
+; -----------------------------------------------------------------------------
+
+extern isr_enter
+extern isr_exit
+extern isr_leave
 
 isr_common:
+    cld                             ; the kernel's string instructions count up
     pusha
     push    ds
     push    es
@@ -287,18 +379,32 @@ isr_common:
     mov     fs, eax
     mov     gs, eax
 
-    ; Save current task's kernel stack pointer (pointing at the full interrupt frame)
-    mov     edi, [current_task]
-    mov     [edi + task_t.esp], esp
+    ; Take the kernel lock and save the current task's kernel stack pointer
+    ; (pointing at the full interrupt frame); see isr_enter
+    push    esp
+    call    isr_enter
+    add     esp, 4
 
-    mov     [esp + 28], esp         ; store current esp in its position in stack (as pushed by `pusha` above)
     call    isr_handler
 
-    ; Restore (possibly different) current task's kernel stack pointer
-    mov     edi, [current_task]
-    mov     esp, [edi + task_t.esp]
+    ; Switch to the (possibly different) current task's kernel stack, and
+    ; drop the kernel lock if that task is going back to user mode
+    call    isr_exit
+    mov     esp, eax
+    push    esp
+    call    isr_leave
+    add     esp, 4
 
 isr_return:
+    ; a task that entered with SYSENTER goes back with SYSEXIT, unless it
+    ; is single-stepping: POPFD would set TF before SYSEXIT and trap in
+    ; the kernel, where IRET sets it along with the switch to ring 3
+    cmp     dword [esp + 52], SYSENTER_MARK
+    jne     iret_return
+    test    dword [esp + 64], EFLAGS_TF
+    jz      sysexit_return
+
+iret_return:
     pop     gs
     pop     fs
     pop     es
@@ -309,6 +415,30 @@ isr_return:
 
     iret
 
+;
+; SYSEXIT takes the user eip from edx and esp from ecx (both lost to the
+; task; the stub expects that), and loads cs/ss. The saved eflags (TF is
+; clear; see isr_return) are
+; restored with IF clear, and STI sets it only after SYSEXIT, so no
+; interrupt can come in on this stack in between (the kernel lock is
+; already dropped).
+;
+sysexit_return:
+    pop     gs
+    pop     fs
+    pop     es
+    pop     ds
+    popa
+
+    add     esp, 0x8                ; pop int_no and error_code
+    mov     edx, [esp]              ; eip
+    mov     ecx, [esp + 12]         ; esp
+    add     esp, 0x8                ; to eflags
+    and     dword [esp], ~EFLAGS_IF
+    popfd
+    sti
+    sysexit
+
 ; -----------------------------------------------------------------------------
 ; Export symbols
 ; -----------------------------------------------------------------------------
@@ -353,3 +483,14 @@ global isr44
 global isr45
 global isr46
 global isr47
+
+global isr48
+global isr49
+global isr255
+
+; System call
+global isr128
+global sysenter_entry
+
+; Yield
+global isr129
@@ -6,6 +6,8 @@
 #include "arch_x86/gdt.h"
 #include "arch_x86/idt.h"
 #include "arch_x86/task_switch.h"
+#include "device/apic.h"
+#include "device/ata.h"
 #include "device/bga.h"
 #include "device/console.h"
 #include "device/keyboard.h"
@@ -13,81 +15,129 @@
 #include "device/pit.h"
 #include <gui/font.h>
 #include <gui/gui.h>
+#include "kernel/bcache.h"
 #include "kernel/exceptions.h"
+#include "kernel/pmm.h"
+#include "kernel/scheduler.h"
+#include "kernel/smp.h"
+#include "kernel/syscall.h"
 #include "kernel/task.h"
+#include "kernel/vector.h"
+#include "kernel/vmm.h"
+#include "lib/util.h"
 #include "../shell/shell.h"
 
-extern task_t* current_task;
+// section boundaries from kernel.ld
+extern uint8_t __bss_start[];
+extern uint8_t __bss_end[];
 
 _Noreturn void thread(int _tid);
 _Noreturn void thread2(int _tid);
 _Noreturn void thread3(int _tid);
 
 void kmain() {
+    // .bss isn't part of the disk image; clear it before anything uses it
+    memset(__bss_start, 0, __bss_end - __bss_start);
+
     disable_cursor();
     clear_screen();
 
     print("Booting kernel...\n");
 
+    pmm_init();
+    // before vmm_init makes the user-accessible pages read-only
+    syscall_detect();
+    vmm_init();
+
     gdt_init();
+    // the boot CPU holds the kernel lock until the first task runs
+    kernel_lock();
     idt_init();
     exceptions_init();
+    syscall_init();
+    sched_init();
     pic_init();
     pit_init();
     keyboard_init(handle_key_event);
+    ata_init();
+    bcache_init();
+    // the 8259s remain the fallback if there are no APICs (and then the
+    // other CPUs stay asleep)
+    _Bool apic = (apic_init() == 0);
+    if (apic) {
+        irq_use_apic(1);
+    }
 
     //  gui_init();
 
     task_t* idle_task = create_task("idle", idle);
+    set_task_priority(idle_task->id, PRIORITY_IDLE);   // runs when nothing else can
+    sched_pin(idle_task, 0);
+    this_cpu()->idle = idle_task;
     task_t* shell_task = create_task("shell", shell);
-    create_user_task("dots1",thread);
-    create_user_task("dots2",thread2);
-    create_user_task("dots3",thread3);
+    // preempts the busy tasks as soon as a key arrives
+    set_task_priority(shell_task->id, PRIORITY_INTERACTIVE);
+    // and stays on the boot CPU, which keeps the time and gets the IRQs
+    sched_pin(shell_task, 0);
+    // the dots tasks exit when they are done drawing, and nobody waits
+    // for them; after that the machine goes idle (and tickless)
+    detach_task(create_user_task("dots1",thread)->id);
+    detach_task(create_user_task("dots2",thread2)->id);
+    detach_task(create_user_task("dots3",thread3)->id);
+
+    // wake up the other CPUs; they wait for the kernel lock, and then
+    // steal their share of the tasks
+    if (apic) {
+        smp_init();
+    }
 
     set_active_task(shell_task);
 
     // Start executing the idle task as task 0; this never returns.
     current_task = idle_task;
     tss_set_kernel_stack(idle_task->kstack);
-    current_task->state = RUNNING;
+    set_task_state(idle_task->id, RUNNING);
+    kernel_unlock();
     resume_new_task(current_task);
 }
 
-_Noreturn
+// The dots tasks run in ring 3, so they may only call user-accessible
+// code (USER_TEXT), such as the system call stubs.
+USER_TEXT _Noreturn
 void thread(int _tid) {
     int tid = 1;
     for (int row = (tid * 3); row < (tid * 3 + 3); row++) {
         for (int col = 0; col < 80; col++) {
 //            put_char('.', (BLACK << 4 | tid + 1), row, col);
-            put_char('.', (BLACK << 4 | YELLOW), row, col);
+            user_put_char('.', (BLACK << 4 | YELLOW), row, col);
             for (int i=0; i<250000; i++);
         }
     }
-    for(;;);
+    user_exit_task(0);
 }
 
-_Noreturn
+USER_TEXT _Noreturn
 void thread2(int _tid) {
     int tid = 2;
     for (int row = (tid * 3); row < (tid * 3 + 3); row++) {
         for (int col = 0; col < 80; col++) {
 //            put_char('.', (BLACK << 4 | tid + 1), row, col);
-            put_char('.', (BLACK << 4 | RED_LT), row, col);
+            user_put_char('.', (BLACK << 4 | RED_LT), row, col);
             for (int i=0; i<250000; i++);
         }
     }
-    for(;;);
+    user_exit_task(0);
 }
 
-_Noreturn
+USER_TEXT _Noreturn
 void thread3(int _tid) {
     int tid = 3;
     for (int row = (tid * 3); row < (tid * 3 + 3); row++) {
         for (int col = 0; col < 80; col++) {
 //            put_char('.', (BLACK << 4 | tid + 1), row, col);
-            put_char('.', (BLACK << 4 | CYAN_LT), row, col);
+            user_put_char('.', (BLACK << 4 | CYAN_LT), row, col);
             for (int i=0; i<250000; i++);
         }
     }
-    for(;;);
+    user_exit_task(0);
 }
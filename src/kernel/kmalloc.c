@@ -0,0 +1,363 @@
+/**
+ * Kernel Heap
+ *
+ * General-purpose kmalloc/kfree for variable-sized kernel buffers (fixed
+ * objects use slab caches instead).
+ *
+ * Small requests are carved from 64KB arenas taken from the pmm. Every
+ * chunk in an arena carries a boundary tag at both ends (size + in-use
+ * bit), so a freed chunk finds its neighbours in O(1) and merges with
+ * whichever of them is free. Free chunks are kept on segregated lists:
+ * one exact-size list per 8 bytes below 512, then one list per power of
+ * two. A bitmap of non-empty lists lets an allocation jump straight to the
+ * smallest list that can satisfy it; the chunk found is split and the
+ * tail goes back on its list.
+ *
+ * Requests above KMALLOC_LARGE bypass the arenas and get their own
+ * page-aligned block from the pmm. They have no header (a 64KB buffer
+ * would otherwise need 128KB); their orders are kept in a small table.
+ *
+ * Building with KMALLOC_POISON=1 fills freed memory with a pattern and
+ * checks that it is still intact when the memory is handed out again,
+ * which catches writes through stale pointers.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include "arch_x86/cpu.h"
+#include "device/console.h"
+#include "kernel/kmalloc.h"
+#include "kernel/pmm.h"
+#include "lib/util.h"
+
+#ifndef KMALLOC_POISON
+#define KMALLOC_POISON  0
+#endif
+
+#define ARENA_ORDER     4                      // 16 frames
+#define ARENA_SIZE      (FRAME_SIZE << ARENA_ORDER)
+#define KMALLOC_LARGE   (8 * 1024)
+#define MAX_LARGE       128                    // live page-backed allocations
+
+#define CHUNK_MAGIC     0x4B4D4348
+#define CHUNK_USED      1u
+#define CHUNK_HDR       8                      // size + magic
+#define CHUNK_OVERHEAD  (CHUNK_HDR + 4)        // header + footer
+#define CHUNK_MIN       24                     // header, list links, footer
+
+#define SMALL_BINS      64                     // exact bins, 8 bytes apart
+#define NBINS           (SMALL_BINS + 8)       // + one per power of two up to 64KB
+
+#define POISON_FREE     0x6B
+#define POISON_ALLOC    0xA5
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((a) - 1))
+
+typedef struct chunk {
+    uint32_t size;            // whole chunk in bytes | CHUNK_USED
+    uint32_t magic;
+    struct chunk* next;       // free list links (free chunks only)
+    struct chunk* prev;
+} chunk_t;
+
+typedef struct large_alloc {
+    uint32_t addr;            // 0 if the slot is unused
+    uint32_t order;
+} large_alloc_t;
+
+static chunk_t* bins[NBINS];
+static uint32_t binmap[(NBINS + 31) / 32];
+static large_alloc_t large[MAX_LARGE];
+static kmalloc_stats_t stats;
+
+static inline uint32_t chunk_size(chunk_t* c) {
+    return c->size & ~CHUNK_USED;
+}
+
+static inline uint32_t* chunk_footer(chunk_t* c) {
+    return (uint32_t*)((uint8_t*)c + chunk_size(c) - 4);
+}
+
+static inline void set_tags(chunk_t* c, uint32_t size, uint32_t used) {
+    c->size = size | used;
+    c->magic = CHUNK_MAGIC;
+    *chunk_footer(c) = size | used;
+}
+
+static inline uint32_t bin_index(uint32_t size) {
+    if (size < SMALL_BINS * 8) {
+        return size >> 3;
+    }
+    // 512..1023 -> SMALL_BINS, 1024..2047 -> SMALL_BINS + 1, ...
+    uint32_t bin = SMALL_BINS + (31 - __builtin_clz(size)) - 9;
+    return bin < NBINS ? bin : NBINS - 1;
+}
+
+static void bin_insert(chunk_t* c) {
+    uint32_t bin = bin_index(chunk_size(c));
+    c->prev = NULL;
+    c->next = bins[bin];
+    if (bins[bin]) {
+        bins[bin]->prev = c;
+    }
+    bins[bin] = c;
+    binmap[bin >> 5] |= 1u << (bin & 31);
+}
+
+static void bin_remove(chunk_t* c) {
+    uint32_t bin = bin_index(chunk_size(c));
+    if (c->prev) {
+        c->prev->next = c->next;
+    } else {
+        bins[bin] = c->next;
+    }
+    if (c->next) {
+        c->next->prev = c->prev;
+    }
+    if (bins[bin] == NULL) {
+        binmap[bin >> 5] &= ~(1u << (bin & 31));
+    }
+}
+
+#if KMALLOC_POISON
+static void poison_free(chunk_t* c) {
+    memset((uint8_t*)c + sizeof(chunk_t), POISON_FREE, chunk_size(c) - sizeof(chunk_t) - 4);
+}
+
+static void check_poison(chunk_t* c) {
+    uint8_t* p = (uint8_t*)c + sizeof(chunk_t);
+    uint8_t* end = (uint8_t*)chunk_footer(c);
+    for (; p < end; p++) {
+        if (*p != POISON_FREE) {
+            stats.poison_errors++;
+            print("kmalloc: freed memory modified at 0x");
+            print_hex32((uint32_t)p);
+            print("\n");
+            return;
+        }
+    }
+}
+#endif
+
+/**
+ * Smallest free chunk of at least `size` bytes, or NULL. The exact bins
+ * hold chunks of a single size, so only the power-of-two bins need a scan.
+ */
+static chunk_t* find_chunk(uint32_t size) {
+    uint32_t bin = bin_index(size);
+    if (bin >= SMALL_BINS) {
+        for (chunk_t* c = bins[bin]; c; c = c->next) {
+            if (chunk_size(c) >= size) {
+                return c;
+            }
+        }
+        bin++;
+    }
+
+    for (uint32_t w = bin >> 5; w < sizeof(binmap) / sizeof(binmap[0]); w++) {
+        uint32_t bits = binmap[w];
+        if (w == bin >> 5) {
+            bits &= ~0u << (bin & 31);
+        }
+        if (bits) {
+            return bins[(w << 5) + __builtin_ctz(bits)];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Add a fresh arena as one free chunk, bracketed by in-use fence tags so
+ * coalescing never runs off either end.
+ */
+static _Bool grow() {
+    uint8_t* arena = (uint8_t*)pmm_alloc_frames(ARENA_ORDER);
+    if (arena == NULL) {
+        return 0;
+    }
+
+    *(uint32_t*)(arena + 4) = CHUNK_USED;                     // fence footer
+    chunk_t* end = (chunk_t*)(arena + ARENA_SIZE - CHUNK_HDR);
+    end->size = CHUNK_USED;                                   // fence header
+    end->magic = CHUNK_MAGIC;
+
+    chunk_t* c = (chunk_t*)(arena + CHUNK_HDR);
+    set_tags(c, ARENA_SIZE - 2 * CHUNK_HDR, 0);
+#if KMALLOC_POISON
+    poison_free(c);
+#endif
+    bin_insert(c);
+    stats.arenas++;
+    return 1;
+}
+
+static void* alloc_large(size_t size) {
+    large_alloc_t* slot = NULL;
+    for (int i = 0; i < MAX_LARGE && slot == NULL; i++) {
+        if (large[i].addr == 0) {
+            slot = &large[i];
+        }
+    }
+    if (slot == NULL) {
+        return NULL;
+    }
+
+    uint32_t order = 0;
+    while ((FRAME_SIZE << order) < size) {
+        order++;
+    }
+    uint32_t addr = pmm_alloc_frames(order);
+    if (addr == 0) {
+        return NULL;
+    }
+    slot->addr = addr;
+    slot->order = order;
+    stats.large++;
+    stats.bytes_in_use += FRAME_SIZE << order;
+    return (void*)addr;
+}
+
+/**
+ * Free a page-backed allocation. Returns 0 if `ptr` is not one.
+ */
+static _Bool free_large(void* ptr) {
+    for (int i = 0; i < MAX_LARGE; i++) {
+        if (large[i].addr == (uint32_t)ptr) {
+            pmm_free_frames(large[i].addr, large[i].order);
+            stats.large--;
+            stats.bytes_in_use -= FRAME_SIZE << large[i].order;
+            large[i].addr = 0;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void* kmalloc(size_t size) {
+    if (size == 0 || size > (FRAME_SIZE << PMM_MAX_ORDER)) {
+        return NULL;
+    }
+
+    uint32_t flags = save_and_disable_interrupts();
+    stats.allocs++;
+
+    if (size > KMALLOC_LARGE) {
+        void* p = alloc_large(size);
+        if (p == NULL) {
+            stats.failures++;
+        }
+        restore_interrupts(flags);
+        return p;
+    }
+
+    uint32_t need = ALIGN_UP(size + CHUNK_OVERHEAD, 8);
+    if (need < CHUNK_MIN) {
+        need = CHUNK_MIN;
+    }
+
+    chunk_t* c = find_chunk(need);
+    if (c == NULL) {
+        if (!grow()) {
+            stats.failures++;
+            restore_interrupts(flags);
+            return NULL;
+        }
+        c = find_chunk(need);
+    }
+    bin_remove(c);
+
+    // split off the tail if it is big enough to be a chunk of its own
+    uint32_t csize = chunk_size(c);
+    if (csize - need >= CHUNK_MIN) {
+        chunk_t* rest = (chunk_t*)((uint8_t*)c + need);
+        set_tags(rest, csize - need, 0);
+        bin_insert(rest);
+        csize = need;
+    }
+    set_tags(c, csize, CHUNK_USED);
+
+#if KMALLOC_POISON
+    check_poison(c);
+    memset((uint8_t*)c + CHUNK_HDR, POISON_ALLOC, csize - CHUNK_OVERHEAD);
+#endif
+
+    stats.bytes_in_use += csize;
+    restore_interrupts(flags);
+    return (uint8_t*)c + CHUNK_HDR;
+}
+
+void* kzalloc(size_t size) {
+    void* p = kmalloc(size);
+    if (p) {
+        memset(p, 0, size);
+    }
+    return p;
+}
+
+void kfree(void* ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+
+    chunk_t* c = (chunk_t*)((uint8_t*)ptr - CHUNK_HDR);
+    uint32_t flags = save_and_disable_interrupts();
+
+    // page-backed allocations are frame aligned (an arena chunk may be too)
+    if (((uint32_t)ptr & (FRAME_SIZE - 1)) == 0 && free_large(ptr)) {
+        stats.frees++;
+        restore_interrupts(flags);
+        return;
+    }
+
+    if (c->magic != CHUNK_MAGIC || !(c->size & CHUNK_USED)) {
+        print("kfree: bad or double free of 0x");
+        print_hex32((uint32_t)ptr);
+        print("\n");
+        restore_interrupts(flags);
+        return;
+    }
+
+    uint32_t size = chunk_size(c);
+    stats.bytes_in_use -= size;
+    stats.frees++;
+
+    // merge with the following chunk
+    chunk_t* next = (chunk_t*)((uint8_t*)c + size);
+    if (!(next->size & CHUNK_USED)) {
+        bin_remove(next);
+        size += chunk_size(next);
+        next->magic = 0;
+    }
+
+    // merge with the preceding chunk, found through its footer
+    uint32_t prev_tag = *(uint32_t*)((uint8_t*)c - 4);
+    if (!(prev_tag & CHUNK_USED)) {
+        chunk_t* prev = (chunk_t*)((uint8_t*)c - prev_tag);
+        bin_remove(prev);
+        size += prev_tag;
+        c->magic = 0;
+        c = prev;
+    }
+
+    set_tags(c, size, 0);
+
+    // hand a completely free arena back to the pmm, but keep the last one
+    if (size == ARENA_SIZE - 2 * CHUNK_HDR && stats.arenas > 1) {
+        stats.arenas--;
+        pmm_free_frames((uint32_t)c - CHUNK_HDR, ARENA_ORDER);
+        restore_interrupts(flags);
+        return;
+    }
+
+#if KMALLOC_POISON
+    poison_free(c);
+#endif
+    bin_insert(c);
+    restore_interrupts(flags);
+}
+
+void kmalloc_get_stats(kmalloc_stats_t* out) {
+    uint32_t flags = save_and_disable_interrupts();
+    *out = stats;
+    restore_interrupts(flags);
+}
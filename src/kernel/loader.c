@@ -1,85 +1,461 @@
 /**
  * Task Loader
  *
- * Reads a file table from sector 1 of the disk to find task locations.
- * File table format (512 bytes):
- *   - 4 bytes: number of entries
- *   - For each entry (24 bytes):
+ * Reads a file table from sectors 1-4 of the disk to find task locations.
+ * The table is read once and stays resident; a name is looked up through
+ * its open-addressed hash index, normally one probe and one strcmp.
+ * Files are read in one go: the whole extent (`size` sectors) is handed
+ * to the block cache as a single request.
+ *
+ * Programs are ELF32 executables that run at USER_BASE in the address
+ * space of their task; every copy of a program runs at the same virtual
+ * address. spawn() runs an image as a user task.
+ *
+ * Static executables (ET_EXEC, linked at USER_BASE) are demand paged:
+ * loading only records their PT_LOAD segments, and each page is read from
+ * the file (through the block cache) the first time the task touches it,
+ * with the rest of the page (.bss) zero-filled. Start-up cost is then
+ * proportional to the code a program actually runs.
+ *
+ * Position-independent executables (ET_DYN) are loaded up front into a
+ * region of their own, a block of frames from the pmm sized to the image,
+ * since the R_386_RELATIVE relocations listed in PT_DYNAMIC are applied
+ * (for USER_BASE) to the whole image at once.
+ *
+ * File table format (4 sectors):
+ *   - Header (16 bytes): magic "BFFT", number of entries, number of index
+ *     slots (a power of two), size of the table in sectors
+ *   - Index (FILETABLE_INDEX_SLOTS x 2 bytes): entry number + 1 per slot,
+ *     0 if empty; linear probing from (hash & (slots - 1))
+ *   - For each entry (28 bytes):
  *     - 16 bytes: null-terminated name
+ *     - 4 bytes: FNV-1a hash of the name
  *     - 4 bytes: sector number
  *     - 4 bytes: size in sectors
  */
 
 #include <stddef.h>
 #include <stdint.h>
-#include "device/ata.h"
+#include "kernel/bcache.h"
+#include "kernel/elf.h"
+#include "kernel/kmalloc.h"
 #include "kernel/vector.h"
 #include "kernel/loader.h"
+#include "kernel/pmm.h"
+#include "kernel/task.h"
+#include "kernel/vmm.h"
 #include "lib/util.h"
 
-#define TASK_LOAD_ADDR 0xf000
+#define PROGRAM_MAX_SIZE    (FRAME_SIZE << PMM_MAX_ORDER)
+#define MAX_PHDRS           8
 #define FILETABLE_SECTOR 1
+#define FILETABLE_SECTORS 4
+#define FILETABLE_MAGIC 0x54464642  // "BFFT"
+#define FILETABLE_INDEX_SLOTS 128
 #define FILETABLE_NAME_SIZE 16
-#define FILETABLE_ENTRY_SIZE 24
-#define FILETABLE_MAX_ENTRIES 21
-
-extern kernel_vector_t kernel_vectors[];
-
-typedef void (*task_fn_t)(kernel_vector_t[]);
+#define FILETABLE_ENTRY_SIZE 28
+#define FILETABLE_HEADER_SIZE (16 + FILETABLE_INDEX_SLOTS * 2)
+#define FILETABLE_MAX_ENTRIES \
+    ((FILETABLE_SECTORS * SECTOR_SIZE - FILETABLE_HEADER_SIZE) / FILETABLE_ENTRY_SIZE)
 
 // File table entry (matches the on-disk format)
-typedef struct __attribute__((packed)) {
+typedef struct __attribute__((packed)) filetable_entry {
     char name[FILETABLE_NAME_SIZE];
+    uint32_t hash;
     uint32_t sector;
     uint32_t size;
 } filetable_entry_t;
 
-// File table header
+// File table (matches the on-disk format)
 typedef struct __attribute__((packed)) {
+    uint32_t magic;
     uint32_t num_entries;
+    uint32_t index_slots;
+    uint32_t sectors;
+    uint16_t index[FILETABLE_INDEX_SLOTS];
     filetable_entry_t entries[FILETABLE_MAX_ENTRIES];
+    uint8_t padding[FILETABLE_SECTORS * SECTOR_SIZE - FILETABLE_HEADER_SIZE
+                    - FILETABLE_MAX_ENTRIES * FILETABLE_ENTRY_SIZE];
 } filetable_t;
 
-static filetable_t filetable;
+static filetable_t filetable __attribute__((aligned(4)));
 static int filetable_loaded = 0;
 
+// must match tools/gen_filetable.c
+static uint32_t fnv1a(const char* s) {
+    uint32_t h = 2166136261u;
+    while (*s) {
+        h ^= (uint8_t)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
 static void load_filetable() {
     if (filetable_loaded) return;
     
-    read_sectors(FILETABLE_SECTOR, 1, (uint32_t*)&filetable);
+    int read_count = bcache_read(FILETABLE_SECTOR, FILETABLE_SECTORS, &filetable);
+    if (read_count != FILETABLE_SECTORS
+        || filetable.magic != FILETABLE_MAGIC
+        || filetable.index_slots != FILETABLE_INDEX_SLOTS
+        || filetable.num_entries > FILETABLE_MAX_ENTRIES) {
+        // treat a missing or unknown table as empty
+        memset(&filetable, 0, sizeof(filetable));
+    }
     filetable_loaded = 1;
 }
 
-int lookup_task_sector(const char* name) {
+static filetable_entry_t* lookup_file(const char* name) {
     load_filetable();
-    
-    for (uint32_t i = 0; i < filetable.num_entries; i++) {
-        if (strcmp(filetable.entries[i].name, name) == 0) {
-            return filetable.entries[i].sector;
+
+    uint32_t hash = fnv1a(name);
+    uint32_t slot = hash & (FILETABLE_INDEX_SLOTS - 1);
+    for (int probes = 0; probes < FILETABLE_INDEX_SLOTS; probes++) {
+        uint16_t n = filetable.index[slot];
+        if (n == 0 || n > filetable.num_entries) {
+            break;
+        }
+        filetable_entry_t* entry = &filetable.entries[n - 1];
+        if (entry->hash == hash && strcmp(entry->name, name) == 0) {
+            return entry;
+        }
+        slot = (slot + 1) & (FILETABLE_INDEX_SLOTS - 1);
+    }
+    return NULL;
+}
+
+/**
+ * Size of a file in sectors, or -1 if there is no such file.
+ */
+int file_sectors(const char* name) {
+    filetable_entry_t* entry = lookup_file(name);
+    return entry ? (int)entry->size : -1;
+}
+
+int load_file(const char* name, void* dest, size_t max_sectors) {
+    filetable_entry_t* entry = lookup_file(name);
+    if (entry == NULL || entry->size == 0 || entry->size > max_sectors) {
+        return -1;
+    }
+
+    int read_count = bcache_read(entry->sector, entry->size, dest);
+    return (read_count == entry->size) ? read_count : -1;
+}
+
+/**
+ * Read `len` bytes at byte `offset` of a file. Whole sectors go straight
+ * into `dest` in one request; partial ones are staged in a bounce buffer.
+ * Page faults read through here too, so it must be reentrant.
+ */
+static int read_file_range(const filetable_entry_t* entry, uint32_t offset, size_t len, uint8_t* dest) {
+    uint8_t* bounce = NULL;
+
+    if (offset + len < offset || offset + len > entry->size * SECTOR_SIZE) {
+        return -1;
+    }
+
+    while (len > 0) {
+        uint32_t sector = offset / SECTOR_SIZE;
+        uint32_t skip = offset % SECTOR_SIZE;
+        size_t chunk;
+
+        if (skip == 0 && len >= SECTOR_SIZE) {
+            size_t n = len / SECTOR_SIZE;
+            if (bcache_read(entry->sector + sector, n, dest) != n) {
+                kfree(bounce);
+                return -1;
+            }
+            chunk = n * SECTOR_SIZE;
+        } else {
+            if (bounce == NULL && (bounce = kmalloc(SECTOR_SIZE)) == NULL) {
+                return -1;
+            }
+            if (bcache_read(entry->sector + sector, 1, bounce) != 1) {
+                kfree(bounce);
+                return -1;
+            }
+            chunk = SECTOR_SIZE - skip;
+            if (chunk > len) {
+                chunk = len;
+            }
+            memcpy(dest, bounce + skip, chunk);
+        }
+
+        offset += chunk;
+        dest += chunk;
+        len -= chunk;
+    }
+    kfree(bounce);
+    return 0;
+}
+
+static int check_ehdr(elf32_ehdr_t* ehdr) {
+    if (ehdr->e_ident[0] != ELFMAG0 || ehdr->e_ident[1] != ELFMAG1
+        || ehdr->e_ident[2] != ELFMAG2 || ehdr->e_ident[3] != ELFMAG3) {
+        return -1;
+    }
+    if (ehdr->e_ident[EI_CLASS] != ELFCLASS32 || ehdr->e_ident[EI_DATA] != ELFDATA2LSB
+        || ehdr->e_machine != EM_386 || (ehdr->e_type != ET_EXEC && ehdr->e_type != ET_DYN)) {
+        return -1;
+    }
+    if (ehdr->e_phentsize != sizeof(elf32_phdr_t) || ehdr->e_phnum == 0 || ehdr->e_phnum > MAX_PHDRS) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Apply the image's R_386_RELATIVE relocations (the only kind a static PIE
+ * has) to the copy at `base`, for the virtual address `vbase`.
+ */
+static int relocate(uint32_t base, uint32_t vbase, uint32_t span, elf32_phdr_t* dynamic) {
+    uint32_t rel = 0;
+    uint32_t relsz = 0;
+    uint32_t relent = sizeof(elf32_rel_t);
+
+    if (dynamic->p_vaddr + dynamic->p_memsz > span) {
+        return -1;
+    }
+    elf32_dyn_t* dyn = (elf32_dyn_t*)(base + dynamic->p_vaddr);
+    elf32_dyn_t* dyn_end = (elf32_dyn_t*)(base + dynamic->p_vaddr + dynamic->p_memsz);
+    for (; dyn < dyn_end && dyn->d_tag != DT_NULL; dyn++) {
+        switch (dyn->d_tag) {
+            case DT_REL:    rel = dyn->d_val; break;
+            case DT_RELSZ:  relsz = dyn->d_val; break;
+            case DT_RELENT: relent = dyn->d_val; break;
+        }
+    }
+
+    if (relsz == 0) {
+        return 0;
+    }
+    if (relent != sizeof(elf32_rel_t) || rel + relsz > span) {
+        return -1;
+    }
+
+    for (elf32_rel_t* r = (elf32_rel_t*)(base + rel); r < (elf32_rel_t*)(base + rel + relsz); r++) {
+        switch (ELF32_R_TYPE(r->r_info)) {
+            case R_386_NONE:
+                break;
+            case R_386_RELATIVE:
+                if (r->r_offset + 4 > span) {
+                    return -1;
+                }
+                *(uint32_t*)(base + r->r_offset) += vbase;
+                break;
+            default:
+                return -1;
+        }
+    }
+    return 0;
+}
+
+// smallest buddy order whose block holds `size` bytes
+static uint32_t region_order(uint32_t size) {
+    uint32_t order = 0;
+    while ((FRAME_SIZE << order) < size) {
+        order++;
+    }
+    return order;
+}
+
+/**
+ * Record the PT_LOAD segments of a static executable for program_page_in;
+ * nothing is read yet. The segments must lie within the file and within
+ * PROGRAM_MAX_SIZE bytes of USER_BASE.
+ */
+static int prepare_executable(const filetable_entry_t* entry, elf32_ehdr_t* ehdr,
+                              elf32_phdr_t* phdrs, program_t* prog) {
+    uint32_t end = USER_BASE;
+    uint32_t file_size = entry->size * SECTOR_SIZE;
+
+    for (int i = 0; i < ehdr->e_phnum; i++) {
+        elf32_phdr_t* ph = &phdrs[i];
+        if (ph->p_type != PT_LOAD || ph->p_memsz == 0) {
+            continue;
+        }
+        if (prog->n_segments == PROGRAM_MAX_SEGMENTS || ph->p_filesz > ph->p_memsz
+            || ph->p_vaddr < USER_BASE || ph->p_vaddr + ph->p_memsz < ph->p_vaddr
+            || ph->p_vaddr + ph->p_memsz > USER_BASE + PROGRAM_MAX_SIZE
+            || ph->p_offset + ph->p_filesz < ph->p_offset
+            || ph->p_offset + ph->p_filesz > file_size) {
+            return -1;
+        }
+        program_segment_t* seg = &prog->segments[prog->n_segments++];
+        seg->vaddr = ph->p_vaddr;
+        seg->memsz = ph->p_memsz;
+        seg->offset = ph->p_offset;
+        seg->filesz = ph->p_filesz;
+        seg->writable = (ph->p_flags & PF_W) != 0;
+        if (ph->p_vaddr + ph->p_memsz > end) {
+            end = ph->p_vaddr + ph->p_memsz;
         }
     }
-    return -1;
+    if (prog->n_segments == 0 || ehdr->e_entry < USER_BASE || ehdr->e_entry >= end) {
+        return -1;
+    }
+
+    prog->size = end - USER_BASE;
+    prog->entry = (program_entry_t)ehdr->e_entry;
+    prog->file = entry;
+    return 0;
 }
 
-int load_task(const char* name, uint32_t* dest) {
-    int read_count = 0;
+int load_program(const char* name, program_t* prog) {
+    filetable_entry_t* entry = lookup_file(name);
+    if (entry == NULL) {
+        return -1;
+    }
+
+    elf32_ehdr_t ehdr;
+    elf32_phdr_t phdrs[MAX_PHDRS];
+    if (read_file_range(entry, 0, sizeof(ehdr), (uint8_t*)&ehdr) != 0 || check_ehdr(&ehdr) != 0) {
+        return -1;
+    }
+    if (read_file_range(entry, ehdr.e_phoff, ehdr.e_phnum * sizeof(elf32_phdr_t), (uint8_t*)phdrs) != 0) {
+        return -1;
+    }
+
+    memset(prog, 0, sizeof(program_t));
+    if (ehdr.e_type == ET_EXEC) {
+        return prepare_executable(entry, &ehdr, phdrs, prog);
+    }
+
+    // the image must fit its region
+    uint32_t span = 0;
+    elf32_phdr_t* dynamic = NULL;
+    for (int i = 0; i < ehdr.e_phnum; i++) {
+        elf32_phdr_t* ph = &phdrs[i];
+        if (ph->p_type == PT_DYNAMIC) {
+            dynamic = ph;
+        }
+        if (ph->p_type != PT_LOAD) {
+            continue;
+        }
+        if (ph->p_filesz > ph->p_memsz || ph->p_vaddr + ph->p_memsz < ph->p_vaddr
+            || ph->p_vaddr + ph->p_memsz > PROGRAM_MAX_SIZE) {
+            return -1;
+        }
+        if (ph->p_vaddr + ph->p_memsz > span) {
+            span = ph->p_vaddr + ph->p_memsz;
+        }
+    }
+    if (span == 0 || ehdr.e_entry >= span) {
+        return -1;
+    }
+
+    uint32_t order = region_order(span);
+    uint32_t base = pmm_alloc_frames(order);
+    if (base == 0) {
+        return -1;
+    }
 
-    uint32_t sector = lookup_task_sector(name);
-    if (sector >= 0) {
-        read_count = read_sectors(sector, 1, dest);
+    for (int i = 0; i < ehdr.e_phnum; i++) {
+        elf32_phdr_t* ph = &phdrs[i];
+        if (ph->p_type != PT_LOAD) {
+            continue;
+        }
+        uint8_t* seg = (uint8_t*)(base + ph->p_vaddr);
+        if (read_file_range(entry, ph->p_offset, ph->p_filesz, seg) != 0) {
+            pmm_free_frames(base, order);
+            return -1;
+        }
+        memset(seg + ph->p_filesz, 0, ph->p_memsz - ph->p_filesz);
     }
 
-    return (read_count == 1) ? 0 : -1;
+    if (dynamic != NULL && relocate(base, USER_BASE, span, dynamic) != 0) {
+        pmm_free_frames(base, order);
+        return -1;
+    }
+
+    prog->order = order;
+    prog->base = base;
+    prog->size = span;
+    prog->entry = (program_entry_t)(USER_BASE + ehdr.e_entry);
+    return 0;
 }
 
-int exec(const char* name) {
-    // load
-    int load_result = load_task(name, (uint32_t*)TASK_LOAD_ADDR);
-    if (load_result == 0) {
-        // execute
-        task_fn_t task = (task_fn_t)TASK_LOAD_ADDR;
-        task(kernel_vectors);
+void unload_program(program_t* prog) {
+    if (prog->base != 0) {
+        pmm_free_frames(prog->base, prog->order);
+    }
+    prog->base = 0;
+    prog->file = NULL;
+}
+
+/**
+ * Bring in the page of a demand-paged image that holds `addr`: a fresh
+ * frame with the file-backed bytes of every segment covering the page
+ * read in and the rest zeroed, mapped user-accessible in `page_dir` (and
+ * writable if a writable segment covers it). The frame is owned by the
+ * address space. Returns 0, or -1 if no segment covers `addr` or the page
+ * could not be read or mapped. Runs with interrupts enabled.
+ */
+int program_page_in(program_t* prog, uint32_t page_dir, uint32_t addr) {
+    uint32_t page = addr & ~(PAGE_SIZE - 1);
+    uint32_t flags = PTE_USER | PTE_OWNED;
+    _Bool covered = 0;
+
+    for (int i = 0; i < prog->n_segments; i++) {
+        program_segment_t* seg = &prog->segments[i];
+        if (addr >= seg->vaddr && addr < seg->vaddr + seg->memsz) {
+            covered = 1;
+        }
+    }
+    if (prog->file == NULL || !covered) {
+        return -1;
+    }
+
+    uint32_t frame = pmm_alloc_frame();
+    if (frame == 0) {
+        return -1;
+    }
+    memset((void*)frame, 0, PAGE_SIZE);
+
+    for (int i = 0; i < prog->n_segments; i++) {
+        program_segment_t* seg = &prog->segments[i];
+        if (seg->vaddr >= page + PAGE_SIZE || seg->vaddr + seg->memsz <= page) {
+            continue;
+        }
+        if (seg->writable) {
+            flags |= PTE_WRITE;
+        }
+        // the part of the segment's file contents that falls in this page
+        uint32_t start = (seg->vaddr > page) ? seg->vaddr : page;
+        uint32_t file_end = seg->vaddr + seg->filesz;
+        uint32_t end = (file_end < page + PAGE_SIZE) ? file_end : page + PAGE_SIZE;
+        if (start < end
+            && read_file_range(prog->file, seg->offset + (start - seg->vaddr), end - start,
+                               (uint8_t*)(frame + (start - page))) != 0) {
+            pmm_free_frame(frame);
+            return -1;
+        }
+    }
+
+    if (vmm_map(page_dir, page, frame, PAGE_SIZE, flags) != 0) {
+        pmm_free_frame(frame);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Load a program and start it as a user task. Returns the task id (to
+ * wait on with wait_task), or -1 if the program can't be loaded or there
+ * is no free task slot.
+ */
+int spawn(const char* name) {
+    program_t prog;
+
+    if (load_program(name, &prog) != 0) {
+        return -1;
+    }
+
+    task_t* t = create_program_task(name, &prog, (uint32_t)kernel_vectors);
+    if (t == NULL) {
+        unload_program(&prog);
+        return -1;
     }
 
-    return load_result;
+    return t->id;
 }
@@ -0,0 +1,265 @@
+/**
+ * Physical Memory Manager
+ *
+ * Hands out 4KB page frames from the RAM reported by the BIOS E820 memory
+ * map (collected by the boot sector at E820_MAP_ADDR).
+ *
+ * This is a buddy allocator whose free sets are bitmaps: for each order k
+ * there is one bit per naturally aligned block of 2^k frames, set when that
+ * block is free (and not part of a larger free block). Allocating order k
+ * takes a set bit from the order-k bitmap, splitting a larger block only
+ * when that bitmap is empty; freeing merges a block with its buddy for as
+ * long as the buddy is free too.
+ *
+ * Most requests are single frames, which come straight out of the order-0
+ * bitmap: a scan for a non-zero word from a rolling hint, then BSF.
+ *
+ * The bitmaps are sized for the installed RAM and placed at the start of
+ * the first usable region above 1MB. Memory below 1MB (kernel, stacks,
+ * BIOS data, video memory) is never handed out, and neither is memory
+ * above KSTACK_AREA, which the kernel does not identity map.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include "arch_x86/cpu.h"
+#include "kernel/pmm.h"
+#include "kernel/vmm.h"
+#include "lib/util.h"
+
+#define E820_MAP_ADDR   0x500    // must match bootsect.asm
+#define E820_MAX        32
+#define E820_USABLE     1
+
+#define LOW_MEMORY_END  0x100000
+#define MAX_ADDR        ((uint64_t)KSTACK_AREA)
+
+typedef struct __attribute__((packed)) e820_entry {
+    uint64_t base;
+    uint64_t length;
+    uint32_t type;
+    uint32_t acpi;
+} e820_entry_t;
+
+typedef struct __attribute__((packed)) e820_map {
+    uint32_t count;
+    e820_entry_t entries[E820_MAX];
+} e820_map_t;
+
+static uint32_t* free_map[PMM_MAX_ORDER + 1];   // free block bitmaps
+static uint32_t map_words[PMM_MAX_ORDER + 1];
+static uint32_t hint[PMM_MAX_ORDER + 1];        // word to start searching at
+static uint32_t n_free[PMM_MAX_ORDER + 1];      // set bits per bitmap
+static uint32_t n_frames;                       // frames covered by the bitmaps
+static uint32_t total_frames;
+
+#define TEST(order, block)  (free_map[order][(block) >> 5] & (1u << ((block) & 31)))
+#define SET(order, block)   (free_map[order][(block) >> 5] |= (1u << ((block) & 31)))
+#define CLEAR(order, block) (free_map[order][(block) >> 5] &= ~(1u << ((block) & 31)))
+
+/**
+ * Take any free block of the given order, or return -1.
+ */
+static int32_t take_block(uint32_t order) {
+    if (n_free[order] == 0) {
+        return -1;
+    }
+
+    uint32_t words = map_words[order];
+    uint32_t w = hint[order];
+    for (uint32_t i = 0; i < words; i++, w++) {
+        if (w == words) {
+            w = 0;
+        }
+        uint32_t bits = free_map[order][w];
+        if (bits != 0) {
+            uint32_t block = (w << 5) + __builtin_ctz(bits);
+            CLEAR(order, block);
+            n_free[order]--;
+            hint[order] = w;
+            return block;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Return a block (frame number `frame`, 2^order frames) to the free sets,
+ * merging it with its buddy as far up as possible.
+ */
+static void put_block(uint32_t frame, uint32_t order) {
+    while (order < PMM_MAX_ORDER) {
+        uint32_t buddy = frame ^ (1u << order);
+        if (buddy + (1u << order) > n_frames || !TEST(order, buddy >> order)) {
+            break;
+        }
+        CLEAR(order, buddy >> order);
+        n_free[order]--;
+        frame &= ~(1u << order);
+        order++;
+    }
+
+    SET(order, frame >> order);
+    n_free[order]++;
+    if ((frame >> order >> 5) < hint[order]) {
+        hint[order] = frame >> order >> 5;
+    }
+}
+
+/**
+ * Allocate 2^order physically contiguous frames, aligned to their size.
+ * Returns the physical address, or 0 if no block is available.
+ */
+uint32_t pmm_alloc_frames(uint32_t order) {
+    if (order > PMM_MAX_ORDER) {
+        return 0;
+    }
+
+    uint32_t flags = save_and_disable_interrupts();
+
+    // smallest order that has a free block
+    uint32_t k = order;
+    int32_t block = -1;
+    while (k <= PMM_MAX_ORDER && (block = take_block(k)) < 0) {
+        k++;
+    }
+    if (block < 0) {
+        restore_interrupts(flags);
+        return 0;
+    }
+
+    // split down to the requested order, freeing the upper halves
+    uint32_t frame = (uint32_t)block << k;
+    while (k > order) {
+        k--;
+        SET(k, (frame >> k) + 1);
+        n_free[k]++;
+    }
+
+    restore_interrupts(flags);
+    return frame << FRAME_SHIFT;
+}
+
+void pmm_free_frames(uint32_t addr, uint32_t order) {
+    if (addr == 0 || order > PMM_MAX_ORDER) {
+        return;
+    }
+    uint32_t flags = save_and_disable_interrupts();
+    put_block(addr >> FRAME_SHIFT, order);
+    restore_interrupts(flags);
+}
+
+uint32_t pmm_alloc_frame() {
+    return pmm_alloc_frames(0);
+}
+
+void pmm_free_frame(uint32_t addr) {
+    pmm_free_frames(addr, 0);
+}
+
+void pmm_get_stats(pmm_stats_t* stats) {
+    stats->total_frames = total_frames;
+    stats->free_frames = 0;
+    for (uint32_t k = 0; k <= PMM_MAX_ORDER; k++) {
+        stats->free_blocks[k] = n_free[k];
+        stats->free_frames += n_free[k] << k;
+    }
+}
+
+/**
+ * Free the frames in [start, end) as the largest aligned blocks that fit.
+ */
+static void free_range(uint32_t start, uint32_t end) {
+    while (start < end) {
+        uint32_t order = 0;
+        while (order < PMM_MAX_ORDER
+               && (start & ((2u << order) - 1)) == 0
+               && start + (2u << order) <= end) {
+            order++;
+        }
+        put_block(start, order);
+        total_frames += 1u << order;
+        start += 1u << order;
+    }
+}
+
+/**
+ * Usable frames [start, end) of an E820 range, rounded inwards.
+ */
+static _Bool usable_frames(e820_entry_t* e, uint32_t* start, uint32_t* end) {
+    if (e->type != E820_USABLE || e->length == 0 || e->base >= MAX_ADDR) {
+        return 0;
+    }
+    uint64_t lo = e->base;
+    uint64_t hi = e->base + e->length;
+    if (hi > MAX_ADDR) {
+        hi = MAX_ADDR;
+    }
+    if (lo < LOW_MEMORY_END) {
+        lo = LOW_MEMORY_END;
+    }
+    *start = (uint32_t)((lo + FRAME_SIZE - 1) >> FRAME_SHIFT);
+    *end = (uint32_t)(hi >> FRAME_SHIFT);
+    return *start < *end;
+}
+
+void pmm_init() {
+    e820_map_t* map = (e820_map_t*)E820_MAP_ADDR;
+    uint32_t count = map->count < E820_MAX ? map->count : E820_MAX;
+
+    // size the bitmaps for the highest usable frame
+    uint32_t start, end;
+    n_frames = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (usable_frames(&map->entries[i], &start, &end) && end > n_frames) {
+            n_frames = end;
+        }
+    }
+    if (n_frames == 0) {
+        return;
+    }
+
+    uint32_t meta_bytes = 0;
+    for (uint32_t k = 0; k <= PMM_MAX_ORDER; k++) {
+        map_words[k] = ((n_frames >> k) + 32) / 32;
+        meta_bytes += map_words[k] * sizeof(uint32_t);
+    }
+    uint32_t meta_frames = (meta_bytes + FRAME_SIZE - 1) >> FRAME_SHIFT;
+
+    // place them at the start of the first range that can hold them
+    uint32_t meta_start = 0;
+    for (uint32_t i = 0; i < count && meta_start == 0; i++) {
+        if (usable_frames(&map->entries[i], &start, &end) && end - start >= meta_frames) {
+            meta_start = start;
+        }
+    }
+    if (meta_start == 0) {
+        n_frames = 0;
+        return;
+    }
+
+    uint32_t* p = (uint32_t*)(meta_start << FRAME_SHIFT);
+    memset(p, 0, meta_frames << FRAME_SHIFT);
+    for (uint32_t k = 0; k <= PMM_MAX_ORDER; k++) {
+        free_map[k] = p;
+        p += map_words[k];
+    }
+
+    // everything starts allocated; free the usable ranges minus the bitmaps
+    uint32_t meta_end = meta_start + meta_frames;
+    for (uint32_t i = 0; i < count; i++) {
+        if (!usable_frames(&map->entries[i], &start, &end)) {
+            continue;
+        }
+        if (start < meta_end && meta_start < end) {
+            if (start < meta_start) {
+                free_range(start, meta_start);
+            }
+            if (meta_end < end) {
+                free_range(meta_end, end);
+            }
+        } else {
+            free_range(start, end);
+        }
+    }
+}
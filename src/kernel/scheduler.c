@@ -7,36 +7,344 @@
  *   1. Pick the next runnable task
  *   2. Update task states
  *   3. Update current_task pointer and TSS.esp0
+ *   4. Load the next task's address space (CR3) if it has a different one
  *
  * When isr_common resumes, it will load esp from current_task->esp (which may
  * now point to a different task's kernel stack) and execute the iret epilogue.
+ *
+ * Runnable (NEW/READY) tasks wait in one FIFO run queue per priority level,
+ * and a bitmap has a bit set for each non-empty queue. Picking the next
+ * task is a BSF on the bitmap and taking the head of that queue; a task is
+ * queued or unqueued when its state changes (set_task_state), so blocked
+ * and terminated tasks cost nothing here. Tasks of equal priority take
+ * turns: a preempted task goes to the back of its queue. The running task
+ * is not on a queue.
+ *
+ * Besides the timer tick, a task gets switched out when
+ *   - it gives up the CPU with yield() (INT 0x81 through isr_common), which
+ *     is how a task blocking in wait_event leaves right away, and
+ *   - a task of higher priority becomes runnable: the wakeup sets
+ *     need_resched, acted on when the current interrupt returns.
+ *
+ * Each CPU has its own run queues (in its cpu_t), and a task is queued on
+ * the CPU it last ran on (task->cpu), which likely still has its data in
+ * cache. A CPU left with nothing but its idle task steals from the CPU
+ * with the most queued tasks; one that queues a task while busy sends a
+ * reschedule IPI to an idle CPU so it comes looking. Pinned tasks (the
+ * idle tasks, the shell) stay where they are. Everything here runs under
+ * the kernel lock (see smp.c), which also covers other CPUs' queues.
+ *
+ * A task that has disabled preemption (preempt_disable, e.g. while it
+ * holds a spinlock) is not switched out on a tick or wakeup: the switch
+ * waits, as need_resched, until the matching preempt_enable.
  */
 
+#include <stddef.h>
 #include "kernel/scheduler.h"
+#include "kernel/smp.h"
+#include "kernel/vmm.h"
+#include "arch_x86/cpu.h"
 #include "arch_x86/gdt.h"
+#include "arch_x86/idt.h"
+
+static uint32_t active_cpus = 1;   // CPUs 0..active_cpus-1 take tasks
+
+// whether a CPU has nothing better queued than idle-priority tasks
+static _Bool idle_queues(cpu_t* cpu) {
+    return (cpu->rq_bitmap & ~(1u << PRIORITY_IDLE)) == 0;
+}
+
+extern isr_t isr129;
+
+/**
+ * Ask an idle CPU to come and steal a task from `busy`, if one is idle
+ * (and hasn't been asked already).
+ */
+static void kick_idle_cpu(cpu_t* busy) {
+    for (uint32_t i = 0; i < active_cpus; i++) {
+        cpu_t* cpu = &cpus[i];
+        if (cpu != busy && cpu->online && cpu->current == cpu->idle && idle_queues(cpu)
+            && !cpu->need_resched) {
+            cpu->need_resched = 1;
+            if (cpu != this_cpu()) {
+                smp_send_resched(i);
+            }
+            return;
+        }
+    }
+}
+
+/**
+ * Put a task at the back of its priority's run queue on its CPU (if it
+ * isn't on it already). A task whose CPU no longer takes tasks moves to
+ * the boot CPU. Interrupts must be off.
+ */
+void sched_enqueue(task_t* t) {
+    if (t->queued) {
+        return;
+    }
+    if (t->cpu >= active_cpus && !t->pinned) {
+        t->cpu = 0;
+    }
+    cpu_t* cpu = &cpus[t->cpu];
+    uint32_t p = t->priority;
+    t->rq_next = NULL;
+    t->rq_prev = cpu->rq_tail[p];
+    if (cpu->rq_tail[p] != NULL) {
+        cpu->rq_tail[p]->rq_next = t;
+    } else {
+        cpu->rq_head[p] = t;
+    }
+    cpu->rq_tail[p] = t;
+    cpu->rq_bitmap |= 1u << p;
+    t->queued = 1;
+    if (!t->pinned) {
+        cpu->nr_queued++;
+    }
+
+    task_t* running = cpu->current;
+    if (running != NULL && running->state == RUNNING && p < running->priority) {
+        cpu->need_resched = 1;
+        if (cpu != this_cpu()) {
+            smp_send_resched(cpu->id);
+        }
+    } else if (!t->pinned && t != running) {
+        // (a preempted task is requeued while still current: no need)
+        kick_idle_cpu(cpu);
+    }
+}
+
+/**
+ * Take a task off its run queue (if it is on it). Interrupts must be off.
+ */
+void sched_dequeue(task_t* t) {
+    if (!t->queued) {
+        return;
+    }
+    cpu_t* cpu = &cpus[t->cpu];
+    uint32_t p = t->priority;
+    if (t->rq_prev != NULL) {
+        t->rq_prev->rq_next = t->rq_next;
+    } else {
+        cpu->rq_head[p] = t->rq_next;
+    }
+    if (t->rq_next != NULL) {
+        t->rq_next->rq_prev = t->rq_prev;
+    } else {
+        cpu->rq_tail[p] = t->rq_prev;
+    }
+    if (cpu->rq_head[p] == NULL) {
+        cpu->rq_bitmap &= ~(1u << p);
+    }
+    if (!t->pinned) {
+        cpu->nr_queued--;
+    }
+    t->rq_next = t->rq_prev = NULL;
+    t->queued = 0;
+}
 
-extern task_t* current_task;
+/**
+ * Take a task from the CPU with the most queued tasks for `thief`: the
+ * last one queued at the highest priority that has one not pinned, which
+ * has waited the least there. Returns NULL if no CPU has one to spare.
+ */
+static task_t* steal(cpu_t* thief) {
+    cpu_t* victim = NULL;
+    for (uint32_t i = 0; i < active_cpus; i++) {
+        cpu_t* cpu = &cpus[i];
+        if (cpu != thief && cpu->online && cpu->nr_queued > 0
+            && (victim == NULL || cpu->nr_queued > victim->nr_queued)) {
+            victim = cpu;
+        }
+    }
+    if (victim == NULL) {
+        return NULL;
+    }
+
+    uint32_t bits = victim->rq_bitmap;
+    while (bits != 0) {
+        uint32_t p = __builtin_ctz(bits);
+        bits &= bits - 1;
+        for (task_t* t = victim->rq_tail[p]; t != NULL; t = t->rq_prev) {
+            if (!t->pinned) {
+                sched_dequeue(t);
+                t->cpu = thief->id;
+                thief->steals++;
+                return t;
+            }
+        }
+    }
+    return NULL;
+}
+
+// move the tasks off a CPU that no longer takes them (see sched_enqueue)
+static void hand_off(cpu_t* cpu) {
+    for (uint32_t p = 0; p < SCHED_PRIORITIES; p++) {
+        task_t* t = cpu->rq_head[p];
+        while (t != NULL) {
+            task_t* next = t->rq_next;
+            if (!t->pinned) {
+                sched_dequeue(t);
+                sched_enqueue(t);
+            }
+            t = next;
+        }
+    }
+}
+
+/**
+ * Take the first task of this CPU's highest-priority non-empty run queue
+ * off it, or return NULL if no task is runnable. If only the idle task (or
+ * idle-priority tasks) is left, try stealing one first. Interrupts must be
+ * off.
+ */
+task_t* sched_pick() {
+    cpu_t* cpu = this_cpu();
+    if (cpu->id >= active_cpus) {
+        hand_off(cpu);
+    } else if (idle_queues(cpu)) {
+        task_t* t = steal(cpu);
+        if (t != NULL) {
+            return t;
+        }
+    }
+    if (cpu->rq_bitmap == 0) {
+        return NULL;
+    }
+    task_t* t = cpu->rq_head[__builtin_ctz(cpu->rq_bitmap)];
+    sched_dequeue(t);
+    return t;
+}
 
 void schedule(task_state_t state) {
-    task_t* old_task  = current_task;
-    task_t* next_task = current_task;
+    cpu_t* cpu = this_cpu();
+    task_t* old_task  = cpu->current;
+    if (cpu->preempt_count > 0 && old_task->state == RUNNING) {
+        cpu->need_resched = 1;
+        return;
+    }
+    cpu->need_resched = 0;
 
-    // Pick the next READY/NEW task in the circular list
-    do {
-        next_task = next_task->next;
-    } while (next_task->state != READY && next_task->state != NEW);
+    // A preempted task goes to the back of its queue; a task that blocked
+    // itself (e.g. in wait_event) stays off the queues until whoever it is
+    // waiting on marks it READY again
+    if (old_task->state == RUNNING) {
+        old_task->state = state;
+        if (state == READY) {
+            sched_enqueue(old_task);
+        }
+    }
+
+    // this CPU's idle task is always runnable, so there is a next task
+    task_t* next_task = sched_pick();
 
     // Nothing to do if we're staying on the same already-running task
     if (old_task == next_task) {
+        next_task->state = RUNNING;
         return;
     }
 
-    // Update old task's state (unless it was never started, which shouldn't happen here)
-    old_task->state = state;
-
     // Switch logical current task and TSS kernel stack
-    current_task = next_task;
+    cpu->current = next_task;
     tss_set_kernel_stack(next_task->kstack);
+    vmm_sync_kstacks(&cpu->kstack_gen);
+
+    // kernel mappings are global and survive the reload; kernel tasks
+    // share one directory, so switching between them costs nothing
+    vmm_switch(next_task->page_dir);
 
     next_task->state = RUNNING;
 }
+
+/**
+ * Switch to a higher-priority task that was woken since the running task
+ * was scheduled, if any. Called on the way out of every interrupt.
+ */
+void sched_preempt() {
+    if (this_cpu()->need_resched) {
+        schedule(READY);
+    }
+}
+
+/**
+ * Keep the running task on this CPU until the matching preempt_enable.
+ * Calls nest.
+ */
+void preempt_disable() {
+    uint32_t flags = save_and_disable_interrupts();
+    this_cpu()->preempt_count++;
+    restore_interrupts(flags);
+}
+
+/**
+ * Undo a preempt_disable; at the outermost one, make the switch that was
+ * put off meanwhile, if any (or leave it to the next interrupt's exit if
+ * interrupts are off).
+ */
+void preempt_enable() {
+    uint32_t flags = save_and_disable_interrupts();
+    cpu_t* cpu = this_cpu();
+    _Bool resched = (--cpu->preempt_count == 0 && cpu->need_resched);
+    restore_interrupts(flags);
+    if (resched && interrupts_enabled()) {
+        yield();
+    }
+}
+
+/**
+ * Whether the running task needs the periodic timer tick: only to take
+ * turns with the tasks of its own priority. Higher ones preempt it as
+ * they wake up, and lower ones wait until it blocks anyway. (Until the
+ * first task runs, the timer just keeps ticking.)
+ */
+_Bool sched_needs_tick() {
+    cpu_t* cpu = this_cpu();
+    if (cpu->current == NULL) {
+        return 1;
+    }
+    return (cpu->rq_bitmap >> cpu->current->priority) & 1;
+}
+
+/**
+ * Keep a task on one CPU: it moves to that CPU's run queues (if queued)
+ * and is never stolen. Interrupts must be off.
+ */
+void sched_pin(task_t* t, uint32_t cpu) {
+    _Bool queued = t->queued;
+    sched_dequeue(t);
+    t->cpu = cpu;
+    t->pinned = 1;
+    if (queued) {
+        sched_enqueue(t);
+    }
+}
+
+/**
+ * Let only the first `n` online CPUs take tasks (the others keep to their
+ * idle tasks, and their queued tasks move over as they are scheduled).
+ * Returns the number in effect.
+ */
+uint32_t sched_set_cpus(uint32_t n) {
+    uint32_t flags = save_and_disable_interrupts();
+    uint32_t online = smp_cpus_online();
+    active_cpus = (n == 0 || n > online) ? online : n;
+    restore_interrupts(flags);
+    return active_cpus;
+}
+
+uint32_t sched_get_cpus() {
+    return active_cpus;
+}
+
+/**
+ * Give up the CPU: the current task goes through the scheduler right away
+ * (to the back of its run queue, or off the queues if it has just marked
+ * itself BLOCKED) instead of waiting for the next timer tick.
+ */
+void yield() {
+    asm volatile("int %0" : : "i"(YIELD_VECTOR) : "memory");
+}
+
+void sched_init() {
+    idt_set(YIELD_VECTOR, &isr129);
+}
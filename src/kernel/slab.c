@@ -0,0 +1,218 @@
+/**
+ * Slab Allocator
+ *
+ * Object caches for fixed-size kernel objects (tasks, queues, events).
+ * Each cache carves one-frame slabs from the pmm into equal objects,
+ * padded to a cache line so no two objects share one. A slab starts with
+ * its header (owning cache, list links, free list), so the slab of an
+ * object is found by rounding its address down to the frame.
+ *
+ * The free list is an array of object indices in the header rather than a
+ * pointer stored inside each free object. That way an object keeps the
+ * state its constructor gave it: the constructor runs once per object when
+ * a slab is created, and callers hand objects back in that same state.
+ *
+ * Slabs sit on one of three lists (full, partial, empty); allocation takes
+ * from a partial slab first. One empty slab is kept per cache to absorb
+ * alloc/free churn; further empty slabs go back to the pmm.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include "arch_x86/cpu.h"
+#include "kernel/pmm.h"
+#include "kernel/slab.h"
+#include "lib/util.h"
+
+#define SLAB_MAX_CACHES 16
+#define SLAB_MAX_OBJS   64
+#define SLAB_NONE       0xFF
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((a) - 1))
+
+typedef struct slab {
+    slab_cache_t* cache;
+    struct slab* prev;
+    struct slab* next;
+    uint32_t inuse;
+    uint8_t free_head;                 // first free object, or SLAB_NONE
+    uint8_t free_next[SLAB_MAX_OBJS];  // next free object after each one
+} slab_t;
+
+struct slab_cache {
+    const char* name;
+    uint32_t obj_size;
+    uint32_t obj_offset;      // offset of the first object in a slab
+    uint32_t objs_per_slab;
+    slab_ctor_t ctor;
+    slab_t* full;
+    slab_t* partial;
+    slab_t* empty;
+    uint32_t slabs;
+    uint32_t active;
+    uint32_t allocs;
+    uint32_t frees;
+};
+
+static slab_cache_t caches[SLAB_MAX_CACHES];
+static int n_caches = 0;
+
+static void list_remove(slab_t** head, slab_t* s) {
+    if (s->prev) {
+        s->prev->next = s->next;
+    } else {
+        *head = s->next;
+    }
+    if (s->next) {
+        s->next->prev = s->prev;
+    }
+    s->prev = s->next = NULL;
+}
+
+static void list_push(slab_t** head, slab_t* s) {
+    s->prev = NULL;
+    s->next = *head;
+    if (*head) {
+        (*head)->prev = s;
+    }
+    *head = s;
+}
+
+static inline uint8_t* slab_obj(slab_cache_t* cache, slab_t* s, uint32_t i) {
+    return (uint8_t*)s + cache->obj_offset + i * cache->obj_size;
+}
+
+/**
+ * Get a new slab from the pmm and construct all its objects.
+ */
+static slab_t* grow(slab_cache_t* cache) {
+    slab_t* s = (slab_t*)pmm_alloc_frame();
+    if (s == NULL) {
+        return NULL;
+    }
+
+    s->cache = cache;
+    s->prev = s->next = NULL;
+    s->inuse = 0;
+    s->free_head = 0;
+    for (uint32_t i = 0; i < cache->objs_per_slab; i++) {
+        s->free_next[i] = (i + 1 < cache->objs_per_slab) ? i + 1 : SLAB_NONE;
+        if (cache->ctor) {
+            cache->ctor(slab_obj(cache, s, i));
+        }
+    }
+
+    cache->slabs++;
+    list_push(&cache->empty, s);
+    return s;
+}
+
+/**
+ * Create a cache of `size`-byte objects. `ctor` (optional) puts a fresh
+ * object in its initial state.
+ */
+slab_cache_t* slab_cache_create(const char* name, uint32_t size, slab_ctor_t ctor) {
+    uint32_t obj_size = ALIGN_UP(size ? size : 1, CACHE_LINE_SIZE);
+    uint32_t obj_offset = ALIGN_UP(sizeof(slab_t), CACHE_LINE_SIZE);
+    if (n_caches >= SLAB_MAX_CACHES || obj_offset + obj_size > FRAME_SIZE) {
+        return NULL;
+    }
+
+    uint32_t n = (FRAME_SIZE - obj_offset) / obj_size;
+    if (n > SLAB_MAX_OBJS) {
+        n = SLAB_MAX_OBJS;
+    }
+
+    slab_cache_t* cache = &caches[n_caches++];
+    memset(cache, 0, sizeof(*cache));
+    cache->name = name;
+    cache->obj_size = obj_size;
+    cache->obj_offset = obj_offset;
+    cache->objs_per_slab = n;
+    cache->ctor = ctor;
+    return cache;
+}
+
+void* slab_alloc(slab_cache_t* cache) {
+    uint32_t flags = save_and_disable_interrupts();
+
+    slab_t* s = cache->partial;
+    slab_t** from = &cache->partial;
+    if (s == NULL) {
+        if (cache->empty == NULL && grow(cache) == NULL) {
+            restore_interrupts(flags);
+            return NULL;
+        }
+        s = cache->empty;
+        from = &cache->empty;
+    }
+
+    uint32_t i = s->free_head;
+    s->free_head = s->free_next[i];
+    s->inuse++;
+
+    if (s->inuse == cache->objs_per_slab) {
+        list_remove(from, s);
+        list_push(&cache->full, s);
+    } else if (from == &cache->empty) {
+        list_remove(from, s);
+        list_push(&cache->partial, s);
+    }
+
+    cache->active++;
+    cache->allocs++;
+    restore_interrupts(flags);
+    return slab_obj(cache, s, i);
+}
+
+void slab_free(slab_cache_t* cache, void* obj) {
+    if (obj == NULL) {
+        return;
+    }
+
+    slab_t* s = (slab_t*)((uint32_t)obj & ~(FRAME_SIZE - 1));
+    if (s->cache != cache) {
+        return;
+    }
+    uint32_t i = ((uint8_t*)obj - slab_obj(cache, s, 0)) / cache->obj_size;
+
+    uint32_t flags = save_and_disable_interrupts();
+
+    _Bool was_full = (s->inuse == cache->objs_per_slab);
+    s->free_next[i] = s->free_head;
+    s->free_head = i;
+    s->inuse--;
+
+    if (was_full) {
+        list_remove(&cache->full, s);
+        list_push(&cache->partial, s);
+    }
+    if (s->inuse == 0) {
+        list_remove(&cache->partial, s);
+        if (cache->empty == NULL) {
+            list_push(&cache->empty, s);
+        } else {
+            pmm_free_frame((uint32_t)s);
+            cache->slabs--;
+        }
+    }
+
+    cache->active--;
+    cache->frees++;
+    restore_interrupts(flags);
+}
+
+int slab_get_stats(slab_stats_t* stats, int max) {
+    int n = 0;
+    for (; n < n_caches && n < max; n++) {
+        slab_cache_t* cache = &caches[n];
+        stats[n].name = cache->name;
+        stats[n].obj_size = cache->obj_size;
+        stats[n].objs_per_slab = cache->objs_per_slab;
+        stats[n].slabs = cache->slabs;
+        stats[n].active = cache->active;
+        stats[n].allocs = cache->allocs;
+        stats[n].frees = cache->frees;
+    }
+    return n;
+}
@@ -0,0 +1,198 @@
+/**
+ * Multiprocessor Support
+ *
+ * The boot CPU wakes the others (application processors, APs) listed in
+ * the ACPI MADT with the INIT-SIPI-SIPI sequence: an INIT IPI resets one
+ * into a wait-for-startup state, and a STARTUP IPI starts it in real mode
+ * at the trampoline in ap_start.asm, which brings it into protected mode
+ * with paging and calls ap_main. Each CPU has a cpu_t of its own (its
+ * current task, idle task and run queues) and a TSS of its own, whose
+ * selector in the task register tells the CPU which cpu_t is its (see
+ * cpu_id in gdt.c).
+ *
+ * The kernel was written for one CPU, so kernel code runs under one
+ * (big) kernel lock: a CPU takes it on every interrupt entry (isr_enter)
+ * and drops it when it returns to user mode or to its idle task
+ * (isr_leave). Kernel tasks hold it while they run. User code and idle
+ * CPUs run in parallel; interrupts, system calls and scheduling take
+ * turns. Every CPU's interrupts funnel into the lock, so it is an MCS
+ * lock (see spinlock.c).
+ */
+
+#include <stddef.h>
+#include "arch_x86/cpu.h"
+#include "arch_x86/gdt.h"
+#include "arch_x86/idt.h"
+#include "arch_x86/task_switch.h"
+#include "device/apic.h"
+#include "device/console.h"
+#include "device/pit.h"
+#include "kernel/pmm.h"
+#include "kernel/scheduler.h"
+#include "kernel/smp.h"
+#include "kernel/spinlock.h"
+#include "kernel/syscall.h"
+#include "kernel/vmm.h"
+#include "lib/util.h"
+
+#define AP_TRAMPOLINE   0x1000      // must match ap_start.asm (above the E820 map)
+#define NO_CPU          0xFFFFFFFF
+
+// the trampoline's parameters (ap_params in ap_start.asm)
+typedef struct __attribute__((packed)) ap_params {
+    uint16_t gdt_limit;
+    uint32_t gdt_base;
+    uint32_t cr3;
+    uint32_t stack;
+    uint32_t cpu;
+} ap_params_t;
+
+extern uint8_t ap_trampoline[];
+extern uint8_t ap_trampoline_end[];
+extern uint8_t ap_params[];
+extern isr_t isr49;
+
+cpu_t cpus[MAX_CPUS];
+
+static uint32_t n_online = 1;
+static lock_stats_t big_lock_stats = { .name = "kernel" };
+static mcs_lock_t big_lock = { .stats = &big_lock_stats };
+static volatile uint32_t lock_owner = NO_CPU;
+
+cpu_t* this_cpu() {
+    return &cpus[cpu_id()];
+}
+
+uint32_t smp_cpus_online() {
+    return n_online;
+}
+
+/**
+ * Take the kernel lock, unless this CPU holds it already (an interrupt
+ * nested in a handler that runs with interrupts on).
+ */
+void kernel_lock() {
+    uint32_t me = cpu_id();
+    if (lock_owner == me) {
+        return;
+    }
+    mcs_lock(&big_lock, &cpus[me].lock_node);
+    lock_owner = me;
+}
+
+void kernel_unlock() {
+    if (lock_owner != cpu_id()) {
+        return;
+    }
+    uint32_t me = lock_owner;
+    lock_owner = NO_CPU;
+    mcs_unlock(&big_lock, &cpus[me].lock_node);
+}
+
+// whether `t` is the current task of some CPU
+_Bool smp_is_running(task_t* t) {
+    for (uint32_t i = 0; i < n_online; i++) {
+        if (cpus[i].current == t) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// make another CPU go through the scheduler (see sched_enqueue)
+void smp_send_resched(uint32_t cpu) {
+    lapic_send_ipi(cpus[cpu].apic_id, RESCHED_VECTOR);
+}
+
+/**
+ * Where an AP lands from the trampoline, on its boot stack. It waits for
+ * the kernel lock (the boot CPU holds it until its first task runs) and
+ * then starts its idle task, from which the scheduler takes over.
+ */
+_Noreturn void ap_main(uint32_t id) {
+    cpu_t* cpu = &cpus[id];
+    gdt_init_ap(id);
+    idt_load();
+    syscall_init_cpu(id);
+    lapic_init_ap();
+    timer_init_ap(id);
+    cpu->online = 1;
+
+    kernel_lock();
+    cpu->current = cpu->idle;
+    tss_set_kernel_stack(cpu->idle->kstack);
+    set_task_state(cpu->idle->id, RUNNING);
+    kernel_unlock();
+    resume_new_task(cpu->idle);
+}
+
+// INIT, then a STARTUP or two (the second if the first went unnoticed)
+static _Bool start_ap(cpu_t* cpu) {
+    lapic_send_init(cpu->apic_id);
+    pit_wait(10000);
+    for (int i = 0; i < 2 && !cpu->online; i++) {
+        lapic_send_startup(cpu->apic_id, AP_TRAMPOLINE >> 12);
+        pit_wait(200);
+    }
+    for (int ms = 0; ms < 100 && !cpu->online; ms++) {
+        pit_wait(1000);
+    }
+    return cpu->online;
+}
+
+/**
+ * Start the other CPUs, each with an idle task pinned to it, and let the
+ * scheduler use them all. Call it from kmain after apic_init, holding the
+ * kernel lock.
+ */
+void smp_init() {
+    const madt_info_t* madt = apic_madt();
+    cpus[0].apic_id = lapic_id();
+    cpus[0].online = 1;
+    idt_set(RESCHED_VECTOR, &isr49);
+
+    memcpy((void*)AP_TRAMPOLINE, ap_trampoline, ap_trampoline_end - ap_trampoline);
+    ap_params_t* params = (ap_params_t*)(AP_TRAMPOLINE + (ap_params - ap_trampoline));
+    asm volatile("sgdt %0" : "=m"(*params));
+    params->cr3 = vmm_kernel_space();
+
+    for (uint32_t i = 0; i < madt->n_cpus && n_online < MAX_CPUS; i++) {
+        if (madt->cpu_apic_ids[i] == cpus[0].apic_id) {
+            continue;
+        }
+        cpu_t* cpu = &cpus[n_online];
+        cpu->id = n_online;
+        cpu->apic_id = madt->cpu_apic_ids[i];
+
+        // the boot stack is only used until ap_main starts the idle task
+        uint32_t stack = pmm_alloc_frame();
+        task_t* idle_task = create_task("idle", idle);
+        if (stack == 0 || idle_task == NULL) {
+            print("SMP: out of memory\n");
+            break;
+        }
+        set_task_priority(idle_task->id, PRIORITY_IDLE);
+        sched_pin(idle_task, cpu->id);
+        cpu->idle = idle_task;
+
+        params->stack = stack + FRAME_SIZE;
+        params->cpu = cpu->id;
+        if (!start_ap(cpu)) {
+            print("SMP: CPU with APIC id ");
+            print_dec32(cpu->apic_id);
+            print(" did not start\n");
+            // the next CPU gets the slot (and a new idle task)
+            set_task_state(idle_task->id, TERMINATED);
+            detach_task(idle_task->id);
+            pmm_free_frame(stack);
+            cpu->idle = NULL;
+            continue;
+        }
+        n_online++;
+    }
+    sched_set_cpus(n_online);
+
+    print("SMP: ");
+    print_dec32(n_online);
+    print(" CPU(s) online\n");
+}
@@ -0,0 +1,149 @@
+/**
+ * Spinlocks
+ *
+ * Ticket locks guard short stretches of kernel data. A CPU takes a ticket
+ * with one atomic add and spins until the owner count reaches it, so the
+ * lock is handed out first come, first served; the plain reads while
+ * spinning don't keep pulling the lock's cache line away from the others,
+ * and PAUSE eases the spinning. A task holding one can't be switched out
+ * (preempt_disable), or the next task on the CPU could spin on it for
+ * good; the _irqsave variants also turn interrupts off, for data that
+ * interrupt handlers touch too.
+ *
+ * MCS locks are for the contended paths: each waiter queues a node of its
+ * own (an atomic exchange on the tail) and spins on that, and the holder
+ * hands the lock to the next node directly. A handoff touches one
+ * waiter's cache line instead of all of theirs.
+ *
+ * Either kind may count its use in a lock_stats_t, which joins the list
+ * the shell's "locks" command shows the first time the lock is taken. The
+ * counts are updated under the lock itself; locks sharing one record may
+ * race on it, which only blurs the numbers.
+ */
+
+#include <stddef.h>
+#include "arch_x86/cpu.h"
+#include "kernel/scheduler.h"
+#include "kernel/spinlock.h"
+
+static lock_stats_t* volatile all_stats;
+
+// count an acquisition that waited since `start` (0: didn't wait)
+static void acquired(lock_stats_t* stats, uint64_t start) {
+    if (stats == NULL) {
+        return;
+    }
+    uint64_t now = rdtsc();
+    if (!stats->listed) {
+        stats->listed = 1;
+        lock_stats_t* head;
+        do {
+            head = all_stats;
+            stats->next = head;
+        } while (!__atomic_compare_exchange_n(&all_stats, &head, stats, 0,
+                                              __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    stats->acquired++;
+    if (start != 0) {
+        stats->contended++;
+        stats->wait_cycles += now - start;
+    }
+    stats->since = now;
+}
+
+static void released(lock_stats_t* stats) {
+    if (stats == NULL) {
+        return;
+    }
+    uint64_t held = rdtsc() - stats->since;
+    stats->hold_cycles += held;
+    if (held > stats->max_hold) {
+        stats->max_hold = (held >> 32) ? 0xFFFFFFFF : (uint32_t)held;
+    }
+}
+
+static void ticket_lock(spinlock_t* lock) {
+    uint16_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_ACQUIRE);
+    uint64_t start = 0;
+    if (lock->owner != ticket) {
+        start = rdtsc();
+        while (lock->owner != ticket) {
+            asm volatile("pause");
+        }
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    acquired(lock->stats, start);
+}
+
+static void ticket_unlock(spinlock_t* lock) {
+    released(lock->stats);
+    __atomic_store_n(&lock->owner, lock->owner + 1, __ATOMIC_RELEASE);
+}
+
+void spin_lock(spinlock_t* lock) {
+    preempt_disable();
+    ticket_lock(lock);
+}
+
+void spin_unlock(spinlock_t* lock) {
+    ticket_unlock(lock);
+    preempt_enable();
+}
+
+/**
+ * Take the lock with interrupts off; returns the flags to restore them
+ * with when it's released.
+ */
+uint32_t spin_lock_irqsave(spinlock_t* lock) {
+    uint32_t flags = save_and_disable_interrupts();
+    preempt_disable();
+    ticket_lock(lock);
+    return flags;
+}
+
+void spin_unlock_irqrestore(spinlock_t* lock, uint32_t flags) {
+    ticket_unlock(lock);
+    restore_interrupts(flags);
+    preempt_enable();
+}
+
+/**
+ * Take the lock, queueing `node` (the caller's, until mcs_unlock) behind
+ * the last waiter. Doesn't touch preemption or interrupts.
+ */
+void mcs_lock(mcs_lock_t* lock, mcs_node_t* node) {
+    node->next = NULL;
+    node->waiting = 1;
+    mcs_node_t* prev = __atomic_exchange_n(&lock->tail, node, __ATOMIC_ACQ_REL);
+    uint64_t start = 0;
+    if (prev != NULL) {
+        start = rdtsc();
+        prev->next = node;
+        while (node->waiting) {
+            asm volatile("pause");
+        }
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    acquired(lock->stats, start);
+}
+
+void mcs_unlock(mcs_lock_t* lock, mcs_node_t* node) {
+    released(lock->stats);
+    if (node->next == NULL) {
+        // nobody behind us, unless one is between its exchange and linking in
+        mcs_node_t* expected = node;
+        if (__atomic_compare_exchange_n(&lock->tail, &expected, NULL, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            return;
+        }
+        while (node->next == NULL) {
+            asm volatile("pause");
+        }
+    }
+    __atomic_store_n(&node->next->waiting, 0, __ATOMIC_RELEASE);
+}
+
+// the counted locks, most recently first taken first
+lock_stats_t* lock_stats_first() {
+    return all_stats;
+}
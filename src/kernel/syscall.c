@@ -0,0 +1,213 @@
+/**
+ * System Calls
+ *
+ * User tasks enter the kernel with INT 0x80 (a DPL 3 gate) or, where the
+ * CPU has it, with SYSENTER. The call number is in eax and the arguments
+ * in ebx, ecx, edx and esi; a result is returned in eax by writing it into
+ * the saved frame. The number indexes a table of handlers.
+ *
+ * SYSENTER skips the IDT and TSS lookups and the stack pushes of an INT,
+ * but it saves nothing: it loads cs/ss, esp and eip from MSRs and leaves
+ * the rest to software. The user stub (syscall_sysenter in vector.c) keeps
+ * its stack pointer in ebp and always returns at sysenter_return, and the
+ * kernel entry (sysenter_entry in isr.asm) builds the frame an INT 0x80
+ * would have, marked so that the way out takes SYSEXIT instead of IRET.
+ * So the rest of the kernel (fork copying the frame, a task switch inside
+ * a call) can't tell the two apart. SYSEXIT hands the user eip and esp
+ * back in edx and ecx, which the stub gives up.
+ *
+ * Pointers from user space are checked against the task's page tables
+ * before the kernel reads through them.
+ */
+
+#include <stddef.h>
+#include "arch_x86/cpu.h"
+#include "arch_x86/gdt.h"
+#include "arch_x86/idt.h"
+#include "device/console.h"
+#include "device/pit.h"
+#include "kernel/loader.h"
+#include "kernel/scheduler.h"
+#include "kernel/syscall.h"
+#include "kernel/task.h"
+#include "kernel/vector.h"
+#include "kernel/vmm.h"
+
+#define MAX_USER_STRING 256
+
+#define CPUID_SEP        (1u << 11)     // CPUID.1:EDX, SYSENTER/SYSEXIT
+#define MSR_SYSENTER_CS  0x174
+#define MSR_SYSENTER_ESP 0x175
+#define MSR_SYSENTER_EIP 0x176
+
+typedef uint32_t (*syscall_t)(interrupt_frame_t* frame);
+
+extern isr_t isr128;
+extern isr_t sysenter_entry;
+
+/**
+ * Copy a NUL-terminated string of at most `size` - 1 characters from user
+ * space. Returns its length, or -1 if it runs into memory the task can't
+ * read.
+ */
+static int copy_user_string(char* dest, uint32_t src, size_t size) {
+    uint32_t page_dir = get_current_task()->page_dir;
+    for (size_t i = 0; i < size - 1; i++) {
+        uint32_t addr = src + i;
+        // a page of the program image may not have been touched yet
+        if ((i == 0 || (addr & (PAGE_SIZE - 1)) == 0)
+            && !vmm_user_accessible(page_dir, addr, 1, 0)
+            && (task_page_fault(addr) != 0 || !vmm_user_accessible(page_dir, addr, 1, 0))) {
+            return -1;
+        }
+        dest[i] = *(const char*)addr;
+        if (dest[i] == 0) {
+            return i;
+        }
+    }
+    dest[size - 1] = 0;
+    return size - 1;
+}
+
+static uint32_t sys_exit(interrupt_frame_t* frame) {
+    exit_task((int)frame->ebx);
+    return 0;   // not reached
+}
+
+static uint32_t sys_print(interrupt_frame_t* frame) {
+    char str[MAX_USER_STRING];
+    if (copy_user_string(str, frame->ebx, sizeof(str)) < 0) {
+        return (uint32_t)-1;
+    }
+    print(str);
+    return 0;
+}
+
+static uint32_t sys_put_str(interrupt_frame_t* frame) {
+    char str[MAX_USER_STRING];
+    int row = (int)frame->edx;
+    int col = (int)frame->esi;
+    int len = copy_user_string(str, frame->ebx, sizeof(str));
+    if (len < 0 || row < 0 || row >= SCREEN_ROWS || col < 0 || col >= SCREEN_COLS) {
+        return (uint32_t)-1;
+    }
+    // clip at the end of the screen
+    int room = (SCREEN_ROWS - row) * SCREEN_COLS - col;
+    if (len > room) {
+        str[room] = 0;
+    }
+    put_str((const unsigned char*)str, (char)frame->ecx, row, col);
+    return 0;
+}
+
+static uint32_t sys_put_char(interrupt_frame_t* frame) {
+    int row = (int)frame->edx;
+    int col = (int)frame->esi;
+    if (row < 0 || row >= SCREEN_ROWS || col < 0 || col >= SCREEN_COLS) {
+        return (uint32_t)-1;
+    }
+    put_char((unsigned char)frame->ebx, (char)frame->ecx, row, col);
+    return 0;
+}
+
+static uint32_t sys_fork(interrupt_frame_t* frame) {
+    return (uint32_t)fork_task(frame);
+}
+
+// only a task's parent may wait for it
+static uint32_t sys_wait(interrupt_frame_t* frame) {
+    task_t* child = get_task(frame->ebx);
+    if (child == NULL || child->parent != get_current_task()) {
+        return (uint32_t)-1;
+    }
+    return (uint32_t)wait_task(frame->ebx, NULL);
+}
+
+static uint32_t sys_yield(interrupt_frame_t* frame) {
+    schedule(READY);
+    return 0;
+}
+
+// keys reach the task the shell made active (see set_active_task)
+static uint32_t sys_read_key(interrupt_frame_t* frame) {
+    return (uint8_t)bq_dequeue(get_current_task()->keybuf);
+}
+
+// the caller becomes the program's parent, and may wait for it
+static uint32_t sys_spawn(interrupt_frame_t* frame) {
+    char name[MAX_USER_STRING];
+    if (copy_user_string(name, frame->ebx, sizeof(name)) < 0) {
+        return (uint32_t)-1;
+    }
+    int tid = spawn(name);
+    if (tid >= 0) {
+        get_task(tid)->parent = get_current_task();
+    }
+    return (uint32_t)tid;
+}
+
+static uint32_t sys_sleep(interrupt_frame_t* frame) {
+    sleep(frame->ebx);
+    return 0;
+}
+
+static uint32_t sys_null(interrupt_frame_t* frame) {
+    return 0;
+}
+
+static const syscall_t syscalls[NR_SYSCALLS] = {
+    [SYS_EXIT]     = sys_exit,
+    [SYS_PRINT]    = sys_print,
+    [SYS_PUT_STR]  = sys_put_str,
+    [SYS_PUT_CHAR] = sys_put_char,
+    [SYS_FORK]     = sys_fork,
+    [SYS_WAIT]     = sys_wait,
+    [SYS_YIELD]    = sys_yield,
+    [SYS_READ_KEY] = sys_read_key,
+    [SYS_SPAWN]    = sys_spawn,
+    [SYS_SLEEP]    = sys_sleep,
+    [SYS_NULL]     = sys_null,
+};
+
+void handle_syscall(interrupt_frame_t* frame) {
+    if (frame->eax >= NR_SYSCALLS) {
+        frame->eax = (uint32_t)-1;
+        return;
+    }
+    frame->eax = syscalls[frame->eax](frame);
+}
+
+/**
+ * Tell the user stubs whether to use SYSENTER. It has to happen before
+ * vmm_init, which maps the user-accessible data read-only. (The first
+ * CPUs to report SEP, Pentium Pro family 6 before model 3 stepping 3,
+ * don't really have it.)
+ */
+void syscall_detect() {
+    uint32_t regs[4];
+    cpuid(1, regs);
+    uint32_t family = (regs[0] >> 8) & 0xF;
+    uint32_t model = (regs[0] >> 4) & 0xF;
+    uint32_t stepping = regs[0] & 0xF;
+    syscall_use_sysenter = (regs[3] & CPUID_SEP)
+        && !(family == 6 && model < 3 && stepping < 3);
+}
+
+/**
+ * Set up SYSENTER on a CPU (each has its own MSRs). It takes cs from the
+ * MSR (and ss, and SYSEXIT's user cs and ss, from the GDT entries after
+ * it), and starts with esp pointing at a copy of this CPU's TSS.esp0, the
+ * current task's kernel stack.
+ */
+void syscall_init_cpu(uint32_t cpu) {
+    if (syscall_use_sysenter) {
+        wrmsr(MSR_SYSENTER_CS, 0x08);
+        wrmsr(MSR_SYSENTER_ESP, sysenter_stack_top(cpu));
+        wrmsr(MSR_SYSENTER_EIP, (uint32_t)&sysenter_entry);
+    }
+}
+
+void syscall_init() {
+    idt_set_user(SYSCALL_VECTOR, &isr128);
+    syscall_init_cpu(0);
+}
@@ -3,85 +3,246 @@
  */
 
 #include "arch_x86/cpu.h"
+#include "arch_x86/task_switch.h"
 #include "device/console.h"
+#include "kernel/pmm.h"
 #include "kernel/scheduler.h"
+#include "kernel/slab.h"
+#include "kernel/smp.h"
+#include "kernel/spinlock.h"
 #include "kernel/task.h"
+#include "kernel/vmm.h"
 #include "lib/queue.h"
 #include "lib/util.h"
 
-#define STACK_SIZE 512
+#define KSTACK_FILL 0xA5   // kernel stacks start out filled with this (see task_kstack_used)
 
 uint32_t n_tasks = 0;
 
-task_t tasks[16];
-task_t* current_task = NULL;
+static task_t* task_table[MAX_TASKS];  // by task id; NULL if the id is free
+static slab_cache_t* task_cache = NULL;
 
-uint32_t kstacks[8][STACK_SIZE];
-uint32_t ustacks[8][STACK_SIZE];
+// guards changes to task_table and n_tasks (lookups just read a pointer)
+static lock_stats_t task_lock_stats = { .name = "tasks" };
+static spinlock_t task_lock = { .stats = &task_lock_stats };
 
 
+// Make a new task runnable: it joins the back of its run queue
 void add_task(task_t* t) {
-//    task_t* curr = thread_list;
-//    task_t* next = curr->next;
-//    while (next != thread_list) {
-//        curr = curr->next;
-//        next = curr->next;
-//    }
-//    curr->next = t;
-//    t->next = next;
-
-  //  print("Adding task ");
-  //  print_hex8(t->id);
-  //  print(": tasks[");
-  //  print_hex8(t->id - 1);
-  //  print("].next = task ");
-  //  print_hex8(t->id);
-  //  print("\n");
-
-  if (t->id > 0) {
-    tasks[t->id - 1].next = t;
-    t->next = &tasks[0];
-  } else {
-    t->next = t;
-  }
-
-//    print("Task 0 next: ");
-//    print_hex8(tasks[0].next->id);
-//    print("\n");
-}
-
-// Remove a task from the circular linked list
+    uint32_t flags = save_and_disable_interrupts();
+    sched_enqueue(t);
+    restore_interrupts(flags);
+}
+
+// Take a task off the run queues for good (it may be the current task,
+// which is on none)
 static void remove_task(task_t* t) {
-    // Find the task that points to t
-    task_t* prev = t;
-    while (prev->next != t) {
-        prev = prev->next;
+    sched_dequeue(t);
+}
+
+/**
+ * Release a terminated task and everything it owns. It must not be the
+ * current task, which may still be running on its kernel stack.
+ */
+static void free_task(task_t* t) {
+    vmm_destroy_space(t->page_dir);
+    vmm_free_kstack(t->id);
+    destroy_blocking_queue(t->keybuf);
+    destroy_event(t->exited);
+
+    // the id (and its stack slot) is free from here on
+    spin_lock(&task_lock);
+    task_table[t->id] = NULL;
+    n_tasks--;
+    spin_unlock(&task_lock);
+    slab_free(task_cache, t);
+}
+
+// free terminated tasks that nobody is going to wait for
+static void reap_detached() {
+    for (int i = 1; i < MAX_TASKS; i++) {
+        task_t* t = task_table[i];
+        if (t && t->detached && t->state == TERMINATED && !smp_is_running(t)) {
+            free_task(t);
+        }
     }
-    // Unlink t from the list
-    prev->next = t->next;
-    t->next = NULL;
 }
 
-void end_task() {
-    task_t* t = get_current_task();
+/**
+ * Get a task object with a free id, a kernel stack (in the stack slot of
+ * that id, see vmm_alloc_kstack) and its keyboard buffer and exit event.
+ * A user task also gets an (empty) address space of its own; kernel tasks
+ * run in the kernel's.
+ */
+static task_t* alloc_task(_Bool user) {
+    if (task_cache == NULL) {
+        task_cache = slab_cache_create("task", sizeof(task_t), NULL);
+    }
+    reap_detached();
+
+    task_t* t = slab_alloc(task_cache);
+    if (t == NULL) {
+        return NULL;
+    }
+    memset(t, 0, sizeof(task_t));
+    t->state = TERMINATED;   // not a task yet (init_task makes it NEW)
+
+    // claim a free id
+    spin_lock(&task_lock);
+    int tid = 0;
+    while (tid < MAX_TASKS && task_table[tid] != NULL) {
+        tid++;
+    }
+    if (tid < MAX_TASKS) {
+        task_table[tid] = t;
+        n_tasks++;
+    }
+    spin_unlock(&task_lock);
+    if (tid == MAX_TASKS) {
+        slab_free(task_cache, t);
+        return NULL;
+    }
+
+    t->id = tid;
+    t->cpu = this_cpu()->id;
+    t->kstack = vmm_alloc_kstack(tid);
+    t->page_dir = user ? vmm_create_space() : vmm_kernel_space();
+    t->keybuf = create_blocking_queue();
+    t->exited = create_event();
+    if (t->kstack == 0 || t->page_dir == 0 || t->keybuf == NULL || t->exited == NULL) {
+        vmm_destroy_space(t->page_dir);
+        vmm_free_kstack(tid);
+        destroy_blocking_queue(t->keybuf);
+        destroy_event(t->exited);
+        spin_lock(&task_lock);
+        task_table[tid] = NULL;
+        n_tasks--;
+        spin_unlock(&task_lock);
+        slab_free(task_cache, t);
+        return NULL;
+    }
+
+    memset((void*)(t->kstack - KSTACK_SIZE), KSTACK_FILL, KSTACK_SIZE);
+    return t;
+}
 
-    // Mark this task as terminated and remove from scheduler list
+/**
+ * Map the user stack page at `page`, owned by the task's address space.
+ * Returns the frame (0 if out of memory), which the caller may write
+ * through the kernel's mapping.
+ */
+static uint32_t map_user_stack(task_t* t, uint32_t page) {
+    uint32_t frame = pmm_alloc_frame();
+    if (frame == 0) {
+        return 0;
+    }
+    memset((void*)frame, 0, FRAME_SIZE);
+    if (vmm_map(t->page_dir, page, frame, FRAME_SIZE, PTE_USER | PTE_WRITE | PTE_OWNED) != 0) {
+        pmm_free_frame(frame);
+        return 0;
+    }
+    if (USER_STACK_TOP - page > t->ustack_size) {
+        t->ustack_size = USER_STACK_TOP - page;
+    }
+    return frame;
+}
+
+// the first page of a user stack; the rest is mapped as the stack grows
+static uint32_t alloc_user_stack(task_t* t) {
+    return map_user_stack(t, USER_STACK_TOP - FRAME_SIZE);
+}
+
+static void init_task(task_t* t, const char* name, uint32_t* kstack, uint8_t privilege) {
+    t->esp = (uint32_t)kstack;
+    t->state = NEW;
+    t->priority = PRIORITY_DEFAULT;
+    t->ticks = 0;
+    t->privilege = privilege;
+    t->exit_code = 0;
+    t->program.base = 0;
+    strncpy(t->name, name, 32);
+}
+
+/**
+ * Terminate the current task: take it off the run list, release its
+ * program image, cut its parent/child links, and wake whoever waits on
+ * it. Interrupts must be off.
+ * The task object itself is freed by wait_task, or on a later task
+ * creation if the task was detached.
+ */
+static void terminate(task_t* t, int exit_code) {
+    t->exit_code = exit_code;
     t->state = TERMINATED;
     remove_task(t);
+    unload_program(&t->program);
+    // children nobody can wait for any more are freed when they end
+    for (int i = 1; i < MAX_TASKS; i++) {
+        if (task_table[i] != NULL && task_table[i]->parent == t) {
+            task_table[i]->parent = NULL;
+            task_table[i]->detached = 1;
+        }
+    }
+    t->parent = NULL;
+    set_event(t->exited);
+}
 
-    // Yield the CPU forever; the scheduler (called from timer interrupt)
-    // will switch to another task.
+void end_task() {
+    asm volatile("cli");
+    terminate(get_current_task(), 0);
+
+    // a terminated task is never picked again
     for (;;) {
-        asm volatile("sti\nhlt");
+        yield();
+    }
+}
+
+/**
+ * Exit the current task from the system call handler; switches to the
+ * next task on the way out of the interrupt.
+ */
+void exit_task(int exit_code) {
+    terminate(get_current_task(), exit_code);
+    schedule(TERMINATED);
+}
+
+/**
+ * Wait for a task to terminate, free it, and return its exit code. If
+ * `stats` is not NULL it receives what the task used.
+ */
+int wait_task(uint32_t tid, task_stats_t* stats) {
+    task_t* t = get_task(tid);
+    if (t == NULL || t->detached) {
+        return -1;
+    }
+    wait_event(t->exited);
+    int exit_code = t->exit_code;
+    if (stats != NULL) {
+        stats->ticks = t->ticks;
+        stats->faults = t->faults;
+        stats->fault_cycles = t->fault_cycles;
+    }
+    free_task(t);
+    return exit_code;
+}
+
+/**
+ * Nobody will wait for this task; free it as soon as it has terminated.
+ */
+void detach_task(uint32_t tid) {
+    task_t* t = get_task(tid);
+    if (t != NULL) {
+        t->detached = 1;
     }
 }
 
 task_t* create_task(const char* name, void (*entry_point)(int)) {
-    int tid = n_tasks++;
-    task_t* t = &tasks[tid];
-    uint32_t* kstack = &kstacks[tid][STACK_SIZE];
+    task_t* t = alloc_task(0);
+    if (t == NULL) {
+        return NULL;
+    }
+    uint32_t* kstack = (uint32_t*)t->kstack;
 
-    push(kstack, tid);                   // task id (param to entry_point)
+    push(kstack, t->id);                 // task id (param to entry_point)
     push(kstack, (uint32_t)end_task);    // eip for ret
     push(kstack, 0x202);                 // eflags
     push(kstack, 0x08);                  // cs
@@ -101,39 +262,49 @@ task_t* create_task(const char* name, void (*entry_point)(int)) {
     push(kstack, 0x10);                  // fs
     push(kstack, 0x10);                  // gs
 
-    t->esp = (uint32_t)kstack;
-    t->kstack = (uint32_t)&kstacks[tid][STACK_SIZE];
-    t->state = NEW;
-    t->id = tid;
-    t->privilege = 0;
-    t->keybuf = create_blocking_queue();
-    strncpy(t->name, name, 32);
-
-  //  print("Created task ");
-  //  print_hex8(t->id);
-  //  print(" state: ");
-  //  print_hex8(t->state);
-  //  print("\n");
-
+    init_task(t, name, kstack, 0);
     add_task(t);
 
     return t;
 }
 
-task_t* create_user_task(const char* name, void (*entry_point)(int)) {
-    int tid = n_tasks++;
-    task_t* t = &tasks[tid];
-    uint32_t* kstack = &kstacks[tid][STACK_SIZE];
-    uint32_t* user_esp = &ustacks[tid][STACK_SIZE];
+/**
+ * Serve a fault on a not-present page at `addr` of the current task: grow
+ * its user stack, or page in its program image. Called from the exception
+ * handler with interrupts off; they are enabled while an image page is
+ * read, so other tasks run meanwhile. Returns 0 if the page is now
+ * mapped, -1 if `addr` is neither in the stack's range nor part of a
+ * demand-paged image (or the page could not be brought in).
+ */
+int task_page_fault(uint32_t addr) {
+    task_t* t = current_task;
+    program_t* prog = &t->program;
+    if (addr >= USER_STACK_TOP - USER_STACK_MAX && addr < USER_STACK_TOP) {
+        return map_user_stack(t, addr & ~(FRAME_SIZE - 1)) != 0 ? 0 : -1;
+    }
+    if (prog->file == NULL || addr < USER_BASE || addr - USER_BASE >= prog->size) {
+        return -1;
+    }
 
-//    push(stack, n_tasks);               // task id (param to entry_point)
-//    push(stack, (uint32_t)end_task);    // eip
+    uint64_t start = rdtsc();
+    asm volatile("sti");
+    int result = program_page_in(prog, t->page_dir, addr);
+    asm volatile("cli");
+    t->faults++;
+    t->fault_cycles += rdtsc() - start;
+    return result;
+}
 
+/**
+ * Build the initial ring-3 interrupt frame on the task's kernel stack, so
+ * the first switch to the task "returns" to `eip` in user mode.
+ */
+static uint32_t* push_user_frame(uint32_t* kstack, uint32_t eip, uint32_t* user_esp) {
     push(kstack, 0x20 | 3);              // ss
     push(kstack, (uint32_t)user_esp);    // esp
     push(kstack, 0x202);                 // eflags
     push(kstack, 0x18 | 3);              // cs
-    push(kstack, (uint32_t)entry_point); // eip
+    push(kstack, eip);                   // eip
     push(kstack, 0);                     // error_code
     push(kstack, 0);                     // int_no
     push(kstack, 0);                     // eax
@@ -148,33 +319,169 @@ task_t* create_user_task(const char* name, void (*entry_point)(int)) {
     push(kstack, 0x20 | 3);              // es
     push(kstack, 0x20 | 3);              // fs
     push(kstack, 0x20 | 3);              // gs
+    return kstack;
+}
 
-    t->esp = (uint32_t)kstack;
-    t->kstack = (uint32_t)&kstacks[tid][STACK_SIZE];
-    t->state = NEW;
-    t->id = tid;
-    t->privilege = 3;
-    t->keybuf = create_blocking_queue();
-    strncpy(t->name, name, 32);
+task_t* create_user_task(const char* name, void (*entry_point)(int)) {
+    task_t* t = alloc_task(1);
+    if (t == NULL) {
+        return NULL;
+    }
+    if (alloc_user_stack(t) == 0) {
+        free_task(t);
+        return NULL;
+    }
+    uint32_t* kstack = (uint32_t*)t->kstack;
 
+    kstack = push_user_frame(kstack, (uint32_t)entry_point, (uint32_t*)USER_STACK_TOP);
+
+    init_task(t, name, kstack, 3);
     add_task(t);
 
     return t;
 }
 
+/**
+ * Create a user task running a loaded program at USER_BASE in the task's
+ * address space. The entry point gets `arg` and returns to
+ * user_exit, which ends the task with its return value. On success the
+ * task owns `prog` and unloads it when it terminates.
+ */
+task_t* create_program_task(const char* name, program_t* prog, uint32_t arg) {
+    task_t* t = alloc_task(1);
+    if (t == NULL) {
+        return NULL;
+    }
+    uint32_t ustack_base = alloc_user_stack(t);
+    if (ustack_base == 0) {
+        free_task(t);
+        return NULL;
+    }
+    // a preloaded image is mapped now; a demand-paged one page by page
+    // as the task faults on it (task_page_fault)
+    uint32_t image_size = (prog->size + FRAME_SIZE - 1) & ~(FRAME_SIZE - 1);
+    if (prog->base != 0
+        && vmm_map(t->page_dir, USER_BASE, prog->base, image_size, PTE_USER | PTE_WRITE) != 0) {
+        free_task(t);
+        return NULL;
+    }
+    uint32_t* kstack = (uint32_t*)t->kstack;
+
+    // the stack is written through the kernel's mapping of its frame
+    uint32_t* ustack = (uint32_t*)(ustack_base + FRAME_SIZE);
+    push(ustack, arg);                   // param to the entry point
+    push(ustack, (uint32_t)user_exit);   // return address
+    uint32_t* user_esp = (uint32_t*)(USER_STACK_TOP - 2 * sizeof(uint32_t));
+
+    kstack = push_user_frame(kstack, (uint32_t)prog->entry, user_esp);
+
+    init_task(t, name, kstack, 3);
+    t->program = *prog;
+    add_task(t);
+
+    return t;
+}
+
+/**
+ * Fork the current user task from within the system call whose frame is
+ * `frame`. The child gets a copy-on-write copy of the address space (see
+ * vmm_fork_space) and the same program, and returns from the same system
+ * call with 0 in eax. Returns the child's id, or -1. Interrupts must be
+ * off.
+ */
+int fork_task(interrupt_frame_t* frame) {
+    task_t* parent = current_task;
+    if (parent->privilege != 3) {
+        return -1;
+    }
+    task_t* t = alloc_task(1);
+    if (t == NULL) {
+        return -1;
+    }
+    if (vmm_fork_space(parent->page_dir, t->page_dir) != 0) {
+        free_task(t);
+        return -1;
+    }
+
+    user_interrupt_frame_t* kframe =
+        (user_interrupt_frame_t*)(t->kstack - sizeof(user_interrupt_frame_t));
+    *kframe = *(user_interrupt_frame_t*)frame;
+    kframe->frame.eax = 0;
+    kframe->frame.esp = 0;               // no outer handler frame (see isr_common)
+
+    init_task(t, parent->name, (uint32_t*)kframe, 3);
+    t->ustack_size = parent->ustack_size;
+    t->program = parent->program;
+    t->program.base = 0;                 // preloaded pages were copied, not shared
+    t->parent = parent;
+    add_task(t);
+
+    return t->id;
+}
+
+/**
+ * The high-water mark of a task's kernel stack: the bytes from its top
+ * down to the deepest one that no longer holds the fill pattern.
+ */
+uint32_t task_kstack_used(task_t* t) {
+    uint8_t* bottom = (uint8_t*)(t->kstack - KSTACK_SIZE);
+    uint32_t i = 0;
+    while (i < KSTACK_SIZE && bottom[i] == KSTACK_FILL) {
+        i++;
+    }
+    return KSTACK_SIZE - i;
+}
+
 task_t* get_current_task() {
     return current_task;
 }
 
 task_t* get_task(uint32_t tid) {
-    return &tasks[tid];
+    return (tid < MAX_TASKS) ? task_table[tid] : NULL;
 }
 
+/**
+ * Change a task's state, and put it on its run queue or take it off to
+ * match: NEW and READY tasks are queued (unless running), others not.
+ */
 void set_task_state(uint32_t tid, task_state_t state) {
-    tasks[tid].state = state;
+    task_t* t = get_task(tid);
+    if (t == NULL) {
+        return;
+    }
+    uint32_t flags = save_and_disable_interrupts();
+    t->state = state;
+    if (state == READY || state == NEW) {
+        sched_enqueue(t);
+    } else {
+        sched_dequeue(t);
+    }
+    restore_interrupts(flags);
 }
 
-int get_task_list(task_t** task_list) {
-    *task_list = tasks;
-    return n_tasks;
+void set_task_priority(uint32_t tid, uint8_t priority) {
+    task_t* t = get_task(tid);
+    if (t == NULL || priority >= SCHED_PRIORITIES) {
+        return;
+    }
+    uint32_t flags = save_and_disable_interrupts();
+    _Bool queued = t->queued;
+    sched_dequeue(t);
+    t->priority = priority;
+    if (queued) {
+        sched_enqueue(t);
+    }
+    restore_interrupts(flags);
+}
+
+int get_task_list(task_t** task_list, int max) {
+    int n = 0;
+    spin_lock(&task_lock);
+    for (int i = 0; i < MAX_TASKS && n < max; i++) {
+        if (task_table[i] != NULL) {
+            task_list[n++] = task_table[i];
+        }
+    }
+    spin_unlock(&task_lock);
+    return n;
 }
@@ -1,11 +1,116 @@
 /**
  * Kernel Vectors
+ *
+ * The table of kernel services handed to programs, and the stubs it points
+ * to. Both sit in the user-accessible part of the kernel image; each stub
+ * enters the kernel through a system call, with SYSENTER if the CPU has it
+ * and INT 0x80 otherwise (see syscall.c).
  */
 
-#include "device/console.h"
+#include "kernel/syscall.h"
 #include "kernel/vector.h"
 
-kernel_vector_t kernel_vectors[] = {
-    [VEC_PUT_STR] = (kernel_vector_t)put_str,
-    [VEC_PRINT]   = (kernel_vector_t)print,
+// set by syscall_detect, before the page holding it turns read-only
+USER_DATA
+_Bool syscall_use_sysenter;
+
+USER_TEXT
+uint32_t syscall_int80(uint32_t call, uint32_t a, uint32_t b, uint32_t c, uint32_t d) {
+    asm volatile("int 0x80" : "+a"(call) : "b"(a), "c"(b), "d"(c), "S"(d) : "memory");
+    return call;
+}
+
+/**
+ * SYSENTER doesn't save a return address or stack pointer: the kernel
+ * returns to sysenter_return with the stack pointer kept in ebp, and
+ * SYSEXIT clobbers ecx and edx. (Only one copy of this code may exist,
+ * for the label.)
+ */
+USER_TEXT __attribute__((noinline))
+uint32_t syscall_sysenter(uint32_t call, uint32_t a, uint32_t b, uint32_t c, uint32_t d) {
+    asm volatile("push ebp \n"
+                 "mov ebp, esp \n"
+                 "sysenter \n"
+                 ".global sysenter_return \n"
+                 "sysenter_return: \n"
+                 "pop ebp"
+                 : "+a"(call), "+c"(b), "+d"(c) : "b"(a), "S"(d) : "memory");
+    return call;
+}
+
+USER_TEXT
+static uint32_t syscall(uint32_t call, uint32_t a, uint32_t b, uint32_t c, uint32_t d) {
+    if (syscall_use_sysenter) {
+        return syscall_sysenter(call, a, b, c, d);
+    }
+    return syscall_int80(call, a, b, c, d);
+}
+
+USER_TEXT
+void user_print(const char* str) {
+    syscall(SYS_PRINT, (uint32_t)str, 0, 0, 0);
+}
+
+USER_TEXT
+void user_put_str(const char* str, char attr, int row, int col) {
+    syscall(SYS_PUT_STR, (uint32_t)str, (uint32_t)attr, (uint32_t)row, (uint32_t)col);
+}
+
+USER_TEXT
+void user_put_char(unsigned char ch, char attr, int row, int col) {
+    syscall(SYS_PUT_CHAR, ch, (uint32_t)attr, (uint32_t)row, (uint32_t)col);
+}
+
+// returns the child's id in the parent, 0 in the child, -1 on failure
+USER_TEXT
+int user_fork(void) {
+    return (int)syscall(SYS_FORK, 0, 0, 0, 0);
+}
+
+// wait for a forked or spawned child to end; returns its exit code
+USER_TEXT
+int user_wait(int tid) {
+    return (int)syscall(SYS_WAIT, (uint32_t)tid, 0, 0, 0);
+}
+
+// give up the CPU to the next task
+USER_TEXT
+void user_yield(void) {
+    syscall(SYS_YIELD, 0, 0, 0, 0);
+}
+
+// wait for the next key typed while the task is the active one
+USER_TEXT
+char user_read_key(void) {
+    return (char)syscall(SYS_READ_KEY, 0, 0, 0, 0);
+}
+
+// start a program from disk; returns its task id, or -1
+USER_TEXT
+int user_spawn(const char* name) {
+    return (int)syscall(SYS_SPAWN, (uint32_t)name, 0, 0, 0);
+}
+
+USER_TEXT
+void user_sleep(uint32_t ms) {
+    syscall(SYS_SLEEP, ms, 0, 0, 0);
+}
+
+USER_TEXT _Noreturn
+void user_exit_task(int exit_code) {
+    syscall(SYS_EXIT, (uint32_t)exit_code, 0, 0, 0);
+    for (;;);
+}
+
+USER_RODATA
+const kernel_vector_t kernel_vectors[] = {
+    [VEC_PUT_STR]  = (kernel_vector_t)user_put_str,
+    [VEC_PRINT]    = (kernel_vector_t)user_print,
+    [VEC_FORK]     = (kernel_vector_t)user_fork,
+    [VEC_WAIT]     = (kernel_vector_t)user_wait,
+    [VEC_YIELD]    = (kernel_vector_t)user_yield,
+    [VEC_READ_KEY] = (kernel_vector_t)user_read_key,
+    [VEC_SPAWN]    = (kernel_vector_t)user_spawn,
+    [VEC_SLEEP]    = (kernel_vector_t)user_sleep,
+    [VEC_EXIT]     = (kernel_vector_t)user_exit_task,
 };
@@ -0,0 +1,448 @@
+/**
+ * Virtual Memory
+ *
+ * 32-bit paging with a page directory per user task. All directories
+ * share the kernel's part of the address space:
+ *
+ *   [0, 1GB)    kernel space: identity mapped, supervisor only. The first
+ *               4MB (kernel image, boot stack, VGA memory) goes through a
+ *               page table so that the pages of the .utext/.urodata/
+ *               .udata sections can be opened to ring 3, read-only (to
+ *               the kernel too, once CR0.WP is set); the rest is
+ *               mapped with 4MB pages, except for the last 4MB:
+ *   [1GB - 4MB, 1GB)
+ *               kernel stacks, mapped page by page through one page table
+ *               that all directories share. Each stack has an unmapped
+ *               guard page below it, so an overflow faults (and ends up
+ *               as a double fault, see exceptions.c) instead of running
+ *               into the next stack.
+ *   [1GB, 3GB)  user space, private to each directory
+ *   [3GB, 4GB)  device memory (framebuffer, APIC), see vmm_map_mmio
+ *
+ * Kernel mappings are global, so the CR3 reload on a switch between
+ * address spaces leaves the kernel's TLB entries in place.
+ *
+ * User frames mapped with PTE_OWNED belong to the address space. Forking
+ * shares them copy-on-write: both spaces map the frame read-only with
+ * PTE_COW, and a per-frame share count says how many other spaces map it.
+ * The first write fault in a space copies the page, unless the count
+ * shows nobody else maps it any more, in which case the space just takes
+ * the page back over. So a fork costs a copy of the page tables, and only
+ * the pages that are written afterwards get copied.
+ *
+ * The kernel is not moved to the higher half: the boot sector loads it as
+ * a flat binary at its link address, and with the identity mapping the
+ * kernel reaches every frame the pmm hands out (all of them lie below
+ * KSTACK_AREA) at its physical address, page tables included.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include "arch_x86/cpu.h"
+#include "device/console.h"
+#include "kernel/pmm.h"
+#include "kernel/vmm.h"
+#include "lib/util.h"
+
+#define LARGE_PAGE_SIZE  0x400000
+#define PDE_INDEX(va)    ((va) >> 22)
+#define PTE_INDEX(va)    (((va) >> PAGE_SHIFT) & 0x3FF)
+#define ENTRY_ADDR(e)    ((e) & ~0xFFFu)
+#define ENTRY_FLAGS(e)   ((e) & 0xFFFu)
+#define FRAME_INDEX(pa)  ((pa) >> PAGE_SHIFT)
+
+#define KERNEL_PDES      PDE_INDEX(KERNEL_SPACE_END)
+#define USER_PDE_START   PDE_INDEX(USER_BASE)
+#define USER_PDE_END     PDE_INDEX(USER_SPACE_END)
+
+#define CR0_WP           (1u << 16)
+#define CR0_PG           (1u << 31)
+#define CR4_PSE          (1u << 4)
+#define CR4_PGE          (1u << 7)
+
+// one share count per frame below KSTACK_AREA: 256KB
+#define SHARE_MAP_ORDER  6
+
+// the pages user code may execute and read (kernel.ld)
+extern uint8_t __user_start[];
+extern uint8_t __user_end[];
+
+static uint32_t* kernel_dir;
+static uint32_t* kstack_table;    // maps [KSTACK_AREA, KERNEL_SPACE_END)
+
+// other address spaces mapping each frame (allocated on the first fork);
+// a task can only be forked into MAX_TASKS - 1 others, so a byte will do
+static uint8_t* share_count;
+static vmm_stats_t stats;
+static volatile uint32_t kstack_gen;   // kernel stack unmappings so far
+
+static inline uint32_t read_cr3() {
+    uint32_t cr3;
+    asm volatile("mov %0, cr3" : "=r"(cr3));
+    return cr3;
+}
+
+static inline void invlpg(uint32_t vaddr) {
+    asm volatile("invlpg [%0]" : : "r"(vaddr) : "memory");
+}
+
+// a zeroed frame for a page directory or table
+static uint32_t* alloc_table() {
+    uint32_t* table = (uint32_t*)pmm_alloc_frame();
+    if (table != NULL) {
+        memset(table, 0, PAGE_SIZE);
+    }
+    return table;
+}
+
+/**
+ * The page table entry for `vaddr`, or NULL if there is no page table
+ * for it (or it is covered by a 4MB page).
+ */
+static uint32_t* lookup_pte(uint32_t* dir, uint32_t vaddr) {
+    uint32_t pde = dir[PDE_INDEX(vaddr)];
+    if (!(pde & PTE_PRESENT) || (pde & PTE_LARGE)) {
+        return NULL;
+    }
+    return &((uint32_t*)ENTRY_ADDR(pde))[PTE_INDEX(vaddr)];
+}
+
+void vmm_init() {
+    kernel_dir = alloc_table();
+    uint32_t* low_table = alloc_table();
+    kstack_table = alloc_table();
+    if (kernel_dir == NULL || low_table == NULL || kstack_table == NULL) {
+        print("vmm: no memory for page tables\n");
+        halt();
+    }
+
+    for (uint32_t i = 0; i < 1024; i++) {
+        uint32_t addr = i << PAGE_SHIFT;
+        if (addr >= (uint32_t)__user_start && addr < (uint32_t)__user_end) {
+            low_table[i] = addr | PTE_PRESENT | PTE_USER | PTE_GLOBAL;
+        } else {
+            low_table[i] = addr | PTE_PRESENT | PTE_WRITE | PTE_GLOBAL;
+        }
+    }
+    // access is the intersection of PDE and PTE bits; the PTEs decide
+    kernel_dir[0] = (uint32_t)low_table | PTE_PRESENT | PTE_WRITE | PTE_USER;
+    for (uint32_t i = 1; i < PDE_INDEX(KSTACK_AREA); i++) {
+        kernel_dir[i] = (i << 22) | PTE_PRESENT | PTE_WRITE | PTE_LARGE | PTE_GLOBAL;
+    }
+    kernel_dir[PDE_INDEX(KSTACK_AREA)] = (uint32_t)kstack_table | PTE_PRESENT | PTE_WRITE;
+
+    uint32_t cr0, cr4;
+    asm volatile("mov cr3, %0" : : "r"(kernel_dir));
+    asm volatile("mov %0, cr4" : "=r"(cr4));
+    asm volatile("mov cr4, %0" : : "r"(cr4 | CR4_PSE));
+    asm volatile("mov %0, cr0" : "=r"(cr0));
+    // WP: read-only pages are read-only for the kernel too
+    asm volatile("mov cr0, %0" : : "r"(cr0 | CR0_PG | CR0_WP) : "memory");
+    asm volatile("mov cr4, %0" : : "r"(cr4 | CR4_PSE | CR4_PGE));
+}
+
+uint32_t vmm_kernel_space() {
+    return (uint32_t)kernel_dir;
+}
+
+/**
+ * Create an address space: a page directory with the kernel mappings and
+ * an empty user space. Returns its physical address, or 0.
+ */
+uint32_t vmm_create_space() {
+    uint32_t* dir = alloc_table();
+    if (dir == NULL) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < KERNEL_PDES; i++) {
+        dir[i] = kernel_dir[i];
+    }
+    for (uint32_t i = USER_PDE_END; i < 1024; i++) {
+        dir[i] = kernel_dir[i];
+    }
+    return (uint32_t)dir;
+}
+
+// drop an address space's claim on an owned frame; the last one frees it
+static void release_frame(uint32_t frame) {
+    uint32_t flags = save_and_disable_interrupts();
+    if (share_count != NULL && share_count[FRAME_INDEX(frame)] > 0) {
+        share_count[FRAME_INDEX(frame)]--;
+    } else {
+        pmm_free_frame(frame);
+    }
+    restore_interrupts(flags);
+}
+
+/**
+ * Free an address space's page directory and user page tables, and the
+ * frames mapped with PTE_OWNED (or its share of them, if they are shared
+ * with a forked space). Other frames belong to someone else (a preloaded
+ * program image) and are not touched.
+ */
+void vmm_destroy_space(uint32_t page_dir) {
+    uint32_t* dir = (uint32_t*)page_dir;
+    if (dir == NULL || dir == kernel_dir) {
+        return;
+    }
+    for (uint32_t i = USER_PDE_START; i < USER_PDE_END; i++) {
+        if (!(dir[i] & PTE_PRESENT) || (dir[i] & PTE_LARGE)) {
+            continue;
+        }
+        uint32_t* table = (uint32_t*)ENTRY_ADDR(dir[i]);
+        for (uint32_t j = 0; j < 1024; j++) {
+            if ((table[j] & PTE_PRESENT) && (table[j] & PTE_OWNED)) {
+                release_frame(ENTRY_ADDR(table[j]));
+            }
+        }
+        pmm_free_frame((uint32_t)table);
+    }
+    pmm_free_frame(page_dir);
+}
+
+/**
+ * Map [vaddr, vaddr + size) of user space to physical memory at `paddr`
+ * with 4KB pages. `flags` are PTE_* bits (PTE_PRESENT is implied).
+ * Returns 0, or -1 if the range is not in user space or a page table
+ * could not be allocated.
+ */
+int vmm_map(uint32_t page_dir, uint32_t vaddr, uint32_t paddr, uint32_t size, uint32_t flags) {
+    uint32_t* dir = (uint32_t*)page_dir;
+    uint32_t end = vaddr + size;
+    if (dir == kernel_dir || vaddr < USER_BASE || end > USER_SPACE_END || end < vaddr
+        || ((vaddr | paddr) & (PAGE_SIZE - 1))) {
+        return -1;
+    }
+
+    _Bool current = (read_cr3() == page_dir);
+    for (; vaddr < end; vaddr += PAGE_SIZE, paddr += PAGE_SIZE) {
+        uint32_t* pde = &dir[PDE_INDEX(vaddr)];
+        if (!(*pde & PTE_PRESENT)) {
+            uint32_t* table = alloc_table();
+            if (table == NULL) {
+                return -1;
+            }
+            *pde = (uint32_t)table | PTE_PRESENT | PTE_WRITE | PTE_USER;
+        }
+        ((uint32_t*)ENTRY_ADDR(*pde))[PTE_INDEX(vaddr)] = paddr | flags | PTE_PRESENT;
+        if (current) {
+            invlpg(vaddr);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Identity map device memory, uncached, in every address space. Only the
+ * top gigabyte is available for this, and the mapping is made in the
+ * kernel directory, which new address spaces copy: call it during boot,
+ * before user tasks are created.
+ */
+void vmm_map_mmio(uint32_t paddr, uint32_t size) {
+    if (paddr + size <= KSTACK_AREA) {
+        return;   // already mapped
+    }
+    if (paddr < USER_SPACE_END) {
+        print("vmm: device memory overlaps user space\n");
+        return;
+    }
+
+    uint32_t start = paddr & ~(LARGE_PAGE_SIZE - 1);
+    uint32_t last = paddr + size - 1;
+    for (uint32_t i = PDE_INDEX(start); i <= PDE_INDEX(last); i++) {
+        kernel_dir[i] = (i << 22) | PTE_PRESENT | PTE_WRITE | PTE_LARGE | PTE_GLOBAL
+                        | PTE_PCD | PTE_PWT;
+        invlpg(i << 22);
+    }
+}
+
+/**
+ * Map a kernel stack in stack slot `slot` (a task id), above the slot's
+ * guard page. The mapping is visible in every address space. Returns the
+ * top of the stack, or 0 if out of memory.
+ */
+uint32_t vmm_alloc_kstack(uint32_t slot) {
+    uint32_t base = KSTACK_AREA + slot * KSTACK_SLOT_SIZE + PAGE_SIZE;
+    if (base + KSTACK_SIZE > KERNEL_SPACE_END) {
+        return 0;
+    }
+    for (uint32_t va = base; va < base + KSTACK_SIZE; va += PAGE_SIZE) {
+        uint32_t frame = pmm_alloc_frame();
+        if (frame == 0) {
+            vmm_free_kstack(slot);
+            return 0;
+        }
+        kstack_table[PTE_INDEX(va)] = frame | PTE_PRESENT | PTE_WRITE | PTE_GLOBAL;
+        // this CPU may still hold the slot's last stack, freed on another
+        // one since it last switched tasks (see vmm_sync_kstacks)
+        invlpg(va);
+    }
+    return base + KSTACK_SIZE;
+}
+
+/**
+ * Unmap the kernel stack in `slot` and free its frames. It must not be
+ * the stack in use.
+ */
+void vmm_free_kstack(uint32_t slot) {
+    uint32_t base = KSTACK_AREA + slot * KSTACK_SLOT_SIZE + PAGE_SIZE;
+    for (uint32_t va = base; va < base + KSTACK_SIZE; va += PAGE_SIZE) {
+        uint32_t* pte = &kstack_table[PTE_INDEX(va)];
+        if (*pte & PTE_PRESENT) {
+            pmm_free_frame(ENTRY_ADDR(*pte));
+            *pte = 0;
+            invlpg(va);
+        }
+    }
+    kstack_gen++;
+}
+
+/**
+ * Drop this CPU's TLB entries for kernel stacks unmapped since `*seen`
+ * (a count kept by the caller, updated here). vmm_free_kstack only
+ * invalidates them on the CPU that ran it, and a stale entry would put
+ * the next stack in the slot on a freed frame. The mappings are global,
+ * so it takes toggling CR4.PGE. Called before switching tasks.
+ */
+void vmm_sync_kstacks(uint32_t* seen) {
+    if (*seen == kstack_gen) {
+        return;
+    }
+    *seen = kstack_gen;
+    uint32_t cr4;
+    asm volatile("mov %0, cr4" : "=r"(cr4));
+    asm volatile("mov cr4, %0" : : "r"(cr4 & ~CR4_PGE) : "memory");
+    asm volatile("mov cr4, %0" : : "r"(cr4) : "memory");
+}
+
+/**
+ * Load an address space, unless it is the current one already.
+ */
+void vmm_switch(uint32_t page_dir) {
+    if (read_cr3() != page_dir) {
+        asm volatile("mov cr3, %0" : : "r"(page_dir) : "memory");
+    }
+}
+
+/**
+ * Check that user code may access [vaddr, vaddr + size) (for writing if
+ * `write`), so the kernel can touch it on the user's behalf.
+ */
+_Bool vmm_user_accessible(uint32_t page_dir, uint32_t vaddr, uint32_t size, _Bool write) {
+    uint32_t end = vaddr + size;
+    if (vaddr < USER_BASE || end > USER_SPACE_END || end < vaddr) {
+        return 0;
+    }
+
+    for (uint32_t page = vaddr & ~(PAGE_SIZE - 1); page < end; page += PAGE_SIZE) {
+        uint32_t* pte = lookup_pte((uint32_t*)page_dir, page);
+        if (pte == NULL || !(*pte & PTE_PRESENT) || !(*pte & PTE_USER)
+            || (write && !(*pte & PTE_WRITE))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Fill the empty user space of `child_dir` from `parent_dir` for a fork.
+ * Owned pages are shared copy-on-write (writable ones become read-only in
+ * both spaces); pages the parent doesn't own get a private copy, owned by
+ * the child. Runs with interrupts off, in the parent's address space.
+ * Returns 0, or -1 if memory ran out; the child space is then only partly
+ * filled and should be destroyed.
+ */
+int vmm_fork_space(uint32_t parent_dir, uint32_t child_dir) {
+    uint32_t* dir = (uint32_t*)parent_dir;
+
+    if (share_count == NULL) {
+        share_count = (uint8_t*)pmm_alloc_frames(SHARE_MAP_ORDER);
+        if (share_count == NULL) {
+            return -1;
+        }
+        memset(share_count, 0, FRAME_SIZE << SHARE_MAP_ORDER);
+    }
+
+    for (uint32_t i = USER_PDE_START; i < USER_PDE_END; i++) {
+        if (!(dir[i] & PTE_PRESENT) || (dir[i] & PTE_LARGE)) {
+            continue;
+        }
+        uint32_t* table = (uint32_t*)ENTRY_ADDR(dir[i]);
+        for (uint32_t j = 0; j < 1024; j++) {
+            uint32_t pte = table[j];
+            uint32_t vaddr = (i << 22) | (j << PAGE_SHIFT);
+            if (!(pte & PTE_PRESENT)) {
+                continue;
+            }
+
+            if (pte & PTE_OWNED) {
+                if (pte & PTE_WRITE) {
+                    pte = (pte & ~PTE_WRITE) | PTE_COW;
+                    table[j] = pte;
+                }
+                if (vmm_map(child_dir, vaddr, ENTRY_ADDR(pte), PAGE_SIZE, ENTRY_FLAGS(pte)) != 0) {
+                    return -1;
+                }
+                share_count[FRAME_INDEX(ENTRY_ADDR(pte))]++;
+                stats.shared_pages++;
+            } else {
+                uint32_t copy = pmm_alloc_frame();
+                if (copy == 0) {
+                    return -1;
+                }
+                memcpy((void*)copy, (void*)ENTRY_ADDR(pte), PAGE_SIZE);
+                if (vmm_map(child_dir, vaddr, copy, PAGE_SIZE, ENTRY_FLAGS(pte) | PTE_OWNED) != 0) {
+                    pmm_free_frame(copy);
+                    return -1;
+                }
+                stats.copied_pages++;
+            }
+        }
+    }
+
+    // the parent's writable pages just became read-only
+    if (read_cr3() == parent_dir) {
+        asm volatile("mov cr3, %0" : : "r"(parent_dir) : "memory");
+    }
+    stats.forks++;
+    return 0;
+}
+
+/**
+ * Serve a write fault at `vaddr` on a copy-on-write page: give the space
+ * a private, writable copy of the page, or make the page writable again
+ * if no other space shares it any more. Returns 0, or -1 if the page is
+ * not copy-on-write (a real protection fault) or memory ran out.
+ * Interrupts must be off.
+ */
+int vmm_copy_on_write(uint32_t page_dir, uint32_t vaddr) {
+    if (vaddr < USER_BASE || vaddr >= USER_SPACE_END) {
+        return -1;
+    }
+    uint32_t* pte = lookup_pte((uint32_t*)page_dir, vaddr);
+    if (pte == NULL || (*pte & (PTE_PRESENT | PTE_COW)) != (PTE_PRESENT | PTE_COW)) {
+        return -1;
+    }
+
+    uint32_t frame = ENTRY_ADDR(*pte);
+    uint32_t flags = (ENTRY_FLAGS(*pte) & ~PTE_COW) | PTE_WRITE;
+    if (share_count[FRAME_INDEX(frame)] == 0) {
+        *pte = frame | flags;
+        stats.cow_reuses++;
+    } else {
+        uint32_t copy = pmm_alloc_frame();
+        if (copy == 0) {
+            return -1;
+        }
+        memcpy((void*)copy, (void*)frame, PAGE_SIZE);
+        share_count[FRAME_INDEX(frame)]--;
+        *pte = copy | flags;
+        stats.cow_copies++;
+    }
+    invlpg(vaddr & ~(PAGE_SIZE - 1));
+    return 0;
+}
+
+void vmm_get_stats(vmm_stats_t* out) {
+    *out = stats;
+}
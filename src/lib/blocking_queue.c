@@ -1,30 +1,79 @@
+/**
+ * Blocking Queue
+ *
+ * A single-producer/single-consumer ring (queue.c) with an event for the
+ * consumer to sleep on while it is empty. Neither side takes a lock: the
+ * producer publishes an item and then signals the event; the consumer
+ * resets the event and then checks the ring once more before it waits.
+ * Whichever way the two interleave, either the check sees the item or the
+ * signal comes after the reset and the wait returns at once, so no wakeup
+ * is lost. (reset_event is a full barrier, and signal_event takes a lock,
+ * so neither side's store is passed by its following load.)
+ */
+
+#include <stddef.h>
 #include "kernel/event.h"
+#include "kernel/slab.h"
 #include "lib/queue.h"
 #include "lib/blocking_queue.h"
 
-static blocking_queue_t queues[16];
-static int n_queues = 0;
+static slab_cache_t* bq_cache = NULL;
 
 blocking_queue_t* create_blocking_queue() {
-    if (n_queues >= 16) {
-        return 0;
+    if (bq_cache == NULL) {
+        bq_cache = slab_cache_create("blocking_queue", sizeof(blocking_queue_t), NULL);
+    }
+    blocking_queue_t* q = slab_alloc(bq_cache);
+    if (q == NULL) {
+        return NULL;
+    }
+    q->dropped = 0;
+    q->inner = create_queue();
+    q->not_empty_evt = create_event();
+    if (q->inner == NULL || q->not_empty_evt == NULL) {
+        destroy_blocking_queue(q);
+        return NULL;
+    }
+    return q;
+}
+
+void destroy_blocking_queue(blocking_queue_t* q) {
+    if (q == NULL) {
+        return;
     }
-    queues[n_queues].inner = create_queue();
-    queues[n_queues].not_empty_evt = create_event();
-    return &queues[n_queues++];
+    destroy_queue(q->inner);
+    destroy_event(q->not_empty_evt);
+    slab_free(bq_cache, q);
 }
 
+// producer side: safe to call from an interrupt handler
 void bq_enqueue(blocking_queue_t* q, char ch) {
-    enqueue(q->inner, ch);
-    set_event(q->not_empty_evt);
+    if (!enqueue(q->inner, ch)) {
+        q->dropped++;
+        return;
+    }
+    signal_event(q->not_empty_evt);
 }
 
-char bq_dequeue(blocking_queue_t* q) {
-    wait_event(q->not_empty_evt);
-    char ch = dequeue(q->inner);
-    if (bq_is_empty(q)) {
+/**
+ * Take up to `max` items into `buf`, waiting until there is at least one:
+ * a burst that arrived while the consumer was away comes back in one call.
+ * Returns the number taken.
+ */
+uint32_t bq_dequeue_batch(blocking_queue_t* q, char* buf, uint32_t max) {
+    uint32_t n;
+    while ((n = dequeue_batch(q->inner, buf, max)) == 0) {
         reset_event(q->not_empty_evt);
+        if (bq_is_empty(q)) {
+            wait_event(q->not_empty_evt);
+        }
     }
+    return n;
+}
+
+char bq_dequeue(blocking_queue_t* q) {
+    char ch;
+    bq_dequeue_batch(q, &ch, 1);
     return ch;
 }
 
@@ -1,50 +1,88 @@
-#include "lib/queue.h"
-#include "device/console.h"
-
-#define next(pos) ((pos + 1) % QUEUE_MAX_ITEMS)
+/**
+ * Single-Producer/Single-Consumer Ring
+ *
+ * head and tail run freely (the slot is the index masked to the buffer
+ * size, and tail - head is the number of items, even across wraparound),
+ * and each has one writer: the producer publishes an item by storing tail
+ * with release order after filling its slot, and the consumer frees a slot
+ * by storing head with release order after reading it. Each side loads the
+ * other's index with acquire order, so it sees the slot contents that go
+ * with it. No lock is needed, and an interrupt handler can be the producer
+ * while a task consumes, on the same CPU or another one.
+ */
 
-static queue_t queues[16];
-static int n_queues = 0;
+#include <stddef.h>
+#include "lib/queue.h"
+#include "kernel/slab.h"
 
-//void printq(queue_t* q) {
-//    print("[f=");
-//    print_hex8(q->front);
-//    print(" r=");
-//    print_hex8(q->rear);
-//    print("]");
-//}
+static slab_cache_t* queue_cache = NULL;
 
+static void queue_ctor(void* obj) {
+    queue_t* q = obj;
+    q->head = 0;
+    q->tail = 0;
+}
 
 queue_t* create_queue() {
-    if (n_queues >= 16) {
-        return 0;
+    if (queue_cache == NULL) {
+        queue_cache = slab_cache_create("queue", sizeof(queue_t), queue_ctor);
     }
-    queues[n_queues].front = 0;
-    queues[n_queues].rear = 0;
-    return &queues[n_queues++];
+    return slab_alloc(queue_cache);
 }
 
-void enqueue(queue_t* q, char ch) {
-    if (is_full(q)) {
+void destroy_queue(queue_t* q) {
+    if (q == NULL) {
         return;
     }
-    q->buf[q->rear] = ch;
-    q->rear = next(q->rear);
+    queue_ctor(q);
+    slab_free(queue_cache, q);
 }
 
-char dequeue(queue_t* q) {
-    if (is_empty(q)) {
+/**
+ * Add an item (producer only). Returns 0, dropping the item, if the queue
+ * is full.
+ */
+_Bool enqueue(queue_t* q, char ch) {
+    uint32_t tail = q->tail;
+    if (tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == QUEUE_MAX_ITEMS) {
         return 0;
     }
-    char ch = q->buf[q->front];
-    q->front = next(q->front);
-    return ch;
+    q->buf[tail & QUEUE_MASK] = ch;
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/**
+ * Take the oldest item (consumer only), or 0 if the queue is empty.
+ */
+char dequeue(queue_t* q) {
+    char ch;
+    return dequeue_batch(q, &ch, 1) ? ch : 0;
+}
+
+/**
+ * Take up to `max` items into `buf` at once (consumer only): everything
+ * published so far, with one load of tail and one store of head. Returns
+ * the number taken.
+ */
+uint32_t dequeue_batch(queue_t* q, char* buf, uint32_t max) {
+    uint32_t head = q->head;
+    uint32_t n = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) - head;
+    if (n > max) {
+        n = max;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        buf[i] = q->buf[(head + i) & QUEUE_MASK];
+    }
+    __atomic_store_n(&q->head, head + n, __ATOMIC_RELEASE);
+    return n;
 }
 
 _Bool is_empty(queue_t* q) {
-    return q->rear == q->front;
+    return __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
 }
 
 _Bool is_full(queue_t* q) {
-    return next(q->rear) == q->front;
+    return __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)
+        == QUEUE_MAX_ITEMS;
 }
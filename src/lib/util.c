@@ -28,6 +28,34 @@ void to_hex32(uint32_t value, char* buf) {
     buf[8] = 0;
 }
 
+void to_dec32(uint32_t value, char* buf) {
+    char tmp[10];
+    int n = 0;
+    do {
+        tmp[n++] = '0' + (value % 10);
+        value /= 10;
+    } while (value);
+    for (int i = 0; i < n; i++) {
+        buf[i] = tmp[n - 1 - i];
+    }
+    buf[n] = 0;
+}
+
+/**
+ * Divide a 64-bit value by a 32-bit divisor without pulling in libgcc.
+ */
+uint64_t udiv64(uint64_t n, uint32_t d) {
+    uint32_t hi = n >> 32;
+    uint32_t lo = (uint32_t)n;
+    uint32_t q_hi = hi / d;
+    uint32_t rem = hi % d;
+    uint32_t q_lo;
+    asm("div %2"
+        : "=a"(q_lo), "=d"(rem)
+        : "rm"(d), "a"(lo), "d"(rem));
+    return ((uint64_t)q_hi << 32) | q_lo;
+}
+
 int strcmp(const char* str1, const char* str2) {
     for(; *str1 && *str2 && *str1 == *str2; str1++, str2++);
     return *str1 - *str2;
@@ -47,4 +75,22 @@ void strncpy(char* dest, const char* src, size_t n) {
     if (i < n) {
         dest[i] = '\0';
     }
-}
\ No newline at end of file
+}
+
+void* memcpy(void* dest, const void* src, size_t n) {
+    void* d = dest;
+    asm volatile("rep movsb"
+        : "+D"(d), "+S"(src), "+c"(n)
+        :
+        : "memory");
+    return dest;
+}
+
+void* memset(void* dest, int value, size_t n) {
+    void* d = dest;
+    asm volatile("rep stosb"
+        : "+D"(d), "+c"(n)
+        : "a"(value)
+        : "memory");
+    return dest;
+}
@@ -0,0 +1,586 @@
+/**
+ * Shell Benchmarks
+ *
+ * Each benchmark runs inside the shell task under QEMU and reports its
+ * results on the console, so the numbers include whatever the emulated
+ * hardware and the other tasks (e.g. the dots tasks) are doing.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include "bench.h"
+#include "arch_x86/cpu.h"
+#include "device/ata.h"
+#include "device/console.h"
+#include "device/pit.h"
+#include "kernel/kmalloc.h"
+#include "kernel/pmm.h"
+#include "kernel/scheduler.h"
+#include "kernel/smp.h"
+#include "kernel/syscall.h"
+#include "kernel/task.h"
+#include "kernel/vector.h"
+#include "kernel/vmm.h"
+#include "lib/util.h"
+
+#define ATA_BENCH_LBA        5    // start of the kernel image
+#define ATA_BENCH_SECTORS    16
+#define ATA_BENCH_ITERATIONS 64
+
+#define PMM_BENCH_BATCH      64
+#define PMM_BENCH_ITERATIONS 256
+
+#define HEAP_BENCH_OPS       4096
+#define HEAP_BENCH_SLOTS     256
+
+#define FORK_BENCH_ITERATIONS 64
+
+#define SCHED_BENCH_MAX_TASKS 48
+#define SCHED_BENCH_PICKS     1000
+
+#define SMP_BENCH_TASKS       8
+#define SMP_BENCH_LOOPS       25000000
+
+#define SYSCALL_BENCH_ITERATIONS 10000
+
+static uint8_t bench_buf[ATA_BENCH_SECTORS * 512] __attribute__((aligned(4)));
+static uint32_t bench_frames[PMM_BENCH_BATCH];
+
+// prints a value given in hundredths as "x.yy"
+static void print_fixed2(uint32_t hundredths) {
+    print_dec32(hundredths / 100);
+    print(".");
+    if (hundredths % 100 < 10) {
+        print("0");
+    }
+    print_dec32(hundredths % 100);
+}
+
+static void bench_ata_mode(ata_mode_t mode, const char* label) {
+    task_t* self = get_current_task();
+    ata_mode_t saved_mode = ata_get_mode();
+    ata_set_mode(mode);
+    if (ata_get_mode() != mode) {
+        print(label);
+        print(": not available\n");
+        ata_set_mode(saved_mode);
+        return;
+    }
+    ata_reset_stats();
+
+    uint32_t start_ticks = get_ticks();
+    uint32_t start_own = self->ticks;
+
+    for (int i = 0; i < ATA_BENCH_ITERATIONS; i++) {
+        read_sectors(ATA_BENCH_LBA, ATA_BENCH_SECTORS, (uint32_t*)bench_buf);
+    }
+
+    uint32_t elapsed = get_ticks() - start_ticks;
+    uint32_t own = self->ticks - start_own;
+
+    ata_stats_t stats;
+    ata_get_stats(&stats);
+    ata_set_mode(saved_mode);
+
+    if (elapsed == 0) {
+        elapsed = 1;
+    }
+    uint32_t sectors = stats.sectors ? stats.sectors : 1;
+
+    print(label);
+    print(": ");
+    print_dec32(stats.sectors);
+    print(" sectors, ");
+    print_dec32(stats.commands);
+    print(" cmds, ");
+    // sectors * 512 bytes / (elapsed / TIMER_HZ) seconds, in 0.01 MB/s
+    print_fixed2(stats.sectors * TIMER_HZ * 100 / (2048 * elapsed));
+    print(" MB/s\n    ");
+    print_dec32((uint32_t)udiv64(stats.cpu_cycles, sectors));
+    print(" CPU cycles/sector, other tasks ran ");
+    print_dec32(elapsed - own);
+    print("/");
+    print_dec32(elapsed);
+    print(" ticks\n");
+}
+
+/**
+ * Read the same run of sectors repeatedly through each transfer path.
+ *
+ * With polling the shell keeps every tick it is scheduled for; with IRQ14
+ * it is parked while the drive works and the ticks go to the other tasks.
+ * "CPU cycles/sector" counts only time spent inside the driver (issuing
+ * commands, polling, copying data), so it shows how much of the transfer
+ * the CPU still does by hand in each mode.
+ */
+void bench_ata() {
+    ata_info_t info;
+    ata_get_info(&info);
+    print("disk: ");
+    print_dec32(info.total_sectors);
+    print(" sectors, ");
+    print(info.lba48 ? "LBA48" : "LBA28");
+    print(", ");
+    print_dec32(info.multiple);
+    print(" sectors/DRQ block\n");
+
+    bench_ata_mode(ATA_MODE_POLL, "PIO poll");
+    bench_ata_mode(ATA_MODE_IRQ,  "PIO irq ");
+    bench_ata_mode(ATA_MODE_DMA,  "DMA     ");
+}
+
+static void bench_pmm_order(uint32_t order, const char* label) {
+    uint64_t cycles = 0;
+    uint32_t ops = 0;
+
+    for (int i = 0; i < PMM_BENCH_ITERATIONS; i++) {
+        // keep the timer out of the measurement
+        asm volatile("cli");
+        uint64_t start = rdtsc();
+        int n = 0;
+        while (n < PMM_BENCH_BATCH && (bench_frames[n] = pmm_alloc_frames(order)) != 0) {
+            n++;
+        }
+        for (int j = n - 1; j >= 0; j--) {
+            pmm_free_frames(bench_frames[j], order);
+        }
+        cycles += rdtsc() - start;
+        asm volatile("sti");
+        ops += n;
+    }
+
+    print(label);
+    print(": ");
+    if (ops == 0) {
+        print("out of memory\n");
+        return;
+    }
+    print_dec32((uint32_t)udiv64(cycles, ops));
+    print(" cycles per alloc+free\n");
+}
+
+/**
+ * Allocate and free batches of blocks of a few sizes. Single frames are
+ * served from the order-0 bitmap; larger blocks exercise splitting and
+ * buddy merging.
+ */
+void bench_pmm() {
+    pmm_stats_t stats;
+    pmm_get_stats(&stats);
+    print("frames: ");
+    print_dec32(stats.free_frames);
+    print(" free of ");
+    print_dec32(stats.total_frames);
+    print("\n");
+
+    bench_pmm_order(0, "4KB   ");
+    bench_pmm_order(4, "64KB  ");
+    bench_pmm_order(PMM_MAX_ORDER, "4MB   ");
+}
+
+static uint32_t bench_rng = 2463534242u;
+
+static uint32_t bench_random() {
+    bench_rng ^= bench_rng << 13;
+    bench_rng ^= bench_rng >> 17;
+    bench_rng ^= bench_rng << 5;
+    return bench_rng;
+}
+
+// mostly small objects, some buffers, a few page-backed allocations
+static uint32_t heap_bench_size() {
+    uint32_t r = bench_random() % 100;
+    if (r < 70) {
+        return 8 + bench_random() % 248;
+    }
+    if (r < 95) {
+        return 256 + bench_random() % 3840;
+    }
+    return 8192 + bench_random() % 24576;
+}
+
+static void sort_samples(uint32_t* a, uint32_t n) {
+    for (uint32_t gap = n / 2; gap > 0; gap /= 2) {
+        for (uint32_t i = gap; i < n; i++) {
+            uint32_t v = a[i];
+            uint32_t j = i;
+            for (; j >= gap && a[j - gap] > v; j -= gap) {
+                a[j] = a[j - gap];
+            }
+            a[j] = v;
+        }
+    }
+}
+
+static void print_percentiles(const char* label, uint32_t* samples, uint32_t n) {
+    print(label);
+    if (n == 0) {
+        print(": no samples\n");
+        return;
+    }
+    sort_samples(samples, n);
+    print(": p50 ");
+    print_dec32(samples[n * 50 / 100]);
+    print("  p90 ");
+    print_dec32(samples[n * 90 / 100]);
+    print("  p99 ");
+    print_dec32(samples[n * 99 / 100]);
+    print("  max ");
+    print_dec32(samples[n - 1]);
+    print(" cycles\n");
+}
+
+/**
+ * Random alloc/free churn over a fixed set of slots. Each live block is
+ * filled with a per-slot byte and checked before it is freed, so the run
+ * doubles as a heap stress test. Every call is timed on its own (with
+ * interrupts off) and the latency distribution is reported, since the
+ * tail is what an interrupt-sensitive caller cares about.
+ */
+void bench_heap() {
+    uint32_t* alloc_cycles = kmalloc(HEAP_BENCH_OPS * sizeof(uint32_t));
+    uint32_t* free_cycles = kmalloc(HEAP_BENCH_OPS * sizeof(uint32_t));
+    uint8_t** slots = kzalloc(HEAP_BENCH_SLOTS * sizeof(uint8_t*));
+    uint32_t* sizes = kmalloc(HEAP_BENCH_SLOTS * sizeof(uint32_t));
+    if (!alloc_cycles || !free_cycles || !slots || !sizes) {
+        print("out of memory\n");
+        kfree(alloc_cycles);
+        kfree(free_cycles);
+        kfree(slots);
+        kfree(sizes);
+        return;
+    }
+
+    uint32_t n_alloc = 0, n_free = 0, failed = 0, corrupt = 0;
+    for (int op = 0; op < HEAP_BENCH_OPS; op++) {
+        uint32_t i = bench_random() % HEAP_BENCH_SLOTS;
+        uint8_t* p = slots[i];
+
+        if (p) {
+            for (uint32_t j = 0; j < sizes[i]; j++) {
+                if (p[j] != (uint8_t)i) {
+                    corrupt++;
+                    break;
+                }
+            }
+            asm volatile("cli");
+            uint64_t start = rdtsc();
+            kfree(p);
+            free_cycles[n_free++] = (uint32_t)(rdtsc() - start);
+            asm volatile("sti");
+            slots[i] = NULL;
+        } else {
+            uint32_t size = heap_bench_size();
+            asm volatile("cli");
+            uint64_t start = rdtsc();
+            p = kmalloc(size);
+            alloc_cycles[n_alloc++] = (uint32_t)(rdtsc() - start);
+            asm volatile("sti");
+            if (p == NULL) {
+                failed++;
+                continue;
+            }
+            memset(p, (uint8_t)i, size);
+            slots[i] = p;
+            sizes[i] = size;
+        }
+    }
+
+    for (int i = 0; i < HEAP_BENCH_SLOTS; i++) {
+        kfree(slots[i]);
+    }
+
+    print_dec32(n_alloc);
+    print(" allocs, ");
+    print_dec32(n_free);
+    print(" frees, ");
+    print_dec32(failed);
+    print(" failed, ");
+    print_dec32(corrupt);
+    print(" corrupted\n");
+    print_percentiles("kmalloc", alloc_cycles, n_alloc);
+    print_percentiles("kfree  ", free_cycles, n_free);
+
+    kfree(alloc_cycles);
+    kfree(free_cycles);
+    kfree(slots);
+    kfree(sizes);
+}
+
+/**
+ * The fork benchmark's task, in ring 3: fork a child that exits at once,
+ * wait for it, repeat. Only the fork call itself is timed here; the
+ * average comes back as the exit code (-1 if a fork failed). Being user
+ * code it can only call the system call stubs, and has no strings.
+ */
+USER_TEXT _Noreturn
+static void fork_bench_task(int _tid) {
+    uint32_t total = 0;
+    for (int i = 0; i < FORK_BENCH_ITERATIONS; i++) {
+        uint32_t start, end;
+        asm volatile("rdtsc" : "=a"(start) : : "edx");
+        int child = user_fork();
+        asm volatile("rdtsc" : "=a"(end) : : "edx");
+        if (child == 0) {
+            user_exit_task(0);
+        }
+        if (child < 0) {
+            user_exit_task(-1);
+        }
+        total += end - start;
+        user_wait(child);
+    }
+    user_exit_task(total / FORK_BENCH_ITERATIONS);
+}
+
+// prints count / n as "x.yy"
+static void print_per(const char* label, uint32_t count, uint32_t n) {
+    print(label);
+    print_fixed2((uint32_t)udiv64((uint64_t)count * 100, n));
+    print("\n");
+}
+
+/**
+ * Fork latency: the fork system call on its own, and the whole round trip
+ * of fork, child exit and wait (which includes waiting for the scheduler
+ * to run the child). For scale, the cost of copying one page is timed
+ * too: that is what an eager fork would pay for every page.
+ */
+void bench_fork() {
+    vmm_stats_t before, after;
+    vmm_get_stats(&before);
+
+    uint64_t start = rdtsc();
+    task_t* t = create_user_task("forkbench", fork_bench_task);
+    if (t == NULL) {
+        print("out of memory\n");
+        return;
+    }
+    int fork_cycles = wait_task(t->id, NULL);
+    uint64_t elapsed = rdtsc() - start;
+    vmm_get_stats(&after);
+
+    if (fork_cycles == -1) {
+        print("fork failed\n");
+        return;
+    }
+    uint32_t forks = after.forks - before.forks;
+    if (forks == 0) {
+        forks = 1;
+    }
+
+    uint32_t src = pmm_alloc_frame();
+    uint32_t dst = pmm_alloc_frame();
+    uint32_t copy_cycles = 0;
+    if (src != 0 && dst != 0) {
+        asm volatile("cli");
+        uint64_t copy_start = rdtsc();
+        memcpy((void*)dst, (void*)src, PAGE_SIZE);
+        copy_cycles = (uint32_t)(rdtsc() - copy_start);
+        asm volatile("sti");
+    }
+    pmm_free_frame(src);
+    pmm_free_frame(dst);
+
+    print_dec32(forks);
+    print(" forks\n");
+    print("fork:               ");
+    print_dec32((uint32_t)fork_cycles);
+    print(" cycles\n");
+    print("fork + exit + wait: ");
+    print_dec32((uint32_t)udiv64(elapsed, forks));
+    print(" cycles\n");
+    print_per("pages shared/fork:  ", after.shared_pages - before.shared_pages, forks);
+    print_per("pages copied/fork:  ", after.copied_pages - before.copied_pages, forks);
+    print_per("COW copies/fork:    ", after.cow_copies - before.cow_copies, forks);
+    print("page copy:          ");
+    print_dec32(copy_cycles);
+    print(" cycles\n");
+}
+
+// does nothing: the scheduler benchmark only creates, queues and reaps these
+static void sched_bench_task(int _tid) {
+}
+
+/**
+ * Scheduler decision time as the task count grows. Extra kernel tasks are
+ * created and blocked; then, with interrupts off, half of them are made
+ * READY and the scheduler's decision (pick the next task, requeue it at
+ * the back, as a timer tick does) is timed SCHED_BENCH_PICKS times. The
+ * tasks then run to their (immediate) end and are freed. The scheduler is
+ * limited to this (the boot) CPU meanwhile, so what is timed is one CPU's
+ * queues: no stealing from other CPUs, and no IPIs to idle ones.
+ */
+void bench_sched() {
+    static const int counts[] = {0, 8, 16, 32, SCHED_BENCH_MAX_TASKS};
+    task_t* tasks[SCHED_BENCH_MAX_TASKS];
+    uint32_t saved = sched_get_cpus();
+    sched_set_cpus(1);
+
+    for (uint32_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        int n = 0;
+        while (n < counts[c]) {
+            task_t* t = create_task("schedbench", sched_bench_task);
+            if (t == NULL) {
+                break;
+            }
+            set_task_state(t->id, BLOCKED);
+            tasks[n++] = t;
+        }
+
+        uint64_t total = 0;
+        uint32_t max = 0;
+        asm volatile("cli");
+        for (int i = 0; i < n / 2; i++) {
+            set_task_state(tasks[i]->id, READY);
+        }
+        for (int i = 0; i < SCHED_BENCH_PICKS; i++) {
+            uint64_t start = rdtsc();
+            task_t* next = sched_pick();
+            sched_enqueue(next);
+            uint32_t cycles = (uint32_t)(rdtsc() - start);
+            total += cycles;
+            if (cycles > max) {
+                max = cycles;
+            }
+        }
+        for (int i = 0; i < n / 2; i++) {
+            set_task_state(tasks[i]->id, BLOCKED);
+        }
+        asm volatile("sti");
+
+        print_dec32(n);
+        print(" extra tasks (");
+        print_dec32(n / 2);
+        print(" ready): avg ");
+        print_dec32((uint32_t)udiv64(total, SCHED_BENCH_PICKS));
+        print("  max ");
+        print_dec32(max);
+        print(" cycles\n");
+
+        for (int i = 0; i < n; i++) {
+            set_task_state(tasks[i]->id, READY);
+        }
+        for (int i = 0; i < n; i++) {
+            wait_task(tasks[i]->id, NULL);
+        }
+    }
+    sched_set_cpus(saved);
+}
+
+// a fixed amount of work in ring 3, where CPUs don't take turns
+USER_TEXT _Noreturn
+static void smp_bench_task(int _tid) {
+    for (int i = 0; i < SMP_BENCH_LOOPS; i++);
+    user_exit_task(0);
+}
+
+/**
+ * Throughput as CPUs are added: SMP_BENCH_TASKS user tasks, each with the
+ * same busy loop, are started on this CPU with the scheduler limited to
+ * the first 1, 2, ... online CPUs, and timed until they have all ended.
+ * The other CPUs get their share by stealing.
+ */
+void bench_smp() {
+    uint32_t online = smp_cpus_online();
+    uint32_t saved = sched_get_cpus();
+    uint32_t base = 0;
+
+    for (uint32_t n = 1; n <= online; n++) {
+        sched_set_cpus(n);
+        uint32_t steals = 0;
+        for (uint32_t i = 0; i < online; i++) {
+            steals -= cpus[i].steals;
+        }
+
+        task_t* tasks[SMP_BENCH_TASKS];
+        int n_tasks = 0;
+        uint32_t start = get_ticks();
+        while (n_tasks < SMP_BENCH_TASKS) {
+            task_t* t = create_user_task("smpbench", smp_bench_task);
+            if (t == NULL) {
+                break;
+            }
+            tasks[n_tasks++] = t;
+        }
+        for (int i = 0; i < n_tasks; i++) {
+            wait_task(tasks[i]->id, NULL);
+        }
+        uint32_t elapsed = get_ticks() - start;
+        for (uint32_t i = 0; i < online; i++) {
+            steals += cpus[i].steals;
+        }
+
+        if (elapsed == 0) {
+            elapsed = 1;
+        }
+        if (n == 1) {
+            base = elapsed;
+        }
+        print_dec32(n);
+        print(" CPU(s): ");
+        print_dec32(n_tasks);
+        print(" tasks in ");
+        print_dec32(elapsed);
+        print(" ticks, speedup ");
+        print_fixed2(base * 100 / elapsed);
+        print(", ");
+        print_dec32(steals);
+        print(" steals\n");
+    }
+    sched_set_cpus(saved);
+}
+
+/**
+ * The system call benchmark's tasks, in ring 3: the null system call over
+ * and over through one entry method each, with the average round trip in
+ * cycles as the exit code.
+ */
+USER_TEXT _Noreturn
+static void int80_bench_task(int _tid) {
+    uint32_t start, end;
+    asm volatile("rdtsc" : "=a"(start) : : "edx");
+    for (int i = 0; i < SYSCALL_BENCH_ITERATIONS; i++) {
+        syscall_int80(SYS_NULL, 0, 0, 0, 0);
+    }
+    asm volatile("rdtsc" : "=a"(end) : : "edx");
+    user_exit_task((end - start) / SYSCALL_BENCH_ITERATIONS);
+}
+
+USER_TEXT _Noreturn
+static void sysenter_bench_task(int _tid) {
+    uint32_t start, end;
+    asm volatile("rdtsc" : "=a"(start) : : "edx");
+    for (int i = 0; i < SYSCALL_BENCH_ITERATIONS; i++) {
+        syscall_sysenter(SYS_NULL, 0, 0, 0, 0);
+    }
+    asm volatile("rdtsc" : "=a"(end) : : "edx");
+    user_exit_task((end - start) / SYSCALL_BENCH_ITERATIONS);
+}
+
+static void bench_syscall_method(const char* label, void (entry)(int)) {
+    task_t* t = create_user_task("syscallbench", entry);
+    if (t == NULL) {
+        print("out of memory\n");
+        return;
+    }
+    int cycles = wait_task(t->id, NULL);
+    print(label);
+    print_dec32((uint32_t)cycles);
+    print(" cycles\n");
+}
+
+/**
+ * System call round trip from ring 3: a call that does nothing, entered
+ * with INT 0x80 (and left with IRET) or with SYSENTER (and SYSEXIT). The
+ * work in between (the common stub, the kernel lock, the dispatch) is
+ * the same for both, so the difference is the cost of the entry and exit.
+ */
+void bench_syscall() {
+    bench_syscall_method("INT 0x80 / IRET:    ", int80_bench_task);
+    if (syscall_use_sysenter) {
+        bench_syscall_method("SYSENTER / SYSEXIT: ", sysenter_bench_task);
+    } else {
+        print("SYSENTER / SYSEXIT: not supported by this CPU\n");
+    }
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+void bench_ata();
+void bench_pmm();
+void bench_heap();
+void bench_fork();
+void bench_sched();
+void bench_smp();
+void bench_syscall();
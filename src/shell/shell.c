@@ -4,18 +4,167 @@
 
 #include <stddef.h>
 #include "shell.h"
+#include "bench.h"
+#include "arch_x86/cpu.h"
 #include "arch_x86/port.h"
 #include "device/console.h"
+#include "device/pic.h"
+#include "device/pit.h"
+#include "kernel/bcache.h"
+#include "kernel/kmalloc.h"
 #include "kernel/loader.h"
+#include "kernel/pmm.h"
+#include "kernel/scheduler.h"
+#include "kernel/slab.h"
+#include "kernel/smp.h"
+#include "kernel/spinlock.h"
 #include "kernel/task.h"
+#include "kernel/vmm.h"
 #include "lib/util.h"
 
+// keystroke-to-echo latency, from the keyboard interrupt to print_char
+static uint32_t key_count;
+static uint32_t key_ticks_total;
+static uint32_t key_ticks_max;
+static uint64_t key_cycles_total;
+
+// keys taken from the keyboard buffer but not yet read (a pasted burst
+// comes out of the buffer in one go)
+static char pending[QUEUE_MAX_ITEMS];
+static uint32_t n_pending;
+static uint32_t next_pending;
+
 char shell_read_char() {
-    char ch = bq_dequeue(get_current_task()->keybuf);
+    blocking_queue_t* keybuf = get_current_task()->keybuf;
+    if (next_pending == n_pending) {
+        n_pending = bq_dequeue_batch(keybuf, pending, sizeof(pending));
+        next_pending = 0;
+    }
+    char ch = pending[next_pending++];
     print_char(ch);
+
+    // only the most recent key's arrival is known; skip typed-ahead keys
+    if (next_pending == n_pending && bq_is_empty(keybuf)) {
+        uint64_t arrived_tsc;
+        uint32_t ticks = get_ticks() - last_key_time(&arrived_tsc);
+        key_count++;
+        key_ticks_total += ticks;
+        key_cycles_total += rdtsc() - arrived_tsc;
+        if (ticks > key_ticks_max) {
+            key_ticks_max = ticks;
+        }
+    }
     return ch;
 }
 
+void print_key_latency() {
+    if (key_count == 0) {
+        print("no keys yet\n");
+        return;
+    }
+    print_dec32(key_count);
+    print(" keys, avg ");
+    print_dec32(key_ticks_total * 100 / key_count / 100);
+    print(".");
+    uint32_t frac = key_ticks_total * 100 / key_count % 100;
+    if (frac < 10) {
+        print("0");
+    }
+    print_dec32(frac);
+    print(" ticks (");
+    print_dec32((uint32_t)udiv64(key_cycles_total, key_count));
+    print(" cycles), max ");
+    print_dec32(key_ticks_max);
+    print(" ticks\n");
+    uint32_t dropped = get_current_task()->keybuf->dropped;
+    if (dropped > 0) {
+        print_dec32(dropped);
+        print(" keys dropped (buffer full)\n");
+    }
+}
+
+void print_timer_stats() {
+    timer_stats_t stats;
+    pit_get_stats(&stats);
+    print_dec32(stats.ticks);
+    print(" ticks, ");
+    print_dec32(stats.interrupts);
+    print(" timer interrupts\n");
+    print_dec32(stats.avoided);
+    print(" ticks without an interrupt, in ");
+    print_dec32(stats.oneshots);
+    print(" one-shots\n");
+}
+
+static void print_irq_latency(_Bool apic) {
+    irq_latency_t l;
+    irq_get_latency(apic, &l);
+    print(apic ? "apic: " : "8259: ");
+    print_dec32(l.count);
+    print(" irqs");
+    if (l.count > 0) {
+        print(", avg ");
+        print_dec32((uint32_t)udiv64(l.cycles, l.count));
+        print(" cycles, max ");
+        print_dec32(l.max);
+    }
+    print("\n");
+}
+
+void print_irq_stats() {
+    print("irqs through the ");
+    print(irq_apic_active() ? "IO-APIC" : "8259 PICs");
+    print("; entry-to-handler latency:\n");
+    print_irq_latency(0);
+    print_irq_latency(1);
+}
+
+void print_cpu_stats() {
+    uint32_t online = smp_cpus_online();
+    print_dec32(online);
+    print(" CPU(s) online, ");
+    print_dec32(sched_get_cpus());
+    print(" taking tasks\n");
+    for (uint32_t i = 0; i < online; i++) {
+        cpu_t* cpu = &cpus[i];
+        print("cpu");
+        print_dec32(i);
+        print(" (APIC ");
+        print_dec32(cpu->apic_id);
+        print("): running ");
+        print(cpu->current->name);
+        print(", ");
+        print_dec32(cpu->nr_queued);
+        print(" movable queued, ");
+        print_dec32(cpu->steals);
+        print(" steals\n");
+    }
+}
+
+void print_lock_stats() {
+    for (lock_stats_t* l = lock_stats_first(); l != NULL; l = l->next) {
+        print(l->name);
+        print(": ");
+        print_dec32(l->acquired);
+        print(" taken, ");
+        print_dec32(l->contended);
+        print(" waited");
+        if (l->contended > 0) {
+            print(" (avg ");
+            print_dec32((uint32_t)udiv64(l->wait_cycles, l->contended));
+            print(" cycles)");
+        }
+        if (l->acquired > 0) {
+            print(", held avg ");
+            print_dec32((uint32_t)udiv64(l->hold_cycles, l->acquired));
+            print(" max ");
+            print_dec32(l->max_hold);
+            print(" cycles");
+        }
+        print("\n");
+    }
+}
+
 void shell_read_line(char buf[], size_t size) {
     int i = 0;
     char ch;
@@ -31,12 +180,31 @@ void shell_read_line(char buf[], size_t size) {
 
 void print_help() {
     print("Available commands:\n");
-    print("  help     - Show this help message\n");
-    print("  about    - Show system information\n");
-    print("  tasks    - List all tasks\n");
-    print("  task_a   - Run sample task A\n");
-    print("  task_b   - Run sample task B\n");
-    print("  quit     - Shutdown the system\n");
+    print("  help        - Show this help message\n");
+    print("  about       - Show system information\n");
+    print("  tasks       - List all tasks\n");
+    print("  cache       - Show block cache statistics\n");
+    print("  mem         - Show physical memory and heap usage\n");
+    print("  bench ata   - Compare disk transfer modes (poll/IRQ/DMA)\n");
+    print("  bench pmm   - Time frame allocation and free\n");
+    print("  bench heap  - Stress kmalloc/kfree and show latency percentiles\n");
+    print("  bench fork  - Time copy-on-write fork + exit\n");
+    print("  bench sched - Time scheduler decisions as tasks are added\n");
+    print("  bench smp   - Time a CPU-bound batch of tasks on 1..N CPUs\n");
+    print("  bench syscall - Time a null system call with INT 0x80 and SYSENTER\n");
+    print("  slabs       - Show kernel object cache usage\n");
+    print("  keys        - Show keystroke-to-echo latency\n");
+    print("  timer       - Show timer interrupts and ticks skipped when idle\n");
+    print("  sleep       - Sleep for one second\n");
+    print("  irq         - Show IRQ entry-to-handler latency\n");
+    print("  irq pic     - Deliver IRQs through the 8259 PICs (and PIT)\n");
+    print("  irq apic    - Deliver IRQs through the APICs (and APIC timer)\n");
+    print("  cpus        - Show each CPU's task, queue and steals\n");
+    print("  locks       - Show lock contention and hold times\n");
+    print("  task_a      - Run sample task A\n");
+    print("  task_b      - Run sample task B\n");
+    print("  <task> &    - Run a task in the background\n");
+    print("  quit        - Shutdown the system\n");
 }
 
 void print_about() {
@@ -44,21 +212,36 @@ void print_about() {
     print("Version 1.0\n");
 }
 
+// demand paging cost of a task: page faults and their average latency
+static void print_faults(uint32_t faults, uint64_t cycles) {
+    print_dec32(faults);
+    print(" faults");
+    if (faults > 0) {
+        print(" (avg ");
+        print_dec32((uint32_t)udiv64(cycles, faults));
+        print(" cycles)");
+    }
+}
+
 void print_task_list() {
-    task_t* tasks;
-    int n_tasks = get_task_list(&tasks);
+    task_t* tasks[MAX_TASKS];
+    int n_tasks = get_task_list(tasks, MAX_TASKS);
     for (int i = 0; i < n_tasks; i++) {
-        print_hex8(tasks[i].id);
+        print_hex8(tasks[i]->id);
         print(" ");
-        if (tasks[i].privilege == 0) {
+        if (tasks[i]->privilege == 0) {
             print("(K)");
         } else {
             print("(U)");
         }
         print(" ");
-        print(tasks[i].name);
+        print(tasks[i]->name);
+        print(" p");
+        print_dec32(tasks[i]->priority);
+        print(" cpu");
+        print_dec32(tasks[i]->cpu);
         print(" ");
-        switch (tasks[i].state) {
+        switch (tasks[i]->state) {
             case NEW:
                 print("NEW");
                 break;
@@ -75,10 +258,144 @@ void print_task_list() {
                 print("TERMINATED");
                 break;
         }
+        print(" ");
+        print_dec32(tasks[i]->ticks);
+        print(" ticks, stack ");
+        print_dec32(task_kstack_used(tasks[i]));
+        if (tasks[i]->privilege != 0) {
+            print("+");
+            print_dec32(tasks[i]->ustack_size);
+            print(" B, ");
+            print_faults(tasks[i]->faults, tasks[i]->fault_cycles);
+        } else {
+            print(" B");
+        }
         print("\n");
     }
 }
 
+void print_cache_stats() {
+    bcache_stats_t stats;
+    bcache_get_stats(&stats);
+    print("hits: ");
+    print_dec32(stats.hits);
+    print("  misses: ");
+    print_dec32(stats.misses);
+    print("  evictions: ");
+    print_dec32(stats.evictions);
+    print("  disk reads: ");
+    print_dec32(stats.disk_reads);
+    print("\nread-ahead: ");
+    print_dec32(stats.ra_reads);
+    print(" reads, ");
+    print_dec32(stats.ra_sectors);
+    print(" sectors, ");
+    print_dec32(stats.ra_hits);
+    print(" hits\n");
+}
+
+/**
+ * Run a program from disk as a user task and wait for it to finish, or
+ * leave it running in the background if the command ends with '&'.
+ */
+int run_program(const char* cmd) {
+    char name[32];
+    strncpy(name, cmd, sizeof(name));
+    name[sizeof(name) - 1] = 0;
+
+    _Bool background = 0;
+    int len = strlen(name);
+    if (len > 0 && name[len - 1] == '&') {
+        background = 1;
+        name[--len] = 0;
+        while (len > 0 && name[len - 1] == ' ') {
+            name[--len] = 0;
+        }
+    }
+
+    int tid = spawn(name);
+    if (tid < 0) {
+        return -1;
+    }
+
+    if (background) {
+        detach_task(tid);
+        print("[");
+        print_hex8(tid);
+        print("] ");
+        print(name);
+    } else {
+        task_stats_t stats = {0};
+        wait_task(tid, &stats);
+        if (stats.faults > 0) {
+            print("\n[");
+            print_faults(stats.faults, stats.fault_cycles);
+            print("]");
+        }
+    }
+    return 0;
+}
+
+void print_mem_stats() {
+    pmm_stats_t stats;
+    pmm_get_stats(&stats);
+    print("total: ");
+    print_dec32(stats.total_frames * (FRAME_SIZE / 1024));
+    print(" KB  free: ");
+    print_dec32(stats.free_frames * (FRAME_SIZE / 1024));
+    print(" KB\nfree blocks by order:");
+    for (int k = 0; k <= PMM_MAX_ORDER; k++) {
+        print(" ");
+        print_dec32(stats.free_blocks[k]);
+    }
+    print("\n");
+
+    kmalloc_stats_t heap;
+    kmalloc_get_stats(&heap);
+    print("heap: ");
+    print_dec32(heap.bytes_in_use / 1024);
+    print(" KB in use, ");
+    print_dec32(heap.arenas);
+    print(" arenas, ");
+    print_dec32(heap.large);
+    print(" large, ");
+    print_dec32(heap.allocs);
+    print(" allocs, ");
+    print_dec32(heap.frees);
+    print(" frees\n");
+
+    vmm_stats_t vm;
+    vmm_get_stats(&vm);
+    print("fork: ");
+    print_dec32(vm.forks);
+    print(" forks, ");
+    print_dec32(vm.shared_pages);
+    print(" pages shared, ");
+    print_dec32(vm.cow_copies);
+    print(" copied on write\n");
+}
+
+void print_slab_stats() {
+    slab_stats_t stats[16];
+    int n = slab_get_stats(stats, 16);
+    for (int i = 0; i < n; i++) {
+        print(stats[i].name);
+        print(": ");
+        print_dec32(stats[i].obj_size);
+        print(" B x ");
+        print_dec32(stats[i].objs_per_slab);
+        print("/slab, ");
+        print_dec32(stats[i].slabs);
+        print(" slabs, ");
+        print_dec32(stats[i].active);
+        print(" active, ");
+        print_dec32(stats[i].allocs);
+        print(" allocs, ");
+        print_dec32(stats[i].frees);
+        print(" frees\n");
+    }
+}
+
 void dispatch_cmd(const char* cmd) {
     if (strcmp(cmd, "help") == 0) {
         print_help();
@@ -89,8 +406,68 @@ void dispatch_cmd(const char* cmd) {
     else if (strcmp(cmd, "tasks") == 0) {
         print_task_list();
     }
+    else if (strcmp(cmd, "cache") == 0) {
+        print_cache_stats();
+    }
+    else if (strcmp(cmd, "mem") == 0) {
+        print_mem_stats();
+    }
+    else if (strcmp(cmd, "slabs") == 0) {
+        print_slab_stats();
+    }
+    else if (strcmp(cmd, "keys") == 0) {
+        print_key_latency();
+    }
+    else if (strcmp(cmd, "timer") == 0) {
+        print_timer_stats();
+    }
+    else if (strcmp(cmd, "sleep") == 0) {
+        uint32_t start = get_ticks();
+        sleep(1000);
+        print("slept ");
+        print_dec32(get_ticks() - start);
+        print(" ticks\n");
+    }
+    else if (strcmp(cmd, "irq") == 0) {
+        print_irq_stats();
+    }
+    else if (strcmp(cmd, "irq pic") == 0) {
+        irq_use_apic(0);
+    }
+    else if (strcmp(cmd, "irq apic") == 0) {
+        if (irq_use_apic(1) != 0) {
+            print("no APIC found\n");
+        }
+    }
+    else if (strcmp(cmd, "bench ata") == 0) {
+        bench_ata();
+    }
+    else if (strcmp(cmd, "bench pmm") == 0) {
+        bench_pmm();
+    }
+    else if (strcmp(cmd, "bench heap") == 0) {
+        bench_heap();
+    }
+    else if (strcmp(cmd, "bench fork") == 0) {
+        bench_fork();
+    }
+    else if (strcmp(cmd, "bench sched") == 0) {
+        bench_sched();
+    }
+    else if (strcmp(cmd, "bench smp") == 0) {
+        bench_smp();
+    }
+    else if (strcmp(cmd, "bench syscall") == 0) {
+        bench_syscall();
+    }
+    else if (strcmp(cmd, "cpus") == 0) {
+        print_cpu_stats();
+    }
+    else if (strcmp(cmd, "locks") == 0) {
+        print_lock_stats();
+    }
     else {
-        if (exec(cmd) != 0) {
+        if (run_program(cmd) != 0) {
             print("Unknown command. Type 'help' for available commands.\n");
         }
     }
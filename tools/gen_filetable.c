@@ -1,14 +1,22 @@
 /**
  * Generate a file table for the OS image
- * 
- * Usage: gen_filetable <output_file> <name1:sector1> <name2:sector2> ...
- * 
- * File table format (512 bytes):
- *   - 4 bytes: number of entries (little-endian)
- *   - For each entry (24 bytes):
+ *
+ * Usage: gen_filetable <output_file> <name1:sector1:size1> <name2:sector2:size2> ...
+ *
+ * File table format (4 sectors, all fields little-endian):
+ *   - Header (16 bytes):
+ *     - 4 bytes: magic ("BFFT")
+ *     - 4 bytes: number of entries
+ *     - 4 bytes: number of index slots (a power of two)
+ *     - 4 bytes: size of the table in sectors
+ *   - Index (INDEX_SLOTS x 2 bytes): open-addressed hash index; each slot
+ *     holds an entry number + 1, or 0 if empty. An entry lives at the first
+ *     free slot at or after (hash & (INDEX_SLOTS - 1)), probing linearly.
+ *   - Entries (28 bytes each):
  *     - 16 bytes: null-terminated name
- *     - 4 bytes: sector number (little-endian)
- *     - 4 bytes: size in sectors (little-endian, currently always 1)
+ *     - 4 bytes: FNV-1a hash of the name
+ *     - 4 bytes: sector number
+ *     - 4 bytes: size in sectors
  *   - Remaining bytes: zero-padded
  */
 
@@ -18,13 +26,42 @@
 #include <stdint.h>
 
 #define SECTOR_SIZE 512
+#define TABLE_SECTORS 4
+#define TABLE_SIZE (TABLE_SECTORS * SECTOR_SIZE)
+#define MAGIC 0x54464642  // "BFFT"
+#define HEADER_SIZE 16
+#define INDEX_SLOTS 128
+#define INDEX_OFFSET HEADER_SIZE
+#define ENTRIES_OFFSET (INDEX_OFFSET + INDEX_SLOTS * 2)
 #define NAME_SIZE 16
-#define ENTRY_SIZE 24
-#define MAX_ENTRIES ((SECTOR_SIZE - 4) / ENTRY_SIZE)
+#define ENTRY_SIZE 28
+#define MAX_ENTRIES ((TABLE_SIZE - ENTRIES_OFFSET) / ENTRY_SIZE)
+
+static void put16(uint8_t* p, uint16_t v) {
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+}
+
+static void put32(uint8_t* p, uint32_t v) {
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+    p[3] = (v >> 24) & 0xFF;
+}
+
+// must match the kernel's loader
+static uint32_t fnv1a(const char* s) {
+    uint32_t h = 2166136261u;
+    while (*s) {
+        h ^= (uint8_t)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
 
 int main(int argc, char* argv[]) {
     if (argc < 2) {
-        fprintf(stderr, "Usage: %s <output_file> [name:sector ...]\n", argv[0]);
+        fprintf(stderr, "Usage: %s <output_file> [name:sector:size ...]\n", argv[0]);
         return 1;
     }
 
@@ -36,51 +73,64 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
-    // Create a 512-byte buffer, zero-initialized
-    uint8_t buffer[SECTOR_SIZE] = {0};
+    // Create the table buffer, zero-initialized
+    uint8_t buffer[TABLE_SIZE] = {0};
 
-    // Write number of entries (4 bytes, little-endian)
-    buffer[0] = num_entries & 0xFF;
-    buffer[1] = (num_entries >> 8) & 0xFF;
-    buffer[2] = (num_entries >> 16) & 0xFF;
-    buffer[3] = (num_entries >> 24) & 0xFF;
+    // Write header
+    put32(&buffer[0], MAGIC);
+    put32(&buffer[4], num_entries);
+    put32(&buffer[8], INDEX_SLOTS);
+    put32(&buffer[12], TABLE_SECTORS);
 
     // Write each entry
     for (int i = 0; i < num_entries; i++) {
         char* arg = argv[i + 2];
         char* colon = strchr(arg, ':');
-        if (!colon) {
-            fprintf(stderr, "Invalid entry format: %s (expected name:sector)\n", arg);
+        char* colon2 = colon ? strchr(colon + 1, ':') : NULL;
+        if (!colon || !colon2) {
+            fprintf(stderr, "Invalid entry format: %s (expected name:sector:size)\n", arg);
             return 1;
         }
 
-        // Parse name and sector
+        // Parse name, sector and size
         *colon = '\0';
+        *colon2 = '\0';
         const char* name = arg;
         uint32_t sector = atoi(colon + 1);
+        uint32_t size = atoi(colon2 + 1);
+
+        if (size == 0) {
+            fprintf(stderr, "Invalid size for %s\n", name);
+            return 1;
+        }
 
         if (strlen(name) >= NAME_SIZE) {
             fprintf(stderr, "Name too long: %s (max %d chars)\n", name, NAME_SIZE - 1);
             return 1;
         }
 
+        // Find the entry's index slot, rejecting duplicates on the way
+        uint32_t hash = fnv1a(name);
+        uint32_t slot = hash & (INDEX_SLOTS - 1);
+        uint16_t used;
+        while ((used = buffer[INDEX_OFFSET + slot * 2] | buffer[INDEX_OFFSET + slot * 2 + 1] << 8) != 0) {
+            if (strcmp((char*)&buffer[ENTRIES_OFFSET + (used - 1) * ENTRY_SIZE], name) == 0) {
+                fprintf(stderr, "Duplicate entry: %s\n", name);
+                return 1;
+            }
+            slot = (slot + 1) & (INDEX_SLOTS - 1);
+        }
+        put16(&buffer[INDEX_OFFSET + slot * 2], i + 1);
+
         // Calculate offset for this entry
-        int offset = 4 + (i * ENTRY_SIZE);
+        int offset = ENTRIES_OFFSET + (i * ENTRY_SIZE);
 
         // Write name (16 bytes, null-padded)
         strncpy((char*)&buffer[offset], name, NAME_SIZE);
 
-        // Write sector number (4 bytes, little-endian)
-        buffer[offset + 16] = sector & 0xFF;
-        buffer[offset + 17] = (sector >> 8) & 0xFF;
-        buffer[offset + 18] = (sector >> 16) & 0xFF;
-        buffer[offset + 19] = (sector >> 24) & 0xFF;
-
-        // Write size (4 bytes, little-endian) - always 1 for now
-        buffer[offset + 20] = 1;
-        buffer[offset + 21] = 0;
-        buffer[offset + 22] = 0;
-        buffer[offset + 23] = 0;
+        put32(&buffer[offset + 16], hash);
+        put32(&buffer[offset + 20], sector);
+        put32(&buffer[offset + 24], size);
     }
 
     // Write to file
@@ -90,7 +140,7 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
-    if (fwrite(buffer, 1, SECTOR_SIZE, f) != SECTOR_SIZE) {
+    if (fwrite(buffer, 1, TABLE_SIZE, f) != TABLE_SIZE) {
         perror("Failed to write output file");
         fclose(f);
         return 1;
@@ -99,4 +149,3 @@ int main(int argc, char* argv[]) {
     fclose(f);
     return 0;
 }
-